@@ -57,6 +57,46 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void DelUser(const UserMembIter& membiter);
 
+	/** A NAMES list built by UserList() for one cache key
+	 */
+	struct NamesCache
+	{
+		/** The nicks, split into lines, without the part of the numeric which identifies the channel
+		 */
+		std::vector<std::string> lines;
+
+		/** The number of members, counted from the start of userlist, which are in lines.
+		 * Members are only ever added to the end of userlist, so the ones which joined
+		 * since the list was built can be appended to it.
+		 */
+		size_t members;
+
+		/** The value of ModeParser::GetPrefixSerial() when the list was built
+		 */
+		unsigned int prefixserial;
+
+		NamesCache() : members(0), prefixserial(0) { }
+	};
+	typedef std::map<std::string, NamesCache> NamesCacheMap;
+
+	/** NAMES lists for users who can see all members, indexed by the key from OnNamesListCacheKey
+	 */
+	NamesCacheMap namescache;
+
+	/** Find the cached NAMES list which can be sent to a user
+	 * @param user The user to send the list to, must be able to see all members
+	 * @return The cache to use, or NULL if a module does not allow caching the list for this user
+	 */
+	NamesCache* GetNamesCache(User* user);
+
+	/** Format members of this channel for a NAMES list
+	 * @param user The user who the list is for
+	 * @param first The first member to add, as an iterator into userlist
+	 * @param showinvisible True to include users who are +i
+	 * @param lines The lines to add the members to
+	 */
+	void BuildNamesList(User* user, UserMembCIter first, bool showinvisible, std::vector<std::string>& lines);
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -294,6 +334,12 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void UserList(User *user);
 
+	/** Discard the cached NAMES lists of this channel. This is done when a member leaves,
+	 * changes their prefix, nick, ident or displayed host. Modules which change how a
+	 * member is shown in a cached list must call it.
+	 */
+	void InvalidateNamesCache() { namescache.clear(); }
+
 	/** Get the value of a users prefix on this channel.
 	 * @param user The user to look up
 	 * @return The module or core-defined value of the users prefix.
@@ -30,6 +30,29 @@
 class CoreExport CommandParser
 {
  private:
+	/** Storage used by ProcessCommand() to parse a line. It is kept between
+	 * calls so that parsing a line reuses the memory allocated for earlier lines.
+	 */
+	struct ParseState
+	{
+		/** The command name, in uppercase */
+		std::string command;
+
+		/** The tokens of the line, pointing into the line itself */
+		std::vector<irc::string_view> tokens;
+
+		/** The parameters of the command */
+		std::vector<std::string> params;
+	};
+
+	/** One ParseState for each level of ProcessCommand() recursion, a command handler
+	 * may cause another line to be processed before it returns.
+	 */
+	std::deque<ParseState> parsestates;
+
+	/** Number of ProcessCommand() calls currently in progress */
+	size_t parsedepth;
+
 	/** Process a command from a user.
 	 * @param user The user to parse the command for
 	 * @param cmd The command string to process
@@ -160,9 +160,59 @@ struct CommandLineConf
 	char** argv;
 };
 
+/** Numbers the names of oper privileges or oper commands, so that the permissions
+ * of an OperInfo can be stored as bits. A name is given a number the first time
+ * it is seen and keeps it until shutdown, including across rehashes.
+ */
+class CoreExport PermissionIndex
+{
+	typedef TR1NS::unordered_map<std::string, unsigned int> IDMap;
+
+	/** Numbers of all names seen so far */
+	IDMap ids;
+
+ public:
+	/** Returned by Find() for names which have not been given a number */
+	static const unsigned int NONE = UINT_MAX;
+
+	/** Get the number of a name, giving it a new number if it has none yet
+	 * @param name The name to look up
+	 * @return The number of the name
+	 */
+	unsigned int GetID(const std::string& name);
+
+	/** Get the number of a name without giving it one
+	 * @param name The name to look up
+	 * @return The number of the name, or NONE if it has none
+	 */
+	unsigned int Find(const std::string& name) const
+	{
+		IDMap::const_iterator it = ids.find(name);
+		return (it != ids.end() ? it->second : NONE);
+	}
+};
+
 class CoreExport OperInfo : public refcountbase
 {
+	/** Bits of the privileges granted by the class blocks, indexed by PrivIndex number */
+	std::vector<bool> PrivBits;
+
+	/** Bits of the commands granted by the class blocks, indexed by CommandIndex number */
+	std::vector<bool> CommandBits;
+
+	/** True if the class blocks grant every privilege */
+	bool AllPrivs;
+
+	/** True if the class blocks grant every command */
+	bool AllCommands;
+
  public:
+	/** Numbers of all privilege names */
+	static PermissionIndex PrivIndex;
+
+	/** Numbers of all oper command names */
+	static PermissionIndex CommandIndex;
+
 	std::set<std::string> AllowedOperCommands;
 	std::set<std::string> AllowedPrivs;
 
@@ -181,9 +231,83 @@ class CoreExport OperInfo : public refcountbase
 	/** Name of the oper type; i.e. the one shown in WHOIS */
 	std::string name;
 
+	OperInfo() : AllPrivs(false), AllCommands(false) { }
+
 	/** Get a configuration item, searching in the oper, type, and class blocks (in that order) */
 	std::string getConfig(const std::string& key);
 	void init();
+
+	/** Check whether the class blocks grant a privilege, only valid after init()
+	 * @param id The number of the privilege in PrivIndex
+	 */
+	bool HasPriv(unsigned int id) const { return (AllPrivs || ((id < PrivBits.size()) && (PrivBits[id]))); }
+
+	/** Check whether the class blocks grant a command, only valid after init()
+	 * @param id The number of the command in CommandIndex, may be PermissionIndex::NONE
+	 */
+	bool HasCommand(unsigned int id) const { return (AllCommands || ((id < CommandBits.size()) && (CommandBits[id]))); }
+};
+
+/** The name of an oper privilege and its number in OperInfo::PrivIndex. Code which
+ * checks the same privilege often should keep one of these rather than pass the name
+ * to User::HasPrivPermission() each time, so that the check is a bit test.
+ */
+class CoreExport PrivilegeID
+{
+	/** The name of the privilege */
+	const std::string name;
+
+	/** The number of the privilege, looked up on first use */
+	mutable unsigned int id;
+
+ public:
+	PrivilegeID(const std::string& privname) : name(privname), id(PermissionIndex::NONE) { }
+
+	/** Get the name of the privilege */
+	const std::string& GetName() const { return name; }
+
+	/** Get the number of the privilege in OperInfo::PrivIndex */
+	unsigned int GetID() const
+	{
+		if (id == PermissionIndex::NONE)
+			id = OperInfo::PrivIndex.GetID(name);
+		return id;
+	}
+};
+
+/** Finds the connect classes which may match a user without checking the host
+ * mask of every class. It is built from the class list whenever the config is
+ * read, and only narrows the list down: the candidates must still be checked
+ * in full by LocalUser::SetClass().
+ */
+class CoreExport ConnectClassIndex
+{
+	/** Positions of the classes whose host mask has no wildcards
+	 */
+	HostIndex<size_t> hosts;
+
+	/** Positions of the classes which have to be checked against every user,
+	 * keyed by the port they require, or 0 if they allow any port
+	 */
+	std::map<int, std::vector<size_t> > wildcards;
+
+	/** The port each class requires, or 0 if it allows any port
+	 */
+	std::vector<int> ports;
+
+ public:
+	/** Rebuild the index from a list of connect classes
+	 * @param classes The connect classes, in the order they are checked in
+	 */
+	void Build(const ClassVector& classes);
+
+	/** Get the positions of the classes which may match a user, in the order
+	 * they have to be checked in. Named classes are always included so that
+	 * modules may still pick them.
+	 * @param user The user to look up
+	 * @param out The list to fill in
+	 */
+	void FindCandidates(LocalUser* user, std::vector<size_t>& out) const;
 };
 
 /** This class holds the bulk of the runtime configuration for the ircd.
@@ -399,6 +523,11 @@ class CoreExport ServerConfig
 	 */
 	int MaxConn;
 
+	/** The maximum number of batches of socket events handled
+	 * in a row before the main loop does its other work.
+	 */
+	unsigned int EventBatches;
+
 	/** If we should check for clones during CheckClass() in AddUser()
 	 * Setting this to false allows to not trigger on maxclones for users
 	 * that may belong to another class after DNS-lookup is complete.
@@ -455,6 +584,10 @@ class CoreExport ServerConfig
 	 */
 	ClassVector Classes;
 
+	/** Index of the connect classes by host mask and port
+	 */
+	ConnectClassIndex ClassIndex;
+
 	/** STATS characters in this list are available
 	 * only to operators.
 	 */
@@ -38,6 +38,10 @@ class CoreExport CullList
 	void AddItem(classbase* item) { list.push_back(item); }
 	void AddSQItem(LocalUser* item) { SQlist.push_back(item); }
 
+	/** Check whether there is anything waiting to be culled
+	 */
+	bool empty() const { return list.empty() && SQlist.empty(); }
+
 	/** Applies the cull list (deletes the contents)
 	 */
 	void Apply();
@@ -52,6 +56,10 @@ class CoreExport ActionList
 	 */
 	void AddAction(HandlerBase0<void>* item) { list.push_back(item); }
 
+	/** Check whether there are any actions waiting to be run
+	 */
+	bool empty() const { return list.empty(); }
+
 	/** Runs the items
 	 */
 	void Run();
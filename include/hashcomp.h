@@ -97,6 +97,58 @@ template<typename T> const T& SearchAndReplace(T& text, const T& pattern, const
  */
 namespace irc
 {
+	/** A non-owning view of a sequence of characters, such as a line in a receive
+	 * queue or a token in a line. It does not copy the characters; the storage it
+	 * refers to must stay valid and unmodified for as long as the view is used.
+	 */
+	class string_view
+	{
+		/** First character of the view */
+		const char* ptr;
+
+		/** Number of characters in the view */
+		size_t len;
+
+	 public:
+		string_view() : ptr(NULL), len(0) { }
+		string_view(const char* data, size_t length) : ptr(data), len(length) { }
+		string_view(const std::string& str) : ptr(str.data()), len(str.length()) { }
+
+		const char* data() const { return ptr; }
+		size_t length() const { return len; }
+		size_t size() const { return len; }
+		bool empty() const { return (len == 0); }
+		const char* begin() const { return ptr; }
+		const char* end() const { return ptr + len; }
+		char operator[](size_t pos) const { return ptr[pos]; }
+
+		/** Find the first occurrence of a character at or after the given position
+		 * @return The position of the character or std::string::npos if it was not found
+		 */
+		size_t find(char c, size_t pos = 0) const
+		{
+			if (pos >= len)
+				return std::string::npos;
+			const char* found = static_cast<const char*>(memchr(ptr + pos, c, len - pos));
+			return (found ? found - ptr : std::string::npos);
+		}
+
+		/** Get a view of part of this view, limited to the characters which exist */
+		string_view substr(size_t pos, size_t count = std::string::npos) const
+		{
+			if (pos > len)
+				pos = len;
+			if (count > len - pos)
+				count = len - pos;
+			return string_view(ptr + pos, count);
+		}
+
+		/** Copy the characters in this view into a new std::string */
+		std::string str() const { return std::string(ptr, len); }
+
+		bool operator==(const string_view& other) const { return ((len == other.len) && (!len || !memcmp(ptr, other.ptr, len))); }
+		bool operator!=(const string_view& other) const { return !(*this == other); }
+	};
 
 	/** This class returns true if two strings match.
 	 * Case sensitivity is ignored, and the RFC 'character set'
@@ -0,0 +1,235 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Values, such as xlines or connect classes, stored under a host mask without
+ * wildcards, so the values whose mask may match a host or IP address can be
+ * found without checking every mask. Masks are looked up by the host and IP
+ * address exactly; masks which are CIDR ranges are also looked up by the
+ * address masked to every prefix length which is in use.
+ * Only masks for which IsExactMask() is true may be added.
+ */
+template<typename T>
+class HostIndex
+{
+	/** Values keyed by their exact host mask (folded to lower case), or by the address
+	 * family, prefix length and masked address of their CIDR range
+	 */
+	typedef TR1NS::unordered_multimap<std::string, T> Map;
+
+	Map exact;
+	Map cidrs;
+
+	/** Number of CIDR ranges of each prefix length, for IPv4 and IPv6 respectively
+	 */
+	unsigned int prefixlens[2][129];
+
+	/** Get the key an exact host mask is stored under
+	 */
+	static std::string ExactKey(const std::string& mask)
+	{
+		std::string key(mask);
+		for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+			*i = ascii_case_insensitive_map[(unsigned char)*i];
+		return key;
+	}
+
+	/** Get the key a CIDR range is stored under
+	 */
+	static std::string CIDRKey(const irc::sockets::cidr_mask& cidr)
+	{
+		std::string key(1, static_cast<char>(cidr.type));
+		key.push_back(static_cast<char>(cidr.length));
+		key.append(reinterpret_cast<const char*>(cidr.bits), (cidr.length + 7) / 8);
+		return key;
+	}
+
+	/** Get where the CIDR ranges of an address family are counted in prefixlens
+	 * @param family The address family
+	 * @param pos Will be set to the position of the counters of the family in prefixlens
+	 * @param maxlen Will be set to the largest prefix length of the family
+	 * @return False if ranges of this family can't be indexed
+	 */
+	static bool GetFamily(int family, size_t& pos, unsigned int& maxlen)
+	{
+		pos = (family == AF_INET6);
+		maxlen = (family == AF_INET6 ? 128 : 32);
+		return ((family == AF_INET) || (family == AF_INET6));
+	}
+
+	/** Remove a value from one of the maps
+	 */
+	static void Erase(Map& map, const std::string& key, const T& value)
+	{
+		std::pair<typename Map::iterator, typename Map::iterator> range = map.equal_range(key);
+		for (typename Map::iterator i = range.first; i != range.second; ++i)
+		{
+			if (i->second == value)
+			{
+				map.erase(i);
+				return;
+			}
+		}
+	}
+
+	/** Add all values whose host mask is exactly the given string to a list
+	 */
+	void FindExact(const std::string& host, std::vector<T>& out) const
+	{
+		std::pair<typename Map::const_iterator, typename Map::const_iterator> range = exact.equal_range(ExactKey(host));
+		for (typename Map::const_iterator i = range.first; i != range.second; ++i)
+			out.push_back(i->second);
+	}
+
+	/** Add all values whose CIDR range contains the given address to a list
+	 */
+	void FindCIDR(const irc::sockets::sockaddrs& sa, std::vector<T>& out) const
+	{
+		size_t pos;
+		unsigned int maxlen;
+		if (!GetFamily(sa.sa.sa_family, pos, maxlen))
+			return;
+
+		// Look the address up once for every prefix length that is in use
+		for (unsigned int len = 0; len <= maxlen; len++)
+		{
+			if (!prefixlens[pos][len])
+				continue;
+
+			std::pair<typename Map::const_iterator, typename Map::const_iterator> range = cidrs.equal_range(CIDRKey(irc::sockets::cidr_mask(sa, len)));
+			for (typename Map::const_iterator i = range.first; i != range.second; ++i)
+				out.push_back(i->second);
+		}
+	}
+
+ public:
+	/** Create an empty index
+	 */
+	HostIndex()
+	{
+		clear();
+	}
+
+	/** Check whether a host mask can only ever match a host or IP which is
+	 * exactly the same as it. The characters allowed here are folded the
+	 * same way by every national case mapping.
+	 * @param mask The host mask to check
+	 * @return True if the mask may be added to the index
+	 */
+	static bool IsExactMask(const std::string& mask)
+	{
+		if (mask.empty())
+			return false;
+
+		for (std::string::const_iterator i = mask.begin(); i != mask.end(); ++i)
+		{
+			const unsigned char chr = *i;
+			if (!isalnum(chr) && chr != '.' && chr != ':' && chr != '-' && chr != '/')
+				return false;
+		}
+		return true;
+	}
+
+	/** Add a value under a host mask. A mask containing a '/' is also stored as a
+	 * CIDR range, the mask is stored as an exact mask as well because it is also
+	 * matched against the host literally.
+	 * @param mask The host mask, which must not contain wildcards
+	 * @param value The value to store
+	 * @return False if the mask contains a '/' but is not a valid CIDR range
+	 */
+	bool Add(const std::string& mask, const T& value)
+	{
+		if (mask.find('/') != std::string::npos)
+		{
+			irc::sockets::cidr_mask cidr(mask);
+			size_t pos;
+			unsigned int maxlen;
+			if (!GetFamily(cidr.type, pos, maxlen))
+				return false;
+
+			prefixlens[pos][cidr.length]++;
+			cidrs.insert(std::make_pair(CIDRKey(cidr), value));
+		}
+
+		exact.insert(std::make_pair(ExactKey(mask), value));
+		return true;
+	}
+
+	/** Remove a value which was added with Add()
+	 * @param mask The host mask the value was added under
+	 * @param value The value to remove
+	 */
+	void Remove(const std::string& mask, const T& value)
+	{
+		if (mask.find('/') != std::string::npos)
+		{
+			irc::sockets::cidr_mask cidr(mask);
+			size_t pos;
+			unsigned int maxlen;
+			if (!GetFamily(cidr.type, pos, maxlen))
+				return;
+
+			prefixlens[pos][cidr.length]--;
+			Erase(cidrs, CIDRKey(cidr), value);
+		}
+
+		Erase(exact, ExactKey(mask), value);
+	}
+
+	/** Get the values whose host mask may match the given host or IP address.
+	 * A value may appear in the list more than once.
+	 * @param host The host to look up, it is matched against CIDR ranges as well if it is an IP
+	 * @param ip The IP address to look up, as a string
+	 * @param sa The IP address to look up
+	 * @param out The list to append the values to
+	 */
+	void Find(const std::string& host, const std::string& ip, const irc::sockets::sockaddrs& sa, std::vector<T>& out) const
+	{
+		const bool hostisip = (host == ip);
+
+		if (!exact.empty())
+		{
+			FindExact(ip, out);
+			if (!hostisip)
+				FindExact(host, out);
+		}
+
+		if (!cidrs.empty())
+		{
+			FindCIDR(sa, out);
+
+			// This matters if the host is an IP set by a module
+			irc::sockets::sockaddrs hostsa;
+			if ((!hostisip) && (irc::sockets::aptosa(host, 0, hostsa)))
+				FindCIDR(hostsa, out);
+		}
+	}
+
+	/** Check whether the index is empty
+	 */
+	bool empty() const { return exact.empty(); }
+
+	/** Remove all values from the index
+	 */
+	void clear()
+	{
+		exact.clear();
+		cidrs.clear();
+		memset(prefixlens, 0, sizeof(prefixlens));
+	}
+};
@@ -59,9 +59,9 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "numerics.h"
 #include "uid.h"
 #include "server.h"
+#include "timer.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
 #include "hashcomp.h"
 #include "logger.h"
 #include "usermanager.h"
@@ -74,6 +74,7 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "filelogger.h"
 #include "modules.h"
 #include "threadengine.h"
+#include "hostindex.h"
 #include "configreader.h"
 #include "inspstring.h"
 #include "protocol.h"
@@ -187,6 +188,15 @@ class serverstats
 	 * due to timeouts and other latency issues.
 	 */
 	unsigned long statsDnsBad;
+	/** Number of DNS lookups answered from the cache
+	 */
+	unsigned long statsDnsCacheHits;
+	/** Number of DNS lookups which were not in the cache
+	 */
+	unsigned long statsDnsCacheMisses;
+	/** Number of DNS cache entries evicted because the cache was full
+	 */
+	unsigned long statsDnsCacheEvictions;
 	/** Number of inbound connections seen
 	 */
 	unsigned long statsConnects;
@@ -218,7 +228,8 @@ class serverstats
 	 */
 	serverstats()
 		: statsAccept(0), statsRefused(0), statsUnknown(0), statsCollisions(0), statsDns(0),
-		statsDnsGood(0), statsDnsBad(0), statsConnects(0), statsSent(0), statsRecv(0)
+		statsDnsGood(0), statsDnsBad(0), statsDnsCacheHits(0), statsDnsCacheMisses(0), statsDnsCacheEvictions(0),
+		statsConnects(0), statsSent(0), statsRecv(0)
 	{
 	}
 };
@@ -24,6 +24,7 @@
 #pragma once
 
 #include "timer.h"
+#include "hashcomp.h"
 
 class IOHook;
 
@@ -70,6 +71,36 @@ enum BufferedSocketError
 /* Required forward declarations */
 class BufferedSocket;
 
+/** An immutable, reference counted block of data which is queued for sending.
+ * The same buffer may be placed on the sendq of any number of StreamSockets,
+ * so a line that goes to many recipients is built and stored only once.
+ */
+class CoreExport SharedBuffer : public refcountbase
+{
+	/** The data held by this buffer, never modified after construction */
+	const std::string data;
+
+ public:
+	/** Create a buffer holding a copy of the given data
+	 * @param str The data to store in the buffer
+	 */
+	SharedBuffer(const std::string& str) : data(str) { }
+
+	/** Create a buffer holding a copy of the given data
+	 * @param str Pointer to the data to store in the buffer
+	 * @param len Length of the data, in bytes
+	 */
+	SharedBuffer(const char* str, size_t len) : data(str, len) { }
+
+	/** Get the data held by this buffer */
+	const std::string& str() const { return data; }
+
+	/** Get the length, in bytes, of the data held by this buffer */
+	size_t length() const { return data.length(); }
+};
+
+typedef reference<SharedBuffer> SharedBufferRef;
+
 /** Used to time out socket connections
  */
 class CoreExport SocketTimeout : public Timer
@@ -103,20 +134,159 @@ class CoreExport SocketTimeout : public Timer
  */
 class CoreExport StreamSocket : public EventHandler
 {
+ public:
+	/** Queue of data waiting to be sent on a StreamSocket.
+	 * Private data is copied into fixed size chunks which are taken from, and returned to,
+	 * a per-process pool; shared buffers are queued by reference. The queue of chunks and
+	 * buffers is a ring which is only allocated once data is queued and which is freed
+	 * when the queue drains only if it has grown past a few items, so a socket which has
+	 * never sent anything costs no memory and an idle one keeps at most a small ring.
+	 * Sending data only advances an offset into the front item.
+	 * The pool is not locked, so send queues must only be used from the main thread.
+	 */
+	class CoreExport SendQueue
+	{
+	 public:
+		/** A fixed size block of memory holding private data queued for sending */
+		struct Chunk
+		{
+			/** Size of a chunk, including the bookkeeping, in bytes */
+			static const size_t SIZE = 4096;
+
+			/** Next chunk in the pool of unused chunks */
+			Chunk* next;
+
+			/** The data held by this chunk */
+			char data[SIZE - sizeof(Chunk*)];
+		};
+
+	 private:
+		/** A single chunk or shared buffer in the queue */
+		struct Item
+		{
+			/** The shared buffer holding the data, or NULL if the data is in chunk */
+			SharedBufferRef shared;
+
+			/** The chunk holding the data, or NULL if the data is in a shared buffer */
+			Chunk* chunk;
+
+			/** Offset of the first byte which has not been sent yet */
+			size_t begin;
+
+			/** Offset one past the last byte which is queued */
+			size_t end;
+
+			Item() : chunk(NULL), begin(0), end(0) { }
+			const char* data() const { return (chunk ? chunk->data : shared->str().data()) + begin; }
+			size_t length() const { return end - begin; }
+		};
+
+		/** Ring of items, the size of this vector is always zero or a power of two */
+		std::vector<Item> items;
+
+		/** Index of the front item in items */
+		size_t head;
+
+		/** Number of items in the queue */
+		size_t count;
+
+		/** Number of bytes in the queue, not including already sent data */
+		size_t nbytes;
+
+		/** Get an item by its position in the queue, 0 being the front */
+		Item& at(size_t pos) { return items[(head + pos) & (items.size() - 1)]; }
+		const Item& at(size_t pos) const { return items[(head + pos) & (items.size() - 1)]; }
+
+		/** Append an empty item to the back of the queue, growing the ring if needed */
+		Item& push_back();
+
+		/** Remove the front item from the queue, returning its chunk to the pool */
+		void pop_front();
+
+		/** Take an unused chunk from the pool, allocating one if the pool is empty */
+		static Chunk* AllocChunk();
+
+		/** Return an unused chunk to the pool */
+		static void FreeChunk(Chunk* chunk);
+
+	 public:
+		SendQueue() : head(0), count(0), nbytes(0) { }
+		~SendQueue() { clear(); }
+
+		/** Return true if there is no data in the queue */
+		bool empty() const { return (nbytes == 0); }
+
+		/** Get the number of bytes in the queue */
+		size_t bytes() const { return nbytes; }
+
+		/** Get the number of separate blocks of data in the queue */
+		size_t size() const { return count; }
+
+		/** Get a block of queued data
+		 * @param pos Position of the block in the queue, 0 being the front
+		 * @param len Will be set to the length of the block, in bytes
+		 * @return Pointer to the first byte of the block
+		 */
+		const char* GetBlock(size_t pos, size_t& len) const
+		{
+			const Item& item = at(pos);
+			len = item.length();
+			return item.data();
+		}
+
+		/** Copy data from the front of the queue without removing it
+		 * @param buf Buffer to copy the data to
+		 * @param len Size of the buffer, in bytes
+		 * @return Number of bytes copied, at most len
+		 */
+		size_t Peek(char* buf, size_t len) const;
+
+		/** Copy data to the back of the queue, filling up the last chunk first
+		 * @param data Pointer to the data to queue
+		 * @param len Length of the data, in bytes
+		 */
+		void push_back(const char* data, size_t len);
+
+		/** Queue a shared buffer without copying it
+		 * @param buffer The buffer to queue
+		 */
+		void push_back(const SharedBufferRef& buffer);
+
+		/** Remove sent data from the front of the queue
+		 * @param len Number of bytes to remove
+		 */
+		void erase_front(size_t len);
+
+		/** Remove all data from the queue */
+		void clear();
+	};
+
+ private:
 	/** The IOHook that handles raw I/O for this socket, or NULL */
 	IOHook* iohook;
 
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Buffers on it may be shared with other sockets
+	 * and must never be modified.
 	 */
-	std::deque<std::string> sendq;
-	/** Length, in bytes, of the sendq */
-	size_t sendq_len;
+	SendQueue sendq;
+
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
+
+	/** Number of bytes at the start of recvq which have already been taken by GetNextLine() */
+	std::string::size_type recvq_consumed;
+
+	/** Drop the data which has been taken by GetNextLine() from the front of recvq.
+	 * This is done before new data is read, so lines are never moved one by one.
+	 */
+	void CompactRecvQ();
  protected:
+	/** Receive queue. If GetNextLine() is used, the first recvq_consumed bytes have
+	 * already been processed and must be ignored.
+	 */
 	std::string recvq;
  public:
-	StreamSocket() : iohook(NULL), sendq_len(0) {}
+	StreamSocket() : iohook(NULL), recvq_consumed(0) {}
 	IOHook* GetIOHook() const;
 	void AddIOHook(IOHook* hook);
 	void DelIOHook();
@@ -143,14 +313,47 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Send the given data out the socket, either now or when writes unblock
+	 * @param data Pointer to the data to send
+	 * @param len Length of the data, in bytes
+	 */
+	void WriteData(const char* data, size_t len);
+	/** Send the given buffer out the socket, either now or when writes unblock.
+	 * The buffer is queued by reference, it is not copied.
+	 * @param data The buffer to send
+	 */
+	void WriteData(const SharedBufferRef& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
 	 * @return true if a line was read
 	 */
 	bool GetNextLine(std::string& line, char delim = '\n');
+
+	/** Read a line from the socket without copying it.
+	 * The view points into recvq and stays valid until the next read from the
+	 * socket; it does not include the delimiter.
+	 * @param line Will be set to the line read
+	 * @param delim The line delimiter
+	 * @return true if a line was read
+	 */
+	bool GetNextLine(irc::string_view& line, char delim = '\n');
+
+	/** Get the received data which has not been taken yet, without copying it.
+	 * Used by protocols which are not line based; the view stays valid until the
+	 * next read from the socket.
+	 */
+	inline irc::string_view GetRecvQ() const { return irc::string_view(recvq.data() + recvq_consumed, recvq.length() - recvq_consumed); }
+
+	/** Mark data at the start of the view returned by GetRecvQ() as taken
+	 * @param bytes Number of bytes to take, at most getRecvQSize()
+	 */
+	inline void ConsumeRecvQ(size_t bytes) { recvq_consumed += bytes; }
+
+	/** Get the number of received bytes which have not been taken by GetNextLine() yet */
+	inline size_t getRecvQSize() const { return recvq.length() - recvq_consumed; }
 	/** Useful for implementing sendq exceeded */
-	inline size_t getSendQSize() const { return sendq_len; }
+	inline size_t getSendQSize() const { return sendq.bytes(); }
 
 	/**
 	 * Close the socket, remove from socket engine, etc
@@ -234,3 +437,5 @@ class CoreExport BufferedSocket : public StreamSocket
 inline IOHook* StreamSocket::GetIOHook() const { return iohook; }
 inline void StreamSocket::AddIOHook(IOHook* hook) { iohook = hook; }
 inline void StreamSocket::DelIOHook() { iohook = NULL; }
+
+#include "iohook.h"
@@ -59,18 +59,32 @@ class IOHook : public classbase
 	 */
 	IOHookProvider* const prov;
 
+	/** Set by the hook once it no longer changes the data read from the socket, for example
+	 * because the kernel has taken over decryption. The socket then reads the data itself,
+	 * the same way as sockets without a hook do.
+	 */
+	bool plainread;
+
+	/** Set by the hook once it no longer changes the data written to the socket, the socket
+	 * then writes its sendq itself. OnStreamSocketWrite() is not called anymore.
+	 */
+	bool plainwrite;
+
 	IOHook(IOHookProvider* provider)
-		: prov(provider) { }
+		: prov(provider), plainread(false), plainwrite(false) { }
 
 	/**
 	 * Called when a hooked stream has data to write, or when the socket
 	 * engine returns it as writable
 	 * @param sock The socket in question
-	 * @param sendq Data to send to the socket
+	 * @param sendq Data to send to the socket. The hook removes the data it
+	 *  has sent from the front of the queue, and should send as much as it can
+	 *  in one go. After a blocked write the queue still starts with the same
+	 *  data when the hook is called again, as data is only added at the back.
 	 * @return 1 if the sendq has been completely emptied, 0 if there is
 	 *  still data to send, and -1 if there was an error
 	 */
-	virtual int OnStreamSocketWrite(StreamSocket* sock, std::string& sendq) = 0;
+	virtual int OnStreamSocketWrite(StreamSocket* sock, StreamSocket::SendQueue& sendq) = 0;
 
 	/** Called immediately before any socket is closed. When this event is called, shutdown()
 	 * has not yet been called on the socket.
@@ -22,17 +22,37 @@
 
 class CoreExport Membership : public Extensible, public intrusive_list_node<Membership>
 {
+	/** Highest prefix rank of the member, valid if cacheserial is current */
+	mutable unsigned int cachedrank;
+
+	/** Highest prefix character of the member, valid if cacheserial is current */
+	mutable char cachedprefix;
+
+	/** All prefix characters of the member, valid if cacheserial is current */
+	mutable std::string cachedprefixes;
+
+	/** The ModeParser::GetPrefixSerial() value the cached fields were computed at, 0 if never */
+	mutable unsigned int cacheserial;
+
+	/** Recompute the cached prefix fields if they are not current
+	 */
+	void CheckPrefixCache() const;
+
  public:
 	User* const user;
 	Channel* const chan;
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	Membership(User* u, Channel* c) : cachedrank(0), cachedprefix(0), cacheserial(0), user(u), chan(c) {}
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
 	}
-	unsigned int getRank();
+
+	/** Get the rank of the highest prefix mode this member has
+	 * @return The prefix rank of the member, 0 if the member has no prefix modes
+	 */
+	unsigned int getRank() const;
 
 	/** Add a prefix character to a user.
 	 * Only the core should call this method, usually from
@@ -61,6 +81,129 @@ class CoreExport Membership : public Extensible, public intrusive_list_node<Memb
 	const char* GetAllPrefixChars() const;
 };
 
+/** A member of a channel, as stored in the channel's member list. The
+ * first and second fields are named after those of the std::pair the
+ * list used to hold, so loops over the list read the same as before.
+ */
+struct MemberEntry
+{
+	/** Flags describing a member, so that loops over the member list can
+	 * filter members without looking at the User or Membership objects
+	 */
+	enum Flags
+	{
+		/** The member is a local user */
+		FLAG_LOCAL = 1
+	};
+
+	/** The user who is on the channel */
+	User* first;
+
+	/** The membership of the user */
+	Membership* second;
+
+	/** The highest prefix rank of the member, see UserMembList::CheckRanks() */
+	unsigned int rank;
+
+	/** A combination of the values in Flags */
+	unsigned char flags;
+
+	/** Returns true if the member is a local user */
+	bool IsLocal() const { return (flags & FLAG_LOCAL); }
+};
+
+/** The members of a channel. The members are stored contiguously so that
+ * sending to every member of a large channel touches as little memory as
+ * possible, and large channels have a hash index for finding a member.
+ * Removing a member moves the last member into its place, so the order of
+ * the members is not stable and removing any member invalidates iterators.
+ */
+class CoreExport UserMembList
+{
+ public:
+	typedef std::vector<MemberEntry> MemberVector;
+	typedef MemberVector::iterator iterator;
+	typedef MemberVector::const_iterator const_iterator;
+
+ private:
+	typedef TR1NS::unordered_map<User*, size_t> IndexMap;
+
+	/** Channels with at most this many members are searched linearly rather than indexed */
+	static const size_t INDEX_MIN = 16;
+
+	/** The members of the channel */
+	MemberVector members;
+
+	/** Position of each member in the member vector, empty if the channel is small */
+	IndexMap index;
+
+	/** The ModeParser::GetPrefixSerial() value the ranks of the members were stored at */
+	unsigned int rankserial;
+
+	/** Find the position of a user in the member vector
+	 * @return The position of the user, or the size of the vector if the user is not a member
+	 */
+	size_t Find(User* user) const
+	{
+		if (index.empty())
+		{
+			for (size_t i = 0; i < members.size(); ++i)
+			{
+				if (members[i].first == user)
+					return i;
+			}
+			return members.size();
+		}
+
+		IndexMap::const_iterator it = index.find(user);
+		return (it != index.end() ? it->second : members.size());
+	}
+
+ public:
+	UserMembList() : rankserial(0) { }
+
+	iterator begin() { return members.begin(); }
+	iterator end() { return members.end(); }
+	const_iterator begin() const { return members.begin(); }
+	const_iterator end() const { return members.end(); }
+	size_t size() const { return members.size(); }
+	bool empty() const { return members.empty(); }
+
+	/** Find the entry of a user
+	 * @return An iterator to the entry of the user, or end() if the user is not a member
+	 */
+	iterator find(User* user) { return members.begin() + Find(user); }
+	const_iterator find(User* user) const { return members.begin() + Find(user); }
+
+	/** Add a member. The user must not be a member already.
+	 * @param memb The membership of the new member
+	 */
+	void insert(Membership* memb);
+
+	/** Remove a member
+	 * @param it The entry of the member, must be valid
+	 */
+	void erase(iterator it);
+
+	/** Update the highest prefix rank stored for a member
+	 * @param user The member to update
+	 * @param rank The new rank of the member
+	 */
+	void SetRank(User* user, unsigned int rank);
+
+	/** Make sure the ranks stored for the members are current. They are updated by
+	 * Membership::SetPrefix(), but have to be recomputed when prefix modes have been
+	 * added or removed since they were stored, as that changes the rank of a member
+	 * without a call to it.
+	 */
+	void CheckRanks();
+};
+
+/** Iterator of UserMembList */
+typedef UserMembList::iterator UserMembIter;
+/** const Iterator of UserMembList */
+typedef UserMembList::const_iterator UserMembCIter;
+
 template <typename T>
 class InviteBase
 {
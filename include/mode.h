@@ -546,6 +546,15 @@ class CoreExport ModeParser
 	 */
 	std::string Cached004ModeList;
 
+	/** Prefix modes indexed by their prefix character, for FindPrefix()
+	 */
+	PrefixMode* prefixes[256];
+
+	/** Incremented whenever a prefix mode is added or removed, this invalidates
+	 * the prefix information cached by every Membership
+	 */
+	unsigned int prefixserial;
+
  public:
 	typedef std::vector<ListModeBase*> ListModeList;
 	typedef std::vector<PrefixMode*> PrefixModeList;
@@ -691,6 +700,12 @@ class CoreExport ModeParser
 	 * @return A list containing all prefix modes
 	 */
 	const PrefixModeList& GetPrefixModes() const { return mhlist.prefix; }
+
+	/** Get the serial of the current set of prefix modes. The serial changes
+	 * whenever a prefix mode is added or removed.
+	 * @return The current prefix serial, never 0
+	 */
+	unsigned int GetPrefixSerial() const { return prefixserial; }
 };
 
 inline const std::string& ModeParser::GetModeListFor004Numeric()
@@ -266,6 +266,7 @@ enum Implementation
 	I_OnWhoisLine, I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
 	I_OnText, I_OnPassCompare, I_OnNamesListItem, I_OnNumeric,
 	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent, I_OnSetUserIP,
+	I_OnNamesListCacheKey,
 	I_END
 };
 
@@ -1047,6 +1048,18 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual void OnNamesListItem(User* issuer, Membership* item, std::string &prefixes, std::string &nick);
 
+	/** Called before a NAMES list is sent to a user who can see every member of the channel, to pick
+	 * the cached copy of the list to send. A module which changes NAMES list items for this user in
+	 * OnNamesListItem() must append something identifying its changes to the key, or return MOD_RES_DENY
+	 * if the list has to be built for this user alone. If a module implements OnNamesListItem() but not
+	 * this event, NAMES lists are never cached.
+	 * @param issuer The user who the NAMES list is for
+	 * @param chan The channel the NAMES list is for
+	 * @param key The cache key, modules which change the list append to it
+	 * @return MOD_RES_DENY to build the list without the cache, MOD_RES_PASSTHRU to use the cache
+	 */
+	virtual ModResult OnNamesListCacheKey(User* issuer, Channel* chan, std::string& key);
+
 	virtual ModResult OnNumeric(User* user, unsigned int numeric, const std::string &text);
 
 	/** Called whenever a result from /WHO is about to be returned
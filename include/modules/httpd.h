@@ -177,6 +177,24 @@ class HTTPRequest : public Event
 	}
 };
 
+/** Produces the body of a streamed response a part at a time, so a large document
+ * never has to be built in memory at once. m_httpd asks for the next part whenever
+ * the client has taken most of what was sent before, at most once per main loop
+ * iteration, and deletes the producer when the response is complete or the client
+ * goes away.
+ */
+class HTTPStreamProducer
+{
+ public:
+	virtual ~HTTPStreamProducer() { }
+
+	/** Append the next part of the document
+	 * @param data The string to append the next part to
+	 * @return True if there is more to send, false if the document is complete
+	 */
+	virtual bool Produce(std::string& data) = 0;
+};
+
 /** If you want to reply to HTTP requests, you must return a HTTPDocumentResponse to
  * the httpd module via the HTTPdAPI.
  * When you initialize this class you initialize it with all components required to
@@ -191,6 +209,12 @@ class HTTPDocumentResponse
 	Module* const module;
 
 	std::stringstream* document;
+
+	/** Producer of the document body if the response is streamed, NULL otherwise.
+	 * The httpd module takes ownership of it.
+	 */
+	HTTPStreamProducer* producer;
+
 	unsigned int responsecode;
 
 	/** Any extra headers to include with the defaults
@@ -207,7 +231,20 @@ class HTTPDocumentResponse
 	 * based upon the response code.
 	 */
 	HTTPDocumentResponse(Module* mod, HTTPRequest& req, std::stringstream* doc, unsigned int response)
-		: module(mod), document(doc), responsecode(response), src(req)
+		: module(mod), document(doc), producer(NULL), responsecode(response), src(req)
+	{
+	}
+
+	/** Initialize a HTTPDocumentResponse with a streamed body.
+	 * The body is sent with chunked transfer encoding to HTTP/1.1 clients and as it is to
+	 * HTTP/1.0 clients. The connection is closed once the whole document has been sent.
+	 * @param mod A pointer to the module who responded to the request
+	 * @param req The request you obtained from the HTTPRequest at an earlier time
+	 * @param prod The producer of the document body, allocated with new
+	 * @param response A valid HTTP/1.0 or HTTP/1.1 response code
+	 */
+	HTTPDocumentResponse(Module* mod, HTTPRequest& req, HTTPStreamProducer* prod, unsigned int response)
+		: module(mod), document(NULL), producer(prod), responsecode(response), src(req)
 	{
 	}
 };
@@ -20,6 +20,9 @@
 
 #pragma once
 
+#include <deque>
+#include <list>
+#include <map>
 #include <string>
 #include "iohook.h"
 
@@ -138,6 +141,28 @@ class SSLIOHook : public IOHook
 	 */
 	reference<ssl_cert> certificate;
 
+	/** Largest amount of data which fits into one SSL record
+	 */
+	static const size_t MAX_RECORD_SIZE = 16384;
+
+	/** Get the data for the next SSL record from the front of a sendq. Small blocks,
+	 * such as single lines, are merged so records are as large as possible instead
+	 * of every block being sent in a record of its own.
+	 * @param sendq The queue to take the data from, it is not modified
+	 * @param len Set to the length of the data
+	 * @return The data, valid until the next call or until the queue is modified
+	 */
+	static const char* GetRecordData(const StreamSocket::SendQueue& sendq, size_t& len)
+	{
+		const char* data = sendq.GetBlock(0, len);
+		if ((len >= MAX_RECORD_SIZE) || (sendq.size() == 1))
+			return data;
+
+		static char buffer[MAX_RECORD_SIZE];
+		len = sendq.Peek(buffer, sizeof(buffer));
+		return buffer;
+	}
+
  public:
 	SSLIOHook(IOHookProvider* hookprov)
 		: IOHook(hookprov)
@@ -204,6 +229,327 @@ class SSLClientCert
 	}
 };
 
+/** A bounded in-memory cache of SSL sessions, used by the SSL modules to let clients
+ * resume a session by its session ID instead of doing a full handshake. The session
+ * data is stored as serialized by the SSL library, the cache does not interpret it.
+ * Also counts how many handshakes resumed a session, be it from the cache or a ticket.
+ * The cache can be used from the threads of an SSLHandshakePool.
+ */
+class SSLSessionCache
+{
+	typedef std::list<std::string> AgeList;
+
+	struct Entry
+	{
+		std::string data;
+		time_t expires;
+		AgeList::iterator age;
+	};
+	typedef std::map<std::string, Entry> EntryMap;
+
+	/** Cached sessions by session ID */
+	EntryMap entries;
+
+	/** Session IDs from the oldest to the newest, the oldest is evicted when the cache is full */
+	AgeList ages;
+
+	/** Maximum number of sessions in the cache, 0 disables the cache */
+	size_t maxsize;
+
+	/** Number of seconds a session can be resumed for */
+	time_t timeout;
+
+	/** Lookup and handshake counters */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long handshakes;
+	unsigned long resumed;
+
+	/** Guards everything above, handshakes run by an SSLHandshakePool use the cache from its threads */
+	mutable Mutex lock;
+
+	void Erase(EntryMap::iterator it)
+	{
+		ages.erase(it->second.age);
+		entries.erase(it);
+	}
+
+ public:
+	SSLSessionCache(size_t max, time_t time)
+		: maxsize(max), timeout(time), hits(0), misses(0), handshakes(0), resumed(0)
+	{
+	}
+
+	/** Add a session to the cache, evicting the oldest session if the cache is full
+	 * @param id The session ID
+	 * @param data The serialized session
+	 */
+	void Store(const std::string& id, const std::string& data)
+	{
+		if (!maxsize)
+			return;
+
+		lock.Lock();
+		EntryMap::iterator it = entries.find(id);
+		if (it != entries.end())
+			Erase(it);
+		else if (entries.size() >= maxsize)
+			Erase(entries.find(ages.front()));
+
+		Entry& entry = entries[id];
+		entry.data = data;
+		entry.expires = ServerInstance->Time() + timeout;
+		entry.age = ages.insert(ages.end(), id);
+		lock.Unlock();
+	}
+
+	/** Look up a session
+	 * @param id The session ID sent by the client
+	 * @param data Set to the serialized session if it was found
+	 * @return True if the session was found, false if it is not cached or has expired
+	 */
+	bool Find(const std::string& id, std::string& data)
+	{
+		lock.Lock();
+		EntryMap::iterator it = entries.find(id);
+		if ((it != entries.end()) && (it->second.expires <= ServerInstance->Time()))
+		{
+			Erase(it);
+			it = entries.end();
+		}
+
+		bool found = (it != entries.end());
+		if (found)
+		{
+			hits++;
+			data = it->second.data;
+		}
+		else
+			misses++;
+
+		lock.Unlock();
+		return found;
+	}
+
+	/** Remove a session, e.g. because the SSL library found it unusable
+	 * @param id The session ID
+	 */
+	void Remove(const std::string& id)
+	{
+		lock.Lock();
+		EntryMap::iterator it = entries.find(id);
+		if (it != entries.end())
+			Erase(it);
+		lock.Unlock();
+	}
+
+	/** Count a completed handshake
+	 * @param wasresumed True if the handshake resumed an earlier session
+	 */
+	void CountHandshake(bool wasresumed)
+	{
+		lock.Lock();
+		handshakes++;
+		if (wasresumed)
+			resumed++;
+		lock.Unlock();
+	}
+
+	size_t GetMaxSize() const { return maxsize; }
+	time_t GetTimeout() const { return timeout; }
+
+	/** Describe the counters and the size of the cache, for /STATS */
+	std::string GetStats() const
+	{
+		lock.Lock();
+		std::string stats = ConvToStr(handshakes) + " handshakes, " + ConvToStr(resumed) + " resumed (" + ConvToStr(handshakes ? resumed * 100 / handshakes : 0) +
+			"%), cache " + ConvToStr(entries.size()) + "/" + ConvToStr(maxsize) + " sessions, " + ConvToStr(hits) + " hits, " + ConvToStr(misses) + " misses";
+		lock.Unlock();
+		return stats;
+	}
+};
+
+/** A handshake, or the part of it which can be done with the data the peer has sent so far,
+ * run on a thread of an SSLHandshakePool
+ */
+class SSLHandshakeJob
+{
+ public:
+	virtual ~SSLHandshakeJob() { }
+
+	/** Called on a thread of the pool. Must not use anything but the SSL session of the handshake
+	 * and the parts of the SSL profile which are safe to use from multiple threads.
+	 */
+	virtual void Run() = 0;
+
+	/** Called in the main thread after Run() returned, the job is deleted afterwards
+	 */
+	virtual void Finish() = 0;
+};
+
+/** A pool of threads running the CPU heavy part of SSL handshakes (the public key operations)
+ * so they don't delay the main loop. The SSL modules give a handshake to the pool when the
+ * peer has sent data; until the job is finished the socket is not used by the main thread.
+ */
+class SSLHandshakePool
+{
+	class Worker : public SocketThread
+	{
+		/** Jobs waiting to be run, guarded by the queue lock */
+		std::deque<SSLHandshakeJob*> pending;
+
+		/** Jobs which have been run and wait for Finish(), guarded by the queue lock */
+		std::deque<SSLHandshakeJob*> done;
+
+		/** Number of jobs given to this worker which have not been finished yet, only used by the main thread */
+		size_t load;
+
+		void FinishJobs(std::deque<SSLHandshakeJob*>& jobs)
+		{
+			load -= jobs.size();
+			for (std::deque<SSLHandshakeJob*>::const_iterator i = jobs.begin(); i != jobs.end(); ++i)
+			{
+				(*i)->Finish();
+				delete *i;
+			}
+		}
+
+	 public:
+		Worker() : load(0) { }
+
+		size_t GetLoad() const { return load; }
+
+		void Submit(SSLHandshakeJob* job)
+		{
+			load++;
+			LockQueue();
+			pending.push_back(job);
+			UnlockQueueWakeup();
+		}
+
+		void Run() CXX11_OVERRIDE
+		{
+			LockQueue();
+			while (!GetExitFlag())
+			{
+				if (pending.empty())
+				{
+					WaitForQueue();
+					continue;
+				}
+
+				SSLHandshakeJob* job = pending.front();
+				pending.pop_front();
+				UnlockQueue();
+				job->Run();
+				LockQueue();
+				done.push_back(job);
+				NotifyParent();
+			}
+			UnlockQueue();
+		}
+
+		void OnNotify() CXX11_OVERRIDE
+		{
+			std::deque<SSLHandshakeJob*> finished;
+			LockQueue();
+			finished.swap(done);
+			UnlockQueue();
+			FinishJobs(finished);
+		}
+
+		/** Stop the thread, then run and finish the jobs it did not get to
+		 */
+		void Stop()
+		{
+			join();
+			for (std::deque<SSLHandshakeJob*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+				(*i)->Run();
+			done.insert(done.end(), pending.begin(), pending.end());
+			pending.clear();
+			OnNotify();
+		}
+	};
+
+	std::vector<Worker*> workers;
+
+ public:
+	/** Start the threads of the pool
+	 * @param threads The number of threads to start
+	 */
+	SSLHandshakePool(unsigned int threads)
+	{
+		for (unsigned int i = 0; i < threads; ++i)
+		{
+			Worker* worker = new Worker;
+			try
+			{
+				ServerInstance->Threads->Start(worker);
+			}
+			catch (CoreException& ex)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Only %u of %u SSL handshake threads could be started: %s", i, threads, ex.GetReason().c_str());
+				delete worker;
+				break;
+			}
+			workers.push_back(worker);
+		}
+	}
+
+	/** Stop the threads, the jobs which have not been finished yet are finished in the main thread
+	 */
+	~SSLHandshakePool()
+	{
+		for (std::vector<Worker*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			(*i)->Stop();
+			delete *i;
+		}
+	}
+
+	size_t GetThreadCount() const { return workers.size(); }
+
+	/** Replace a pool with one with a different number of threads. The handshakes
+	 * which are still running are finished by the old pool before it is deleted.
+	 * @param pool The pool to replace, NULL if there is none; set to the new pool
+	 * or to NULL if threads is 0 or no thread could be started
+	 * @param threads The number of threads to use
+	 */
+	static void Resize(SSLHandshakePool*& pool, unsigned int threads)
+	{
+		if (threads == (pool ? pool->GetThreadCount() : 0))
+			return;
+
+		SSLHandshakePool* oldpool = pool;
+		pool = NULL;
+		delete oldpool;
+
+		if (threads)
+		{
+			pool = new SSLHandshakePool(threads);
+			if (!pool->GetThreadCount())
+			{
+				delete pool;
+				pool = NULL;
+			}
+		}
+	}
+
+	/** Run a job on the least busy thread, there must be at least one thread
+	 * @param job The job to run, deleted after it was finished
+	 */
+	void Submit(SSLHandshakeJob* job)
+	{
+		Worker* best = workers.front();
+		for (std::vector<Worker*>::const_iterator i = workers.begin() + 1; i != workers.end(); ++i)
+		{
+			if ((*i)->GetLoad() < best->GetLoad())
+				best = *i;
+		}
+		best->Submit(job);
+	}
+};
+
 class UserCertificateAPIBase : public DataProvider
 {
  public:
@@ -127,8 +127,10 @@ namespace irc
 	}
 }
 
-#include "iohook.h"
 #include "socketengine.h"
+
+class IOHookProvider;
+
 /** This class handles incoming connections on client ports.
  * It will create a new User for every valid connection
  * and assign it a file descriptor.
@@ -147,6 +149,11 @@ class CoreExport ListenSocket : public EventHandler
 	 */
 	dynamic_reference_nocheck<IOHookProvider> iohookprov;
 
+	/** Maximum number of connections accepted per read event before
+	 * returning to the socket engine
+	 */
+	unsigned int accept_batch;
+
 	/** Create a new listening socket
 	 */
 	ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to);
@@ -158,8 +165,10 @@ class CoreExport ListenSocket : public EventHandler
 	~ListenSocket();
 
 	/** Handles sockets internals crap of a connection, convenience wrapper really
+	 * @return True if a connection was taken off the backlog (even if it was
+	 * then refused), false if there was nothing left to accept or accept() failed.
 	 */
-	void AcceptInternal();
+	bool AcceptInternal();
 
 	/** Inspects the bind block belonging to this socket to set the name of the IO hook
 	 * provider which this socket will use for incoming connections.
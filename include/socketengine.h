@@ -381,20 +381,26 @@ public:
 	static EventHandler* GetRef(int fd);
 
 	/** Waits for events and dispatches them to handlers.  Please note that
-	 * this doesn't wait long, only a couple of milliseconds. It returns the
+	 * this doesn't wait long, only until the given timeout expires. It returns the
 	 * number of events which occurred during this call.  This method will
 	 * dispatch events to their handlers by calling their
 	 * EventHandler::HandleEvent() methods with the necessary EventType
 	 * value.
+	 * @param timeout The maximum number of milliseconds to wait for events.
 	 * @return The number of events which have occured.
 	 */
-	static int DispatchEvents();
+	static int DispatchEvents(int timeout = 1000);
 
 	/** Dispatch trial reads and writes. This causes the actual socket I/O
 	 * to happen when writes have been pre-buffered.
 	 */
 	static void DispatchTrialWrites();
 
+	/** Returns true if there are trial reads or writes waiting to be
+	 * dispatched, in which case DispatchEvents() should not wait.
+	 */
+	static bool HasPendingTrials() { return !trials.empty(); }
+
 	/** Returns true if the file descriptors in the given event handler are
 	 * within sensible ranges which can be handled by the socket engine.
 	 */
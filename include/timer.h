@@ -23,10 +23,10 @@
 
 class Module;
 
-/** Timer class for one-second resolution timers
+/** Timer class for millisecond resolution timers
  * Timer provides a facility which allows module
  * developers to create one-shot timers. The timer
- * can be made to trigger at any time up to a one-second
+ * can be made to trigger at any time up to a one-millisecond
  * resolution. To use Timer, inherit a class from
  * Timer, then insert your inherited class into the
  * queue using Server::AddTimer(). The Tick() method of
@@ -35,38 +35,59 @@ class Module;
  */
 class CoreExport Timer
 {
-	/** The triggering time
+	friend class TimerManager;
+
+	/** The triggering time, in milliseconds since the epoch
 	 */
-	time_t trigger;
+	uint64_t trigger;
 
-	/** Number of seconds between triggers
+	/** Number of milliseconds between triggers
 	 */
-	unsigned int secs;
+	uint64_t interval;
 
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
 
+	/** The tick of the timer wheel on which this timer is due, set by TimerManager
+	 */
+	uint64_t deadline;
+
+	/** The timer wheel slot holding this timer, NULL if the timer is not scheduled
+	 */
+	Timer** slot;
+
+	/** Neighbours of this timer in its timer wheel slot
+	 */
+	Timer* prev;
+	Timer* next;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
 	 * @param now The time now
 	 * @param repeating Repeat this timer every secs_from_now seconds if set to true
 	 */
-	Timer(unsigned int secs_from_now, time_t now, bool repeating = false)
-	{
-		trigger = now + secs_from_now;
-		secs = secs_from_now;
-		repeat = repeating;
-	}
+	Timer(unsigned int secs_from_now, time_t now, bool repeating = false);
 
 	/** Default destructor, removes the timer from the timer manager
 	 */
 	virtual ~Timer();
 
+	/** Get the time of the current main loop iteration in milliseconds since the epoch
+	 */
+	static uint64_t GetTimeMs();
+
 	/** Retrieve the current triggering time
 	 */
 	time_t GetTrigger() const
+	{
+		return trigger / 1000;
+	}
+
+	/** Retrieve the current triggering time in milliseconds since the epoch
+	 */
+	uint64_t GetTriggerMs() const
 	{
 		return trigger;
 	}
@@ -77,13 +98,17 @@ class CoreExport Timer
 	 */
 	void SetTrigger(time_t nexttrigger)
 	{
-		trigger = nexttrigger;
+		trigger = static_cast<uint64_t>(nexttrigger) * 1000;
 	}
 
 	/** Sets the interval between two ticks.
 	 */
 	void SetInterval(time_t interval);
 
+	/** Sets the interval between two ticks in milliseconds.
+	 */
+	void SetIntervalMs(uint64_t interval);
+
 	/** Called when the timer ticks.
 	 * You should override this method with some useful code to
 	 * handle the tick event.
@@ -104,7 +129,15 @@ class CoreExport Timer
 	 */
 	unsigned int GetInterval() const
 	{
-		return secs;
+		return interval / 1000;
+	}
+
+	/** Returns the interval (number of milliseconds between ticks)
+	 * of this timer object.
+	 */
+	uint64_t GetIntervalMs() const
+	{
+		return interval;
 	}
 
 	/** Cancels the repeat state of a repeating timer.
@@ -117,19 +150,88 @@ class CoreExport Timer
 	}
 };
 
-typedef std::multimap<time_t, Timer*> TimerMap;
-
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel with a resolution of one
+ * millisecond, so adding and removing a timer takes constant time. The
+ * wheel runs on its own clock which follows the system clock forwards but
+ * ignores it going backwards, so a clock step never stalls pending timers.
  */
 class CoreExport TimerManager
 {
-	/** A list of all pending timers
+	/** Number of bits of the deadline used to index each level of the wheel
+	 */
+	static const unsigned int WHEEL_BITS = 8;
+
+	/** Number of slots in each level of the wheel
+	 */
+	static const unsigned int WHEEL_SIZE = 1 << WHEEL_BITS;
+
+	/** Mask selecting the slot index for one level
+	 */
+	static const unsigned int WHEEL_MASK = WHEEL_SIZE - 1;
+
+	/** Number of levels; timers further away than the last level can reach
+	 * (about 49 days) are kept in the overflow list
+	 */
+	static const unsigned int WHEEL_LEVELS = 4;
+
+	/** The timer wheel, one list of timers per slot
+	 */
+	Timer* wheel[WHEEL_LEVELS][WHEEL_SIZE];
+
+	/** Timers too far in the future to fit in the wheel
+	 */
+	Timer* overflow;
+
+	/** Number of timers in the first level of the wheel
+	 */
+	size_t firstlevelcount;
+
+	/** The next tick of the wheel which has not been processed yet
+	 */
+	uint64_t current;
+
+	/** The current time on the wheel's clock
+	 */
+	uint64_t wheelnow;
+
+	/** The system time in milliseconds when wheelnow was last updated
+	 */
+	uint64_t lastwall;
+
+	/** Lower bound of the tick the next timer is due on
 	 */
-	TimerMap Timers;
+	uint64_t nextdue;
+
+	/** Advance the wheel's clock to the current system time
+	 */
+	void SyncClock();
+
+	/** Put a timer into the slot matching its deadline
+	 */
+	void Insert(Timer* t);
+
+	/** Remove a timer from its slot
+	 */
+	void Unlink(Timer* t);
+
+	/** Move the timers of the current slot of the given level down the wheel.
+	 * Called when all lower levels have wrapped around.
+	 */
+	void Cascade(unsigned int level);
+
+	/** Find a lower bound for the tick the next timer is due on
+	 */
+	uint64_t FindNextDue() const;
 
  public:
+	/** Constructor, creates an empty timer wheel
+	 */
+	TimerManager();
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
@@ -144,4 +246,10 @@ class CoreExport TimerManager
 	 * @param T an Timer derived class to remove
 	 */
 	void DelTimer(Timer* T);
+
+	/** Get the number of milliseconds until the next timer is due
+	 * @param maxwait The value to return if no timer is due sooner
+	 * @return The number of milliseconds to wait, at most maxwait
+	 */
+	int GetNextTimeout(int maxwait);
 };
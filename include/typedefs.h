@@ -33,8 +33,10 @@ class InspIRCd;
 class Invitation;
 class LocalUser;
 class Membership;
+class UserMembList;
 class Module;
 class OperInfo;
+class PrivilegeID;
 class ProtocolServer;
 class RemoteUser;
 class Server;
@@ -104,13 +106,6 @@ typedef std::map<std::string, file_cache> ConfigFileCache;
  */
 typedef TR1NS::unordered_map<std::string, Command*> Commandtable;
 
-/** Membership list of a channel */
-typedef std::map<User*, Membership*> UserMembList;
-/** Iterator of UserMembList */
-typedef UserMembList::iterator UserMembIter;
-/** const Iterator of UserMembList */
-typedef UserMembList::const_iterator UserMembCIter;
-
 /** Generic user list, used for exceptions */
 typedef std::set<User*> CUList;
 
@@ -74,10 +74,6 @@ class CoreExport UserManager
      */
 	void GarbageCollect();
 
-	/** Perform background user events such as PING checks
-	 */
-	void DoBackgroundUserStuff();
-
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
 	 * @return True if all modules have finished checking this user
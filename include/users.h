@@ -65,6 +65,14 @@ enum UserType {
  */
 struct CoreExport ConnectClass : public refcountbase
 {
+	/** Limits used when a class doesn't set them, or when a user has no class
+	 */
+	static const unsigned long DEFAULT_SOFTSENDQ = 4096;
+	static const unsigned long DEFAULT_HARDSENDQ = 0x100000;
+	static const unsigned long DEFAULT_RECVQ = 4096;
+	static const unsigned int DEFAULT_THRESHOLD = 10;
+	static const unsigned int DEFAULT_THRESHOLD_NOFAKELAG = 20;
+
 	reference<ConfigTag> config;
 	/** Type of line, either CC_ALLOW or CC_DENY
 	 */
@@ -167,28 +175,28 @@ struct CoreExport ConnectClass : public refcountbase
 	 */
 	unsigned long GetSendqSoftMax()
 	{
-		return (softsendqmax ? softsendqmax : 4096);
+		return (softsendqmax ? softsendqmax : DEFAULT_SOFTSENDQ);
 	}
 
 	/** Returns the maximum sendq value (hard limit)
 	 */
 	unsigned long GetSendqHardMax()
 	{
-		return (hardsendqmax ? hardsendqmax : 0x100000);
+		return (hardsendqmax ? hardsendqmax : DEFAULT_HARDSENDQ);
 	}
 
 	/** Returns the maximum recvq value
 	 */
 	unsigned long GetRecvqMax()
 	{
-		return (recvqmax ? recvqmax : 4096);
+		return (recvqmax ? recvqmax : DEFAULT_RECVQ);
 	}
 
 	/** Returns the penalty threshold value
 	 */
 	unsigned int GetPenaltyThreshold()
 	{
-		return penaltythreshold ? penaltythreshold : (fakelag ? 10 : 20);
+		return penaltythreshold ? penaltythreshold : (fakelag ? DEFAULT_THRESHOLD : DEFAULT_THRESHOLD_NOFAKELAG);
 	}
 
 	unsigned int GetCommandRate()
@@ -376,6 +384,7 @@ class CoreExport User : public Extensible
 
 	/** This clears any cached results that are used for GetFullRealHost() etc.
 	 * The results of these calls are cached as generating them can be generally expensive.
+	 * The cached NAMES lists of the channels the user is on are discarded as well.
 	 */
 	void InvalidateCache();
 
@@ -436,6 +445,13 @@ class CoreExport User : public Extensible
 	 */
 	virtual bool HasPrivPermission(const std::string &privstr, bool noisy = false);
 
+	/** Returns true if a user has a given permission, see the overload above.
+	 * @param priv The priv to check, with its number cached so that the check is cheap
+	 * @param noisy If set to true, the user is notified that they do not have the specified permission where applicable. If false, no notification is sent.
+	 * @return True if this user has the permission in question.
+	 */
+	virtual bool HasPrivPermission(const PrivilegeID& priv, bool noisy = false);
+
 	/** Returns true or false if a user can set a privileged user or channel mode.
 	 * This is done by looking up their oper type from User::oper, then referencing
 	 * this to their oper classes, and checking the modes they can set.
@@ -657,10 +673,93 @@ class CoreExport UserIOHandler : public StreamSocket
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a shared buffer to the user's write buffer, without copying it.
+	 * The same sendq limits as for AddWriteBuf(const std::string&) apply.
+	 * @param data The buffer to add to the write buffer
+	 */
+	void AddWriteBuf(const SharedBufferRef& data);
+
+	/** Adds a line to the user's write buffer, followed by CR/LF.
+	 * The line is copied straight into the sendq, the same sendq limits as for
+	 * AddWriteBuf(const std::string&) apply.
+	 * @param line Pointer to the line, without CR/LF
+	 * @param len Length of the line, in bytes
+	 */
+	void AddWriteLine(const char* line, size_t len);
+
+ private:
+	/** Check whether data may be added to the sendq, quitting the user if the hard sendq is exceeded
+	 * @param len Length of the data which is about to be added, in bytes
+	 * @return True if the data may be added, false if it must be dropped
+	 */
+	bool CheckSendQ(size_t len);
 };
 
 typedef unsigned int already_sent_t;
 
+/** The buffer and flood limits which apply to a local user. They are worked out from
+ * the connect class and the oper privileges of the user by LocalUser::UpdateLimits(),
+ * so that they don't have to be worked out again for every line read or written.
+ * A limit lifted by an oper privilege is ULONG_MAX.
+ */
+struct UserLimits
+{
+	/** Maximum size of the recvq */
+	unsigned long recvqmax;
+
+	/** Size of the sendq above which no more lines are read from the user */
+	unsigned long softsendqmax;
+
+	/** Size of the sendq above which the user is disconnected */
+	unsigned long hardsendqmax;
+
+	/** Command flood penalty above which no more lines are read from the user, in milliseconds */
+	unsigned long penaltymax;
+
+	/** True if the user is delayed rather than disconnected when reaching penaltymax */
+	bool fakelag;
+};
+
+/** Works off the command flood penalty of a local user and resumes reading their recvq.
+ * It is only scheduled while there is a penalty to decay or reading has been stopped,
+ * so idle users cost nothing.
+ */
+class CoreExport UserFloodTimer : public Timer
+{
+	LocalUser* const user;
+
+	/** True if the timer is in the timer queue */
+	bool scheduled;
+
+ public:
+	UserFloodTimer(LocalUser* me);
+
+	/** Make the timer fire one second from now, unless it is already scheduled
+	 */
+	void Schedule();
+
+	bool Tick(time_t TIME) CXX11_OVERRIDE;
+};
+
+/** Enforces the registration timeout of a local user and pings them once they have
+ * been idle for the ping interval of their connect class.
+ */
+class CoreExport UserPingTimer : public Timer
+{
+	LocalUser* const user;
+
+ public:
+	UserPingTimer(LocalUser* me);
+
+	/** Make the timer fire at the next time the user has to be checked. This is every
+	 * second while the user is registering and when the next ping is due afterwards.
+	 */
+	void Schedule();
+
+	bool Tick(time_t TIME) CXX11_OVERRIDE;
+};
+
 class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public intrusive_list_node<LocalUser>
 {
  public:
@@ -669,6 +768,14 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 
 	UserIOHandler eh;
 
+	/** Decays CommandFloodPenalty while it is nonzero
+	 */
+	UserFloodTimer floodtimer;
+
+	/** Sends pings and enforces the registration timeout
+	 */
+	UserPingTimer pingtimer;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
@@ -700,6 +807,16 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	 */
 	ConnectClass* GetClass() const { return MyClass; }
 
+	/** The limits of this user, see UpdateLimits()
+	 */
+	UserLimits Limits;
+
+	/** Work out Limits again from the connect class and oper privileges of the user.
+	 * This is done by SetClass(), on oper up and down, and on rehash. Code which
+	 * changes MyClass without calling SetClass() must call it.
+	 */
+	void UpdateLimits();
+
 	/** Call this method to find the matching \<connect> for a user, and to check them against it.
 	 */
 	void CheckClass(bool clone_count = true);
@@ -768,6 +885,20 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line prepared by MakeLine() to this user. The line is queued on
+	 * the user's sendq by reference, so it can be sent to any number of users
+	 * while only being stored once.
+	 * @param line The line to send, terminated by CR/LF
+	 */
+	void Write(const SharedBufferRef& line);
+
+	/** Prepare a line for sending to one or more users with Write(const SharedBufferRef&).
+	 * The line is cropped to the maximum line length and CR/LF is appended to it.
+	 * @param text The line to prepare, without CR/LF
+	 * @return A shared buffer containing the line
+	 */
+	static SharedBufferRef MakeLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -807,6 +938,13 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	 */
 	bool HasPrivPermission(const std::string &privstr, bool noisy = false);
 
+	/** Returns true if a user has a given permission, see the overload above.
+	 * @param priv The priv to check, with its number cached so that the check is cheap
+	 * @param noisy If set to true, the user is notified that they do not have the specified permission where applicable. If false, no notification is sent.
+	 * @return True if this user has the permission in question.
+	 */
+	bool HasPrivPermission(const PrivilegeID& priv, bool noisy = false);
+
 	/** Returns true or false if a user can set a privileged user or channel mode.
 	 * This is done by looking up their oper type from User::oper, then referencing
 	 * this to their oper classes, and checking the modes they can set.
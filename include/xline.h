@@ -115,6 +115,14 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Returns the part of the mask of this line which is matched against
+	 * the host or IP address of a user. XLineManager uses this to index the
+	 * line so that it does not have to be checked against every user.
+	 * Lines which are not matched on a host return an empty string, which
+	 * makes them be checked against every user.
+	 */
+	virtual const std::string& GetHostMask();
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -178,6 +186,8 @@ class CoreExport KLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual const std::string& GetHostMask();
+
 	virtual bool IsBurstable();
 
 	/** Ident mask (ident part only)
@@ -224,6 +234,8 @@ class CoreExport GLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual const std::string& GetHostMask();
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -268,6 +280,8 @@ class CoreExport ELine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual const std::string& GetHostMask();
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -309,6 +323,8 @@ class CoreExport ZLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual const std::string& GetHostMask();
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -391,6 +407,84 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** An index of xlines which is used to find the lines which may match a
+ * user without checking every line. Lines are sorted by their host mask
+ * (see XLine::GetHostMask()) into one of three groups: CIDR ranges, which
+ * are looked up by prefix length and masked address; plain hosts and IP
+ * addresses (see HostIndex::IsExactMask()), which are looked up by the host
+ * or IP address of the user; and everything else, such as masks with
+ * wildcards, which has to be checked against every user.
+ */
+class CoreExport XLineIndex
+{
+ public:
+	/** A line and its ordinal, the number of lines which were added to the index before it.
+	 * Lines are returned in the order they were added, by sorting on the ordinal.
+	 */
+	typedef std::pair<unsigned long, XLine*> Entry;
+
+	/** Lines keyed by their ordinal
+	 */
+	typedef std::map<unsigned long, XLine*> LineMap;
+
+ private:
+	/** Lines whose host mask is a plain host or IP address
+	 */
+	HostIndex<Entry> hosts;
+
+	/** Lines whose host mask could not be indexed, or which have no host mask
+	 */
+	LineMap wildcards;
+
+	/** The ordinal of every line in the index
+	 */
+	TR1NS::unordered_map<XLine*, unsigned long> ordinals;
+
+	/** The ordinal the next line added will get
+	 */
+	unsigned long nextordinal;
+
+ public:
+	/** Create an empty index
+	 */
+	XLineIndex();
+
+	/** Add a line to the index
+	 */
+	void Add(XLine* line);
+
+	/** Remove a line from the index
+	 */
+	void Remove(XLine* line);
+
+	/** Get the lines which are indexed by host or IP address and may match
+	 * the given host and address. The lines still have to be checked with
+	 * XLine::Matches().
+	 * @param host The host to look up
+	 * @param ip The IP address to look up, as a string
+	 * @param sa The IP address to look up
+	 * @param out The list to fill in, sorted by ordinal and without duplicates
+	 */
+	void FindCandidates(const std::string& host, const std::string& ip, const irc::sockets::sockaddrs& sa, std::vector<Entry>& out) const;
+
+	/** Get the lines which are indexed by host or IP address and may match the given user
+	 * @param user The user to look up
+	 * @param out The list to fill in, sorted by ordinal and without duplicates
+	 */
+	void FindCandidates(User* user, std::vector<Entry>& out) const
+	{
+		FindCandidates(user->host, user->GetIPString(), user->client_sa, out);
+	}
+
+	/** Get the lines which have to be checked against every user
+	 */
+	const LineMap& GetWildcards() const { return wildcards; }
+
+	/** Check whether the index is empty
+	 */
+	bool empty() const { return hosts.empty() && wildcards.empty(); }
+};
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -413,6 +507,10 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Indexes of all lines, by line type, used to speed up matching
+	 */
+	std::map<std::string, XLineIndex> line_index;
+
  public:
 
 	/** Constructor
@@ -28,6 +28,12 @@
 #include <cstdarg>
 #include "mode.h"
 
+namespace
+{
+	/** Opers with this privilege can see the members of any channel */
+	const PrivilegeID AuspexPriv("channels/auspex");
+}
+
 namespace
 {
 	ChanModeReference ban(NULL, "ban");
@@ -63,11 +69,11 @@ void Channel::SetTopic(User* u, const std::string& ntopic)
 
 Membership* Channel::AddUser(User* user)
 {
-	Membership*& memb = userlist[user];
-	if (memb)
+	if (userlist.find(user) != userlist.end())
 		return NULL;
 
-	memb = new Membership(user, this);
+	Membership* memb = new Membership(user, this);
+	userlist.insert(memb);
 	return memb;
 }
 
@@ -106,6 +112,7 @@ void Channel::DelUser(const UserMembIter& membiter)
 	memb->cull();
 	delete memb;
 	userlist.erase(membiter);
+	InvalidateNamesCache();
 
 	// If this channel became empty then it should be removed
 	CheckDestroy();
@@ -443,8 +450,9 @@ void Channel::PartUser(User *user, std::string &reason)
 
 		// Remove this channel from the user's chanlist
 		user->chans.erase(memb);
-		// Remove the Membership from this channel's userlist and destroy it
-		this->DelUser(membiter);
+		// Remove the Membership from this channel's userlist and destroy it. The hooks
+		// above may have changed the userlist, so membiter cannot be used here.
+		this->DelUser(user);
 	}
 }
 
@@ -497,7 +505,7 @@ void Channel::KickUser(User* src, User* victim, const std::string& reason, Membe
 	WriteAllExcept(src, false, 0, except_list, "KICK %s %s :%s", name.c_str(), victim->nick.c_str(), reason.c_str());
 
 	victim->chans.erase(memb);
-	this->DelUser(victimiter);
+	this->DelUser(victim);
 }
 
 void Channel::WriteChannel(User* user, const char* text, ...)
@@ -509,12 +517,12 @@ void Channel::WriteChannel(User* user, const char* text, ...)
 
 void Channel::WriteChannel(User* user, const std::string &text)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + text;
+	const SharedBufferRef message = LocalUser::MakeLine(":" + user->GetFullHost() + " " + text);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
+		if (i->IsLocal())
+			static_cast<LocalUser*>(i->first)->Write(message);
 	}
 }
 
@@ -527,12 +535,12 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const char* text
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const std::string &text)
 {
-	const std::string message = ":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text;
+	const SharedBufferRef message = LocalUser::MakeLine(":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
+		if (i->IsLocal())
+			static_cast<LocalUser*>(i->first)->Write(message);
 	}
 }
 
@@ -568,16 +576,20 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
+	if (minrank)
+		userlist.CheckRanks();
+
+	// Every recipient gets a reference to the same buffer
+	const SharedBufferRef buffer = LocalUser::MakeLine(out);
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
-		{
-			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
-				continue;
+		/* User isn't local or doesn't have the status we're after */
+		if ((!i->IsLocal()) || (i->rank < minrank))
+			continue;
 
-			i->first->Write(out);
-		}
+		LocalUser* lu = static_cast<LocalUser*>(i->first);
+		if (except_list.find(lu) == except_list.end())
+			lu->Write(buffer);
 	}
 }
 
@@ -630,8 +642,9 @@ const char* Channel::ChanModes(bool showkey)
  */
 void Channel::UserList(User *user)
 {
-	bool has_privs = user->HasPrivPermission("channels/auspex");
-	if (this->IsModeSet(secretmode) && !this->HasUser(user) && !has_privs)
+	bool has_privs = user->HasPrivPermission(AuspexPriv);
+	bool has_user = this->HasUser(user);
+	if (this->IsModeSet(secretmode) && !has_user && !has_privs)
 	{
 		user->WriteNumeric(ERR_NOSUCHNICK, "%s :No such nick/channel", this->name.c_str());
 		return;
@@ -643,18 +656,74 @@ void Channel::UserList(User *user)
 	list.append(this->name).append(" :");
 	std::string::size_type pos = list.size();
 
-	bool has_one = false;
-
-	/* Improvement by Brain - this doesnt change in value, so why was it inside
-	 * the loop?
+	/* Users who can see everyone get a cached list; only members who joined since it
+	 * was last sent have to be formatted.
 	 */
-	bool has_user = this->HasUser(user);
+	NamesCache* cache = ((has_user || has_privs) ? GetNamesCache(user) : NULL);
+	std::vector<std::string> uncached;
+	const std::vector<std::string>* lines = &uncached;
+	if (cache)
+	{
+		if (cache->members < userlist.size())
+		{
+			BuildNamesList(user, userlist.begin() + cache->members, true, cache->lines);
+			cache->members = userlist.size();
+		}
+		lines = &cache->lines;
+	}
+	else
+	{
+		BuildNamesList(user, userlist.begin(), (has_user || has_privs), uncached);
+	}
+
+	for (std::vector<std::string>::const_iterator i = lines->begin(); i != lines->end(); ++i)
+	{
+		list.erase(pos);
+		list.append(*i);
+		user->WriteNumeric(RPL_NAMREPLY, list);
+	}
+
+	user->WriteNumeric(RPL_ENDOFNAMES, "%s :End of /NAMES list.", this->name.c_str());
+}
+
+Channel::NamesCache* Channel::GetNamesCache(User* user)
+{
+	std::string key;
+	ModResult res;
+	FIRST_MOD_RESULT(OnNamesListCacheKey, res, (user, this, key));
+	if (res == MOD_RES_DENY)
+		return NULL;
+
+	// A module which changes NAMES list items but does not provide a cache key disables the cache
+	const IntModuleList& itemhandlers = ServerInstance->Modules->EventHandlers[I_OnNamesListItem];
+	const IntModuleList& keyhandlers = ServerInstance->Modules->EventHandlers[I_OnNamesListCacheKey];
+	for (IntModuleList::const_iterator i = itemhandlers.begin(); i != itemhandlers.end(); ++i)
+	{
+		if (std::find(keyhandlers.begin(), keyhandlers.end(), *i) == keyhandlers.end())
+			return NULL;
+	}
+
+	// Prefix modes were added or removed since the list was built, every member may look different
+	NamesCache& cache = namescache[key];
+	if (cache.prefixserial != ServerInstance->Modes->GetPrefixSerial())
+	{
+		cache.lines.clear();
+		cache.members = 0;
+		cache.prefixserial = ServerInstance->Modes->GetPrefixSerial();
+	}
+	return &cache;
+}
+
+void Channel::BuildNamesList(User* user, UserMembCIter first, bool showinvisible, std::vector<std::string>& lines)
+{
+	// The numeric is split into lines of at most 480 characters, including the part identifying the channel
+	const std::string::size_type maxlen = 480 - (this->name.length() + 4);
 
 	std::string prefixlist;
 	std::string nick;
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+	for (UserMembCIter i = first; i != userlist.end(); ++i)
 	{
-		if ((!has_user) && (i->first->IsModeSet(invisiblemode)) && (!has_privs))
+		if ((!showinvisible) && (i->first->IsModeSet(invisiblemode)))
 		{
 			/*
 			 * user is +i, and source not on the channel, does not show
@@ -666,7 +735,9 @@ void Channel::UserList(User *user)
 		Membership* memb = i->second;
 
 		prefixlist.clear();
-		prefixlist.push_back(memb->GetPrefixChar());
+		char prefix = memb->GetPrefixChar();
+		if (prefix)
+			prefixlist.push_back(prefix);
 		nick = i->first->nick;
 
 		FOREACH_MOD(OnNamesListItem, (user, memb, prefixlist, nick));
@@ -675,28 +746,12 @@ void Channel::UserList(User *user)
 		if (nick.empty())
 			continue;
 
-		if (list.size() + prefixlist.length() + nick.length() + 1 > 480)
-		{
-			/* list overflowed into multiple numerics */
-			user->WriteNumeric(RPL_NAMREPLY, list);
-
-			// Erase all nicks, keep the constant part
-			list.erase(pos);
-			has_one = false;
-		}
-
-		list.append(prefixlist).append(nick).push_back(' ');
-
-		has_one = true;
-	}
+		/* list overflowed into multiple numerics */
+		if ((lines.empty()) || (lines.back().length() + prefixlist.length() + nick.length() + 1 > maxlen))
+			lines.push_back(std::string());
 
-	/* if whats left in the list isnt empty, send it */
-	if (has_one)
-	{
-		user->WriteNumeric(RPL_NAMREPLY, list);
+		lines.back().append(prefixlist).append(nick).push_back(' ');
 	}
-
-	user->WriteNumeric(RPL_ENDOFNAMES, "%s :End of /NAMES list.", this->name.c_str());
 }
 
 /* returns the status character for a given user on a channel, e.g. @ for op,
@@ -705,48 +760,54 @@ void Channel::UserList(User *user)
  */
 char Membership::GetPrefixChar() const
 {
-	char pf = 0;
-	unsigned int bestrank = 0;
-
-	for (std::string::const_iterator i = modes.begin(); i != modes.end(); ++i)
-	{
-		PrefixMode* mh = ServerInstance->Modes->FindPrefixMode(*i);
-		if (mh && mh->GetPrefixRank() > bestrank && mh->GetPrefix())
-		{
-			bestrank = mh->GetPrefixRank();
-			pf = mh->GetPrefix();
-		}
-	}
-	return pf;
+	CheckPrefixCache();
+	return cachedprefix;
 }
 
-unsigned int Membership::getRank()
+unsigned int Membership::getRank() const
 {
-	char mchar = modes.c_str()[0];
-	unsigned int rv = 0;
-	if (mchar)
-	{
-		PrefixMode* mh = ServerInstance->Modes->FindPrefixMode(mchar);
-		if (mh)
-			rv = mh->GetPrefixRank();
-	}
-	return rv;
+	CheckPrefixCache();
+	return cachedrank;
 }
 
 const char* Membership::GetAllPrefixChars() const
 {
-	static char prefix[64];
-	int ctr = 0;
+	CheckPrefixCache();
+	return cachedprefixes.c_str();
+}
+
+void Membership::CheckPrefixCache() const
+{
+	const unsigned int serial = ServerInstance->Modes->GetPrefixSerial();
+	if (cacheserial == serial)
+		return;
+
+	cachedrank = 0;
+	cachedprefix = 0;
+	cachedprefixes.clear();
 
+	// The mode list is sorted by rank so the first mode is the highest
+	unsigned int bestrank = 0;
 	for (std::string::const_iterator i = modes.begin(); i != modes.end(); ++i)
 	{
 		PrefixMode* mh = ServerInstance->Modes->FindPrefixMode(*i);
-		if (mh && mh->GetPrefix())
-			prefix[ctr++] = mh->GetPrefix();
-	}
-	prefix[ctr] = 0;
+		if (!mh)
+			continue;
+
+		if (i == modes.begin())
+			cachedrank = mh->GetPrefixRank();
 
-	return prefix;
+		if (mh->GetPrefix())
+		{
+			if (mh->GetPrefixRank() > bestrank)
+			{
+				bestrank = mh->GetPrefixRank();
+				cachedprefix = mh->GetPrefix();
+			}
+			cachedprefixes.push_back(mh->GetPrefix());
+		}
+	}
+	cacheserial = serial;
 }
 
 unsigned int Channel::GetPrefixValue(User* user)
@@ -760,6 +821,8 @@ unsigned int Channel::GetPrefixValue(User* user)
 bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 {
 	char prefix = delta_mh->GetModeChar();
+	bool changed = adding;
+	bool found = false;
 	for (unsigned int i = 0; i < modes.length(); i++)
 	{
 		char mchar = modes[i];
@@ -769,12 +832,76 @@ bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 			modes = modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				modes.substr(mchar == prefix ? i+1 : i);
-			return adding != (mchar == prefix);
+			changed = (adding != (mchar == prefix));
+			found = true;
+			break;
 		}
 	}
-	if (adding)
+	if ((adding) && (!found))
 		modes.push_back(prefix);
-	return adding;
+
+	if (changed)
+	{
+		// Recompute the cached prefix information now rather than on the next lookup
+		cacheserial = 0;
+		chan->userlist.SetRank(user, getRank());
+		chan->InvalidateNamesCache();
+	}
+	return changed;
+}
+
+void UserMembList::insert(Membership* memb)
+{
+	MemberEntry entry;
+	entry.first = memb->user;
+	entry.second = memb;
+	entry.rank = memb->getRank();
+	entry.flags = (IS_LOCAL(memb->user) ? MemberEntry::FLAG_LOCAL : 0);
+	members.push_back(entry);
+
+	if (!index.empty())
+		index[memb->user] = members.size() - 1;
+	else if (members.size() > INDEX_MIN)
+	{
+		// The channel has grown large enough to be worth indexing
+		for (size_t i = 0; i < members.size(); ++i)
+			index[members[i].first] = i;
+	}
+}
+
+void UserMembList::erase(iterator it)
+{
+	// Move the last member into the place of the removed one
+	if (!index.empty())
+		index.erase(it->first);
+	if (it != members.end() - 1)
+	{
+		*it = members.back();
+		if (!index.empty())
+			index[it->first] = it - members.begin();
+	}
+	members.pop_back();
+
+	if (members.empty())
+		index.clear();
+}
+
+void UserMembList::SetRank(User* user, unsigned int rank)
+{
+	iterator it = find(user);
+	if (it != end())
+		it->rank = rank;
+}
+
+void UserMembList::CheckRanks()
+{
+	const unsigned int serial = ServerInstance->Modes->GetPrefixSerial();
+	if (rankserial == serial)
+		return;
+
+	for (iterator i = members.begin(); i != members.end(); ++i)
+		i->rank = i->second->getRank();
+	rankserial = serial;
 }
 
 void Invitation::Create(Channel* c, LocalUser* u, time_t timeout)
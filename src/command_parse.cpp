@@ -159,31 +159,92 @@ CmdResult CommandParser::CallHandler(const std::string& commandname, const std::
 	return CMD_INVALID;
 }
 
+namespace
+{
+	/** Split a line into tokens the same way irc::tokenstream does, without copying
+	 * any part of it. A token other than the first which starts with a colon extends
+	 * to the end of the line.
+	 * @param line The line to split
+	 * @param tokens Cleared, then filled with the tokens of the line
+	 */
+	void SplitLine(const std::string& line, std::vector<irc::string_view>& tokens)
+	{
+		tokens.clear();
+		const char* pos = line.data();
+		const char* const end = pos + line.length();
+		while (true)
+		{
+			while ((pos != end) && (*pos == ' '))
+				pos++;
+			if (pos == end)
+				break;
+
+			if ((*pos == ':') && (!tokens.empty()))
+			{
+				tokens.push_back(irc::string_view(pos + 1, end - pos - 1));
+				break;
+			}
+
+			const char* tokenend = static_cast<const char*>(memchr(pos, ' ', end - pos));
+			if (!tokenend)
+				tokenend = end;
+			tokens.push_back(irc::string_view(pos, tokenend - pos));
+			pos = tokenend;
+		}
+	}
+
+	/** Opers with this privilege are exempt from the command flood penalty */
+	const PrivilegeID NoThrottlePriv("users/flood/no-throttle");
+
+	/** Keeps track of the recursion depth of CommandParser::ProcessCommand() */
+	class ParseDepthGuard
+	{
+		size_t& depth;
+
+	 public:
+		ParseDepthGuard(size_t& d) : depth(d) { depth++; }
+		~ParseDepthGuard() { depth--; }
+	};
+}
+
 void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 {
-	std::vector<std::string> command_p;
-	irc::tokenstream tokens(cmd);
-	std::string command, token;
-	tokens.GetToken(command);
+	// Reuse the storage of an earlier call at this depth, a deque never moves its elements
+	if (parsestates.size() <= parsedepth)
+		parsestates.push_back(ParseState());
+	ParseState& state = parsestates[parsedepth];
+	ParseDepthGuard guard(parsedepth);
+
+	std::vector<irc::string_view>& tokens = state.tokens;
+	SplitLine(cmd, tokens);
 
 	/* A client sent a nick prefix on their command (ick)
 	 * rhapsody and some braindead bouncers do this --
 	 * the rfc says they shouldnt but also says the ircd should
 	 * discard it if they do.
 	 */
-	if (command[0] == ':')
-		tokens.GetToken(command);
-
-	while (tokens.GetToken(token))
-		command_p.push_back(token);
+	size_t first = 0;
+	if ((!tokens.empty()) && (tokens[0][0] == ':'))
+		first = 1;
 
+	std::string& command = state.command;
+	if (first < tokens.size())
+		command.assign(tokens[first].data(), tokens[first].length());
+	else
+		command.clear();
 	std::transform(command.begin(), command.end(), command.begin(), ::toupper);
 
+	// Assigning to the strings left by the previous line normally fits in their existing buffers
+	std::vector<std::string>& command_p = state.params;
+	command_p.resize(tokens.size() > first ? tokens.size() - first - 1 : 0);
+	for (size_t i = 0; i < command_p.size(); i++)
+		command_p[i].assign(tokens[first + i + 1].data(), tokens[first + i + 1].length());
+
 	/* find the command, check it exists */
 	Command* handler = GetHandler(command);
 
 	/* Modify the user's penalty regardless of whether or not the command exists */
-	if (!user->HasPrivPermission("users/flood/no-throttle"))
+	if (!user->HasPrivPermission(NoThrottlePriv))
 	{
 		// If it *doesn't* exist, give it a slightly heftier penalty than normal to deter flooding us crap
 		user->CommandFloodPenalty += handler ? handler->Penalty * 1000 : 2000;
@@ -358,6 +419,7 @@ bool CommandParser::AddCommand(Command *f)
 }
 
 CommandParser::CommandParser()
+	: parsedepth(0)
 {
 }
 
@@ -142,9 +142,13 @@ class Packet : public Query
 		record.ttl = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
 		pos += 4;
 
-		//record.rdlength = input[pos] << 8 | input[pos + 1];
+		const unsigned short rdlength = input[pos] << 8 | input[pos + 1];
 		pos += 2;
 
+		if (rdlength > input_size - pos)
+			throw Exception("Unable to unpack resource record");
+		const size_t rdata_end = pos + rdlength;
+
 		switch (record.type)
 		{
 			case QUERY_A:
@@ -185,10 +189,29 @@ class Packet : public Query
 				record.rdata = this->UnpackName(input, input_size, pos);
 				break;
 			}
+			case QUERY_SOA:
+			{
+				/* Keep the primary nameserver as the rdata. The TTL is limited to the
+				 * minimum field as that is how long a negative answer may be cached.
+				 */
+				record.rdata = this->UnpackName(input, input_size, pos);
+				this->UnpackName(input, input_size, pos);
+
+				if (pos + 20 > input_size)
+					throw Exception("Unable to unpack resource record");
+
+				const unsigned int minimum = (input[pos + 16] << 24) | (input[pos + 17] << 16) | (input[pos + 18] << 8) | input[pos + 19];
+				if (minimum < record.ttl)
+					record.ttl = minimum;
+				break;
+			}
 			default:
 				break;
 		}
 
+		/* Skip anything in the rdata which wasn't used, including the rdata of unknown record types */
+		pos = rdata_end;
+
 		if (!record.name.empty() && !record.rdata.empty())
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: " + record.name + " -> " + record.rdata);
 
@@ -200,6 +223,8 @@ class Packet : public Query
 	static const int LABEL = 0x3F;
 	static const int HEADER_LENGTH = 12;
 
+	/* Records from the authority section, only SOA records are used */
+	std::vector<ResourceRecord> authorities;
 	/* ID for this packet */
 	unsigned short id;
 	/* Flags on the packet */
@@ -244,6 +269,23 @@ class Packet : public Query
 
 		for (unsigned i = 0; i < ancount; ++i)
 			this->answers.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+
+		/* The authority section is only needed for negative caching, so a
+		 * malformed record here doesn't make the rest of the packet invalid.
+		 */
+		try
+		{
+			for (unsigned i = 0; i < nscount; ++i)
+			{
+				ResourceRecord rr = this->UnpackResourceRecord(input, len, packet_pos);
+				if (rr.type == QUERY_SOA)
+					this->authorities.push_back(rr);
+			}
+		}
+		catch (Exception& ex)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Ignoring authority section: " + ex.GetReason());
+		}
 	}
 
 	unsigned short Pack(unsigned char* output, unsigned short output_size)
@@ -394,17 +436,147 @@ class Packet : public Query
 	}
 };
 
-class MyManager : public Manager, public Timer, public EventHandler
+class MyManager;
+
+/** A socket used to talk to one nameserver, along with the round trip
+ * time used to decide which nameserver to send a query to
+ */
+class Nameserver : public EventHandler
+{
+	MyManager* const manager;
+
+ public:
+	/** Address of the nameserver */
+	irc::sockets::sockaddrs addr;
+	/** Smoothed round trip time in milliseconds */
+	unsigned int srtt;
+
+	Nameserver(MyManager* mgr, const irc::sockets::sockaddrs& address);
+	~Nameserver();
+	void HandleEvent(EventType et, int errornum);
+};
+
+/** A query which has been sent to a nameserver. Every request for the same
+ * question made while it is waiting for an answer is attached to it, so
+ * only one packet goes out no matter how many lookups there are.
+ */
+class PendingQuery : public Timer
+{
+	MyManager* const manager;
+
+ public:
+	/* Id of the query on the wire */
+	unsigned short id;
+	/* The question asked, with PTR names already reversed */
+	Question question;
+	/* Requests waiting for the answer */
+	std::vector<DNS::Request*> requests;
+	/* The packed query, kept so it can be resent */
+	std::string packet;
+	/* Nameservers the query has been sent to, the last one is the current one */
+	std::vector<Nameserver*> servers;
+	/* Time the query was last sent, in milliseconds */
+	uint64_t sent;
+
+	PendingQuery(MyManager* mgr, unsigned short qid, const Question& q, const unsigned char* data, unsigned short len)
+		: Timer(0, ServerInstance->Time())
+		, manager(mgr)
+		, id(qid)
+		, question(q)
+		, packet(reinterpret_cast<const char*>(data), len)
+		, sent(0)
+	{
+	}
+
+	/** Called when the current nameserver hasn't answered in time */
+	bool Tick(time_t now);
+};
+
+class MyManager : public Manager, public Timer
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
+	/* Cache entries ordered by the time they expire at. The keys point into cache. */
+	typedef std::multimap<time_t, const Question*> expiry_map;
+	expiry_map expiries;
+
+	/* Cache entries ordered from most to least recently used. The keys point into cache. */
+	typedef std::list<const Question*> lru_list;
+	lru_list lru;
+
+	/** A cached answer, or a cached error for a name or record which doesn't exist */
+	struct CacheEntry
+	{
+		Query query;
+		time_t expires;
+		expiry_map::iterator expiry;
+		lru_list::iterator used;
+	};
+
+	typedef TR1NS::unordered_map<Question, CacheEntry, Question::hash> cache_map;
 	cache_map cache;
 
-	irc::sockets::sockaddrs myserver;
+	/* The maximum number of entries in the cache before the least recently used ones are evicted */
+	unsigned long maxcache;
+
+	typedef TR1NS::unordered_map<Question, PendingQuery*, Question::hash> inflight_map;
+	inflight_map inflight;
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	/* The nameservers to use, in the order they were configured */
+	std::vector<Nameserver*> servers;
+
+	/* The longest time a nameserver is given to answer before the query is sent again */
+	static const unsigned int MAX_RETRY_MS = 3000;
+	/* The shortest time a nameserver is given to answer before the query is sent again */
+	static const unsigned int MIN_RETRY_MS = 1000;
+	/* The maximum number of times one query is sent */
+	static const unsigned int MAX_SENDS = 3;
+	/* The longest time a negative answer is cached for (RFC 2308) */
+	static const unsigned int MAX_NEGATIVE_TTL = 10800;
+
+	static bool IsExpired(const CacheEntry& entry, time_t now = ServerInstance->Time())
+	{
+		return (entry.expires < now);
+	}
+
+	/** Remove an entry from the cache and from the expiry and usage indexes */
+	void RemoveCache(cache_map::iterator it)
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		this->expiries.erase(it->second.expiry);
+		this->lru.erase(it->second.used);
+		this->cache.erase(it);
+	}
+
+	/** Add or replace an entry in the cache, evicting the least recently used
+	 * entries if this takes the cache over its maximum size.
+	 * @param question The question to cache an answer for
+	 * @param query The answer
+	 * @param ttl How long to keep the answer for
+	 */
+	void SetCache(const Question& question, const Query& query, unsigned int ttl)
+	{
+		std::pair<cache_map::iterator, bool> res = this->cache.insert(std::make_pair(question, CacheEntry()));
+		CacheEntry& entry = res.first->second;
+		const Question* key = &res.first->first;
+		if (res.second)
+		{
+			this->lru.push_front(key);
+			entry.used = this->lru.begin();
+		}
+		else
+		{
+			this->expiries.erase(entry.expiry);
+			this->lru.splice(this->lru.begin(), this->lru, entry.used);
+		}
+
+		entry.query = query;
+		entry.expires = ServerInstance->Time() + ttl;
+		entry.expiry = this->expiries.insert(std::make_pair(entry.expires, key));
+
+		while (this->cache.size() > this->maxcache)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: evicting " + this->lru.back()->name);
+			this->RemoveCache(this->cache.find(*this->lru.back()));
+			ServerInstance->stats->statsDnsCacheEvictions++;
+		}
 	}
 
 	/** Check the DNS cache to see if request can be handled by a cached result
@@ -416,94 +588,216 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 		cache_map::iterator it = this->cache.find(question);
 		if (it == this->cache.end())
+		{
+			ServerInstance->stats->statsDnsCacheMisses++;
 			return false;
+		}
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		CacheEntry& entry = it->second;
+		if (IsExpired(entry))
 		{
-			this->cache.erase(it);
+			this->RemoveCache(it);
+			ServerInstance->stats->statsDnsCacheMisses++;
 			return false;
 		}
 
 		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached result for " + question.name);
-		record.cached = true;
-		req->OnLookupComplete(&record);
+		ServerInstance->stats->statsDnsCacheHits++;
+		this->lru.splice(this->lru.begin(), this->lru, entry.used);
+		entry.query.cached = true;
+		if (entry.query.error != ERROR_NONE)
+			req->OnError(&entry.query);
+		else
+			req->OnLookupComplete(&entry.query);
 		return true;
 	}
 
 	/** Add a record to the dns cache
+	 * @param question The question which was asked
 	 * @param r The record
 	 */
-	void AddCache(Query& r)
+	void AddCache(const Question& question, Query& r)
 	{
+		unsigned int ttl = r.answers[0].ttl;
+		for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
+			ttl = std::min(ttl, i->ttl);
+
 		const ResourceRecord& rr = r.answers[0];
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.questions[0]] = r;
-	}
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(ttl));
 
- public:
-	DNS::Request* requests[MAX_REQUEST_ID];
+		this->SetCache(question, r, ttl);
+	}
 
-	MyManager(Module* c) : Manager(c), Timer(3600, ServerInstance->Time(), true)
+	/** Add a negative answer to the dns cache. It is kept for as long as the
+	 * SOA record in the authority section allows, and not cached if there is none.
+	 * @param question The question which was asked
+	 * @param p The packet holding the negative answer
+	 */
+	void AddNegativeCache(const Question& question, Packet& p)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
-			requests[i] = NULL;
-		ServerInstance->Timers->AddTimer(this);
+		if (p.authorities.empty())
+			return;
+
+		const unsigned int ttl = std::min(p.authorities[0].ttl, MAX_NEGATIVE_TTL);
+		if (!ttl)
+			return;
+
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added negative cache for " + question.name + " ttl: " + ConvToStr(ttl));
+
+		this->SetCache(question, p, ttl);
 	}
 
-	~MyManager()
+	/** Pick the nameserver to send a query to. This is the one with the lowest
+	 * round trip time which hasn't been tried for this query yet. The round
+	 * trip time of the other nameservers decays so that a nameserver which
+	 * was slow or failed once gets tried again later.
+	 * @return The nameserver to use, or NULL if there are no usable nameservers
+	 */
+	Nameserver* PickServer(const PendingQuery* pq)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+		Nameserver* best = NULL;
+		Nameserver* besttried = NULL;
+		for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
 		{
-			DNS::Request* request = requests[i];
-			if (!request)
+			Nameserver* ns = *i;
+			if (ns->GetFd() < 0)
 				continue;
 
+			const bool tried = (std::find(pq->servers.begin(), pq->servers.end(), ns) != pq->servers.end());
+			Nameserver*& current = (tried ? besttried : best);
+			if ((!current) || (ns->srtt < current->srtt))
+				current = ns;
+		}
+
+		if (!best)
+			best = besttried;
+
+		for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+		{
+			Nameserver* ns = *i;
+			if (ns != best)
+				ns->srtt -= ns->srtt / 32;
+		}
+
+		return best;
+	}
+
+	/** Send a query to the best nameserver for it
+	 * @return True if the query was sent
+	 */
+	bool Send(PendingQuery* pq)
+	{
+		Nameserver* ns = PickServer(pq);
+		if (!ns)
+			return false;
+
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Sending query for " + pq->question.name + " to " + ns->addr.addr());
+
+		const ssize_t len = pq->packet.length();
+		if (SocketEngine::SendTo(ns, pq->packet.data(), len, 0, &ns->addr.sa, ns->addr.sa_size()) != len)
+			return false;
+
+		pq->servers.push_back(ns);
+		pq->sent = Timer::GetTimeMs();
+		pq->SetIntervalMs(std::min(std::max(ns->srtt * 2, MIN_RETRY_MS), MAX_RETRY_MS));
+		return true;
+	}
+
+	/** Stop waiting for the answer to a query and free its id
+	 * @param pq The query, which is deleted
+	 */
+	void RemoveQuery(PendingQuery* pq)
+	{
+		for (std::vector<DNS::Request*>::const_iterator i = pq->requests.begin(); i != pq->requests.end(); ++i)
+			(*i)->id = 0;
+
+		ForgetQuery(pq);
+		this->pending[pq->id] = NULL;
+		delete pq;
+	}
+
+	/** Stop attaching new requests for the same question to a query
+	 * @param pq The query, which keeps waiting for an answer
+	 */
+	void ForgetQuery(PendingQuery* pq)
+	{
+		inflight_map::iterator it = this->inflight.find(pq->question);
+		if ((it != this->inflight.end()) && (it->second == pq))
+			this->inflight.erase(it);
+	}
+
+	/** Give up on a query and fail the requests waiting for it
+	 * @param pq The query, which is deleted
+	 * @param error The error to give the requests
+	 */
+	void FailQuery(PendingQuery* pq, Error error)
+	{
+		const std::vector<DNS::Request*> requests(pq->requests);
+		RemoveQuery(pq);
+
+		for (std::vector<DNS::Request*>::const_iterator i = requests.begin(); i != requests.end(); ++i)
+		{
+			DNS::Request* request = *i;
 			Query rr(*request);
-			rr.error = ERROR_UNKNOWN;
+			rr.error = error;
 			request->OnError(&rr);
 
 			delete request;
 		}
 	}
 
-	void Process(DNS::Request* req)
+	/** Find an unused query id
+	 */
+	unsigned short AllocateId()
 	{
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Processing request to lookup " + req->name + " of type " + ConvToStr(req->type) + " to " + this->myserver.addr());
-
-		/* Create an id */
+		unsigned short id;
 		unsigned int tries = 0;
 		do
 		{
-			req->id = ServerInstance->GenRandomInt(DNS::MAX_REQUEST_ID);
+			id = ServerInstance->GenRandomInt(DNS::MAX_REQUEST_ID);
 
 			if (++tries == DNS::MAX_REQUEST_ID*5)
 			{
 				// If we couldn't find an empty slot this many times, do a sequential scan as a last
 				// resort. If an empty slot is found that way, go on, otherwise throw an exception
-				req->id = 0;
 				for (int i = 1; i < DNS::MAX_REQUEST_ID; i++)
 				{
-					if (!this->requests[i])
-					{
-						req->id = i;
-						break;
-					}
+					if (!this->pending[i])
+						return i;
 				}
 
-				if (req->id == 0)
-					throw Exception("DNS: All ids are in use");
-
-				break;
+				throw Exception("DNS: All ids are in use");
 			}
 		}
-		while (!req->id || this->requests[req->id]);
+		while (!id || this->pending[id]);
+
+		return id;
+	}
+
+ public:
+	PendingQuery* pending[MAX_REQUEST_ID];
+
+	MyManager(Module* c) : Manager(c), Timer(1, ServerInstance->Time(), true), maxcache(50000)
+	{
+		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+			pending[i] = NULL;
+		ServerInstance->Timers->AddTimer(this);
+	}
+
+	~MyManager()
+	{
+		FailRequests(NULL, ERROR_UNKNOWN);
+
+		for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+			delete *i;
+	}
 
-		this->requests[req->id] = req;
+	void Process(DNS::Request* req)
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Processing request to lookup " + req->name + " of type " + ConvToStr(req->type));
 
 		Packet p;
 		p.flags = QUERYFLAGS_RD;
-		p.id = req->id;
 		p.questions.push_back(*req);
 
 		unsigned char buffer[524];
@@ -512,20 +806,114 @@ class MyManager : public Manager, public Timer, public EventHandler
 		/* Note that calling Pack() above can actually change the contents of p.questions[0].name, if the query is a PTR,
 		 * to contain the value that would be in the DNS cache, which is why this is here.
 		 */
-		if (req->use_cache && this->CheckCache(req, p.questions[0]))
+		const Question& question = p.questions[0];
+		if (req->use_cache && this->CheckCache(req, question))
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Using cached result");
 			delete req;
 			return;
 		}
 
-		if (SocketEngine::SendTo(this, buffer, len, 0, &this->myserver.sa, this->myserver.sa_size()) != len)
+		/* If the same question has already been asked, wait for that answer instead of asking again */
+		inflight_map::iterator it = this->inflight.find(question);
+		if (it != this->inflight.end())
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Attaching to pending query for " + question.name);
+			req->id = it->second->id;
+			it->second->requests.push_back(req);
+			return;
+		}
+
+		/* The id is filled in now that it is known the query will be sent */
+		const unsigned short id = AllocateId();
+		buffer[0] = id >> 8;
+		buffer[1] = id & 0xFF;
+
+		PendingQuery* pq = new PendingQuery(this, id, question, buffer, len);
+		this->pending[id] = pq;
+		this->inflight[question] = pq;
+		pq->requests.push_back(req);
+		req->id = id;
+
+		if (!this->Send(pq))
+		{
+			RemoveQuery(pq);
 			throw Exception("DNS: Unable to send query");
+		}
+	}
+
+	/** Called when a nameserver hasn't answered a query in time. Penalises
+	 * the nameserver and sends the query again, to another nameserver if
+	 * there is one.
+	 */
+	void Retry(PendingQuery* pq)
+	{
+		if (!pq->servers.empty())
+		{
+			Nameserver* ns = pq->servers.back();
+			ns->srtt = std::min(ns->srtt * 2, MAX_RETRY_MS * 4);
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: No answer from " + ns->addr.addr() + " for " + pq->question.name);
+		}
+
+		if (pq->servers.size() >= MAX_SENDS)
+		{
+			/* The query won't be sent again, a new lookup for the same question has to ask again rather than
+			 * wait for this one. The requests waiting for it still take a late answer until they time out.
+			 */
+			ForgetQuery(pq);
+			return;
+		}
+
+		if (!this->Send(pq))
+			FailQuery(pq, ERROR_UNKNOWN);
 	}
 
 	void RemoveRequest(DNS::Request* req)
 	{
-		this->requests[req->id] = NULL;
+		PendingQuery* pq = this->pending[req->id];
+		req->id = 0;
+		if (!pq)
+			return;
+
+		std::vector<DNS::Request*>::iterator it = std::find(pq->requests.begin(), pq->requests.end(), req);
+		if (it != pq->requests.end())
+			pq->requests.erase(it);
+
+		/* Nobody is waiting for the answer any more */
+		if (pq->requests.empty())
+			RemoveQuery(pq);
+	}
+
+	/** Fail waiting requests
+	 * @param mod The module whose requests to fail, or NULL to fail all requests
+	 * @param error The error to give the requests
+	 */
+	void FailRequests(Module* mod, Error error)
+	{
+		std::vector<DNS::Request*> failed;
+		/* Queries which won't be sent again aren't in inflight, but their requests still wait */
+		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+		{
+			if (!this->pending[i])
+				continue;
+
+			const std::vector<DNS::Request*>& requests = this->pending[i]->requests;
+			for (std::vector<DNS::Request*>::const_iterator j = requests.begin(); j != requests.end(); ++j)
+			{
+				if ((!mod) || ((*j)->creator == mod))
+					failed.push_back(*j);
+			}
+		}
+
+		for (std::vector<DNS::Request*>::const_iterator i = failed.begin(); i != failed.end(); ++i)
+		{
+			DNS::Request* request = *i;
+			Query rr(*request);
+			rr.error = error;
+			request->OnError(&rr);
+
+			delete request;
+		}
 	}
 
 	std::string GetErrorStr(Error e)
@@ -555,19 +943,13 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 	}
 
-	void HandleEvent(EventType et, int)
+	void HandleReply(Nameserver* ns)
 	{
-		if (et == EVENT_ERROR)
-		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: UDP socket got an error event");
-			return;
-		}
-
 		unsigned char buffer[524];
 		irc::sockets::sockaddrs from;
 		socklen_t x = sizeof(from);
 
-		int length = SocketEngine::RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
+		int length = SocketEngine::RecvFrom(ns, buffer, sizeof(buffer), 0, &from.sa, &x);
 
 		if (length < Packet::HEADER_LENGTH)
 			return;
@@ -584,28 +966,52 @@ class MyManager : public Manager, public Timer, public EventHandler
 			return;
 		}
 
-		if (myserver != from)
+		if (ns->addr != from)
 		{
 			std::string server1 = from.str();
-			std::string server2 = myserver.str();
+			std::string server2 = ns->addr.str();
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
 				server1.c_str(), server2.c_str());
 			return;
 		}
 
-		DNS::Request* request = this->requests[recv_packet.id];
-		if (request == NULL)
+		PendingQuery* pq = this->pending[recv_packet.id];
+		if ((pq == NULL) || (std::find(pq->servers.begin(), pq->servers.end(), ns) == pq->servers.end()))
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received an answer for something we didn't request");
 			return;
 		}
 
+		/* The answer is shared by everyone waiting for the query and cached, so it must be for exactly the question which was asked */
+		if (recv_packet.questions.empty() || !(recv_packet.questions[0] == pq->question))
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received an answer to a different question than " + pq->question.name + ", DNS forging attempt?");
+			return;
+		}
+
+		/* Only measure the round trip time if the query was sent once, otherwise
+		 * it isn't known which copy is being answered.
+		 */
+		if (pq->servers.size() == 1)
+		{
+			const unsigned int rtt = std::min<uint64_t>(Timer::GetTimeMs() - pq->sent, MAX_RETRY_MS * 4);
+			ns->srtt = (ns->srtt * 7 + rtt) / 8;
+		}
+
+		/* Take the waiting requests before the query is removed, as their callbacks may make new requests */
+		std::vector<DNS::Request*> requests;
+		requests.swap(pq->requests);
+		const Question question = pq->question;
+		RemoveQuery(pq);
+
+		/* The id may be reused by a new query before these requests are deleted */
+		for (std::vector<DNS::Request*>::const_iterator i = requests.begin(); i != requests.end(); ++i)
+			(*i)->id = 0;
+
 		if (recv_packet.flags & QUERYFLAGS_OPCODE)
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received a nonstandard query");
-			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = ERROR_NONSTANDARD_QUERY;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.flags & QUERYFLAGS_RCODE)
 		{
@@ -637,93 +1043,186 @@ class MyManager : public Manager, public Timer, public EventHandler
 					break;
 			}
 
-			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = error;
-			request->OnError(&recv_packet);
+			if (error == ERROR_DOMAIN_NOT_FOUND)
+				this->AddNegativeCache(question, recv_packet);
 		}
-		else if (recv_packet.questions.empty() || recv_packet.answers.empty())
+		else if (recv_packet.answers.empty())
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: No resource records returned");
-			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = ERROR_NO_RECORDS;
-			request->OnError(&recv_packet);
+			this->AddNegativeCache(question, recv_packet);
 		}
 		else
 		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Lookup complete for " + request->name);
-			ServerInstance->stats->statsDnsGood++;
-			request->OnLookupComplete(&recv_packet);
-			this->AddCache(recv_packet);
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Lookup complete for " + question.name);
+			this->AddCache(question, recv_packet);
 		}
 
-		ServerInstance->stats->statsDns++;
+		for (std::vector<DNS::Request*>::const_iterator i = requests.begin(); i != requests.end(); ++i)
+		{
+			DNS::Request* request = *i;
+			if (recv_packet.error == ERROR_NONE)
+			{
+				ServerInstance->stats->statsDnsGood++;
+				request->OnLookupComplete(&recv_packet);
+			}
+			else
+			{
+				ServerInstance->stats->statsDnsBad++;
+				request->OnError(&recv_packet);
+			}
+
+			ServerInstance->stats->statsDns++;
 
-		/* Request's destructor removes it from the request map */
-		delete request;
+			/* Request's destructor removes it from the request map */
+			delete request;
+		}
 	}
 
+	/** Remove the entries which have expired from the cache. This runs every
+	 * second and only looks at the entries which are due, so the cache never
+	 * has to be walked in full.
+	 */
 	bool Tick(time_t now)
 	{
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: purging DNS cache");
-
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+		while (!this->expiries.empty() && this->expiries.begin()->first < now)
 		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
-			else
-				++it;
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: expiring " + this->expiries.begin()->second->name);
+			this->RemoveCache(this->cache.find(*this->expiries.begin()->second));
 		}
 		return true;
 	}
 
-	void Rehash(const std::string& dnsserver)
+	/** Get the number of entries in the cache */
+	size_t GetCacheSize() const
+	{
+		return this->cache.size();
+	}
+
+	/** Set the maximum number of entries in the cache, evicting the least
+	 * recently used entries if there are more than this already.
+	 */
+	void SetMaxCache(unsigned long max)
 	{
-		if (this->GetFd() > -1)
+		this->maxcache = max;
+		while (this->cache.size() > this->maxcache)
 		{
-			SocketEngine::Shutdown(this, 2);
-			SocketEngine::Close(this);
+			this->RemoveCache(this->cache.find(*this->lru.back()));
+			ServerInstance->stats->statsDnsCacheEvictions++;
+		}
+	}
 
-			/* Remove expired entries from the cache */
-			this->Tick(ServerInstance->Time());
+	void Rehash(const std::string& dnsservers)
+	{
+		if (!this->servers.empty())
+		{
+			for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+				delete *i;
+			this->servers.clear();
 		}
 
-		irc::sockets::aptosa(dnsserver, DNS::PORT, myserver);
+		irc::spacesepstream sep(dnsservers);
+		std::string server;
+		while (sep.GetToken(server))
+		{
+			irc::sockets::sockaddrs addr;
+			if (!irc::sockets::aptosa(server, DNS::PORT, addr))
+			{
+				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: '%s' is not a valid nameserver address, ignoring it", server.c_str());
+				continue;
+			}
 
-		/* Initialize mastersocket */
-		int s = socket(myserver.sa.sa_family, SOCK_DGRAM, 0);
-		this->SetFd(s);
+			Nameserver* ns = new Nameserver(this, addr);
+			if (ns->GetFd() < 0)
+				delete ns;
+			else
+				this->servers.push_back(ns);
+		}
 
-		/* Have we got a socket? */
-		if (this->GetFd() != -1)
+		if (this->servers.empty())
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: No usable nameservers - hostnames will NOT resolve");
+
+		/* Send the queries which were waiting for an answer from the old nameservers again,
+		 * the requests of those which can't be sent are failed rather than left waiting
+		 */
+		for (int i = 0; i < MAX_REQUEST_ID; ++i)
 		{
-			SocketEngine::SetReuse(s);
-			SocketEngine::NonBlocking(s);
+			PendingQuery* pq = this->pending[i];
+			if (!pq)
+				continue;
 
-			irc::sockets::sockaddrs bindto;
-			memset(&bindto, 0, sizeof(bindto));
-			bindto.sa.sa_family = myserver.sa.sa_family;
+			pq->servers.clear();
+			if (!this->Send(pq))
+				FailQuery(pq, ERROR_UNKNOWN);
+		}
+	}
+};
 
-			if (SocketEngine::Bind(this->GetFd(), bindto) < 0)
-			{
-				/* Failed to bind */
-				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error binding dns socket - hostnames will NOT resolve");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
-			}
-			else if (!SocketEngine::AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
-			{
-				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Internal error starting DNS - hostnames will NOT resolve.");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
-			}
+Nameserver::Nameserver(MyManager* mgr, const irc::sockets::sockaddrs& address)
+	: manager(mgr)
+	, addr(address)
+	, srtt(100)
+{
+	/* Initialize the socket */
+	int s = socket(addr.sa.sa_family, SOCK_DGRAM, 0);
+	this->SetFd(s);
+
+	/* Have we got a socket? */
+	if (this->GetFd() != -1)
+	{
+		SocketEngine::SetReuse(s);
+		SocketEngine::NonBlocking(s);
+
+		irc::sockets::sockaddrs bindto;
+		memset(&bindto, 0, sizeof(bindto));
+		bindto.sa.sa_family = addr.sa.sa_family;
+
+		if (SocketEngine::Bind(this->GetFd(), bindto) < 0)
+		{
+			/* Failed to bind */
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error binding dns socket for %s", addr.addr().c_str());
+			SocketEngine::Close(this->GetFd());
+			this->SetFd(-1);
 		}
-		else
+		else if (!SocketEngine::AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
 		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error creating DNS socket - hostnames will NOT resolve");
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Internal error starting DNS socket for %s", addr.addr().c_str());
+			SocketEngine::Close(this->GetFd());
+			this->SetFd(-1);
 		}
 	}
-};
+	else
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error creating DNS socket for %s", addr.addr().c_str());
+	}
+}
+
+Nameserver::~Nameserver()
+{
+	if (this->GetFd() > -1)
+	{
+		SocketEngine::Shutdown(this, 2);
+		SocketEngine::Close(this);
+	}
+}
+
+void Nameserver::HandleEvent(EventType et, int)
+{
+	if (et == EVENT_ERROR)
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: UDP socket got an error event");
+		return;
+	}
+
+	manager->HandleReply(this);
+}
+
+bool PendingQuery::Tick(time_t)
+{
+	manager->Retry(this);
+	return true;
+}
 
 class ModuleDNS : public Module
 {
@@ -751,14 +1250,21 @@ class ModuleDNS : public Module
 			if (pFixedInfo)
 			{
 				if (GetNetworkParams(pFixedInfo, &dwBufferSize) == NO_ERROR)
-					DNSServer = pFixedInfo->DnsServerList.IpAddress.String;
+				{
+					for (IP_ADDR_STRING* server = &pFixedInfo->DnsServerList; server; server = server->Next)
+					{
+						if (!DNSServer.empty())
+							DNSServer.push_back(' ');
+						DNSServer.append(server->IpAddress.String);
+					}
+				}
 
 				HeapFree(GetProcessHeap(), 0, pFixedInfo);
 			}
 
 			if (!DNSServer.empty())
 			{
-				ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as first active resolver in the system settings.", DNSServer.c_str());
+				ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' from the active resolvers in the system settings.", DNSServer.c_str());
 				return;
 			}
 		}
@@ -770,19 +1276,27 @@ class ModuleDNS : public Module
 
 		std::ifstream resolv("/etc/resolv.conf");
 
-		while (resolv >> DNSServer)
+		std::string token;
+		while (resolv >> token)
 		{
-			if (DNSServer == "nameserver")
+			if (token == "nameserver")
 			{
-				resolv >> DNSServer;
-				if (DNSServer.find_first_not_of("0123456789.") == std::string::npos)
+				resolv >> token;
+				if (token.find_first_not_of("0123456789.") == std::string::npos)
 				{
-					ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",DNSServer.c_str());
-					return;
+					if (!DNSServer.empty())
+						DNSServer.push_back(' ');
+					DNSServer.append(token);
 				}
 			}
 		}
 
+		if (!DNSServer.empty())
+		{
+			ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' from the resolvers in /etc/resolv.conf.", DNSServer.c_str());
+			return;
+		}
+
 		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 #endif
 		DNSServer = "127.0.0.1";
@@ -795,8 +1309,11 @@ class ModuleDNS : public Module
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("dns");
+		this->manager.SetMaxCache(tag->getInt("cachesize", 50000, 0));
+
 		std::string oldserver = DNSServer;
-		DNSServer = ServerInstance->Config->ConfValue("dns")->getString("server");
+		DNSServer = tag->getString("server");
 		if (DNSServer.empty())
 			FindDNSServer();
 
@@ -806,21 +1323,17 @@ class ModuleDNS : public Module
 
 	void OnUnloadModule(Module* mod)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* req = this->manager.requests[i];
-			if (!req)
-				continue;
+		this->manager.FailRequests(mod, ERROR_UNLOADED);
+	}
 
-			if (req->creator == mod)
-			{
-				Query rr(*req);
-				rr.error = ERROR_UNLOADED;
-				req->OnError(&rr);
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'T')
+			return MOD_RES_PASSTHRU;
 
-				delete req;
-			}
-		}
+		results.push_back("249 " + user->nick + " :dns cache entries " + ConvToStr(this->manager.GetCacheSize()) + " hits " + ConvToStr(ServerInstance->stats->statsDnsCacheHits)
+			+ " misses " + ConvToStr(ServerInstance->stats->statsDnsCacheMisses) + " evicted " + ConvToStr(ServerInstance->stats->statsDnsCacheEvictions));
+		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion()
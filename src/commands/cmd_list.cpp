@@ -29,6 +29,7 @@ class CommandList : public Command
 {
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
+	const PrivilegeID auspexpriv;
 
  public:
 	/** Constructor for list.
@@ -37,6 +38,7 @@ class CommandList : public Command
 		: Command(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, auspexpriv("channels/auspex")
 	{
 		Penalty = 5;
 	}
@@ -90,7 +92,7 @@ CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User
 		}
 
 		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (i->second->HasUser(user) || user->HasPrivPermission("channels/auspex"));
+		bool n = (i->second->HasUser(user) || user->HasPrivPermission(auspexpriv));
 
 		if (!n && i->second->IsModeSet(privatemode))
 		{
@@ -38,6 +38,7 @@ ServerConfig::ServerConfig()
 	NetBufferSize = 10240;
 	SoftLimit = SocketEngine::GetMaxFds();
 	MaxConn = SOMAXCONN;
+	EventBatches = 4;
 	MaxChans = 20;
 	OperMaxChans = 30;
 	c_ipv4_range = 32;
@@ -167,6 +168,59 @@ void ServerConfig::CrossCheckOperClassType()
 	}
 }
 
+void ConnectClassIndex::Build(const ClassVector& classes)
+{
+	hosts.clear();
+	wildcards.clear();
+	ports.assign(classes.size(), 0);
+
+	for (size_t i = 0; i < classes.size(); ++i)
+	{
+		ConnectClass* c = classes[i];
+
+		// Modules may pick a named class for any user, so these are always checked
+		if (c->type == CC_NAMED)
+		{
+			wildcards[0].push_back(i);
+			continue;
+		}
+
+		ports[i] = c->config->getInt("port");
+
+		// A mask with a '/' which is not a valid range is left to MatchCIDR() to decide what it matches
+		const std::string& mask = c->GetHost();
+		if ((!hosts.IsExactMask(mask)) || (!hosts.Add(mask, i)))
+			wildcards[ports[i]].push_back(i);
+	}
+}
+
+void ConnectClassIndex::FindCandidates(LocalUser* user, std::vector<size_t>& out) const
+{
+	const int port = user->GetServerPort();
+	std::map<int, std::vector<size_t> >::const_iterator bucket = wildcards.find(0);
+	if (bucket != wildcards.end())
+		out.insert(out.end(), bucket->second.begin(), bucket->second.end());
+	if (port)
+	{
+		bucket = wildcards.find(port);
+		if (bucket != wildcards.end())
+			out.insert(out.end(), bucket->second.begin(), bucket->second.end());
+	}
+
+	// Classes found by host which require another port are dropped
+	const size_t first = out.size();
+	hosts.Find(user->host, user->GetIPString(), user->client_sa, out);
+	for (size_t i = out.size(); i-- > first; )
+	{
+		if ((ports[out[i]]) && (ports[out[i]] != port))
+			out.erase(out.begin() + i);
+	}
+
+	// The first class to match wins, so the candidates have to be checked in config order
+	std::sort(out.begin(), out.end());
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
 void ServerConfig::CrossCheckConnectBlocks(ServerConfig* current)
 {
 	typedef std::map<std::string, ConnectClass*> ClassMap;
@@ -313,6 +367,8 @@ void ServerConfig::CrossCheckConnectBlocks(ServerConfig* current)
 			Classes[i] = me;
 		}
 	}
+
+	ClassIndex.Build(Classes);
 }
 
 /** Represents a deprecated configuration tag.
@@ -378,6 +434,7 @@ void ServerConfig::Fill()
 	SoftLimit = ConfValue("performance")->getInt("softlimit", SocketEngine::GetMaxFds(), 10, SocketEngine::GetMaxFds());
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
 	MaxConn = ConfValue("performance")->getInt("somaxconn", SOMAXCONN);
+	EventBatches = ConfValue("performance")->getInt("eventbatches", 4, 1, 64);
 	XLineMessage = options->getString("xlinemessage", options->getString("moronbanner", "You're banned!"));
 	ServerDesc = ConfValue("server")->getString("description", "Configure Me");
 	Network = ConfValue("server")->getString("network", "Network");
@@ -618,6 +675,14 @@ void ServerConfig::Apply(ServerConfig* old, const std::string &useruid)
 	errstr.clear();
 	errstr.str(std::string());
 
+	// Connect classes which are still in use were updated in place, the limits of local users may have changed
+	if (old)
+	{
+		const LocalUserList& list = ServerInstance->Users->local_users;
+		for (LocalUserList::const_iterator i = list.begin(); i != list.end(); ++i)
+			(*i)->UpdateLimits();
+	}
+
 	// Re-parse our MOTD and RULES files for colors -- Justasic
 	for (ClassVector::const_iterator it = this->Classes.begin(), it_end = this->Classes.end(); it != it_end; ++it)
 	{
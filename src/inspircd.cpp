@@ -723,9 +723,6 @@ void InspIRCd::Run()
 				FOREACH_MOD(OnGarbageCollect, ());
 			}
 
-			Timers->TickTimers(TIME.tv_sec);
-			Users->DoBackgroundUserStuff();
-
 			if ((TIME.tv_sec % 5) == 0)
 			{
 				FOREACH_MOD(OnBackgroundTimer, (TIME.tv_sec));
@@ -733,15 +730,35 @@ void InspIRCd::Run()
 			}
 		}
 
+		Timers->TickTimers(TIME.tv_sec);
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
 		 * servers... so its nice and easy, just one call.
 		 * This will cause any read or write events to be
-		 * dispatched to their handlers.
+		 * dispatched to their handlers. Wait no longer than
+		 * until the next timer is due or the next second
+		 * starts, whichever comes first, and don't wait at
+		 * all if there is other work queued up already.
 		 */
 		SocketEngine::DispatchTrialWrites();
-		SocketEngine::DispatchEvents();
+		int timeout = 1000 - TIME.tv_nsec / 1000000;
+		if (SocketEngine::HasPendingTrials() || !GlobalCulls.empty() || !AtomicActions.empty())
+			timeout = 0;
+
+		/* If the server is busy, keep handling events until the socket
+		 * engine runs dry, a timer is due or we've done enough batches.
+		 */
+		for (unsigned int batch = 0; batch < Config->EventBatches; ++batch)
+		{
+			if (SocketEngine::DispatchEvents(batch ? 0 : Timers->GetNextTimeout(timeout)) <= 0)
+				break;
+
+			SocketEngine::DispatchTrialWrites();
+			if (Timers->GetNextTimeout(1) == 0)
+				break;
+		}
 
 		/* if any users were quit, take them out */
 		GlobalCulls.Apply();
@@ -148,20 +148,42 @@ CullResult StreamSocket::cull()
 	return EventHandler::cull();
 }
 
-bool StreamSocket::GetNextLine(std::string& line, char delim)
+bool StreamSocket::GetNextLine(irc::string_view& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
+	std::string::size_type i = recvq.find(delim, recvq_consumed);
 	if (i == std::string::npos)
 		return false;
-	line = recvq.substr(0, i);
-	// TODO is this the most efficient way to split?
-	recvq = recvq.substr(i + 1);
+	line = irc::string_view(recvq.data() + recvq_consumed, i - recvq_consumed);
+	recvq_consumed = i + 1;
 	return true;
 }
 
+bool StreamSocket::GetNextLine(std::string& line, char delim)
+{
+	irc::string_view view;
+	if (!GetNextLine(view, delim))
+		return false;
+	line.assign(view.data(), view.length());
+	return true;
+}
+
+void StreamSocket::CompactRecvQ()
+{
+	if (!recvq_consumed)
+		return;
+
+	if (recvq_consumed == recvq.length())
+		recvq.clear();
+	else
+		recvq.erase(0, recvq_consumed);
+	recvq_consumed = 0;
+}
+
 void StreamSocket::DoRead()
 {
-	if (GetIOHook())
+	CompactRecvQ();
+
+	if ((GetIOHook()) && (!GetIOHook()->plainread))
 	{
 		int rv = -1;
 		try
@@ -219,6 +241,155 @@ void StreamSocket::DoRead()
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
 static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
+namespace
+{
+	/** Chunks which are not in use by any sendq, linked through Chunk::next.
+	 * Only used from the main thread, threads must not queue data on sockets.
+	 */
+	StreamSocket::SendQueue::Chunk* freechunks = NULL;
+
+	/** Number of chunks in freechunks */
+	size_t freechunkcount = 0;
+
+	/** Maximum number of unused chunks kept around for reuse */
+	const size_t MAX_FREE_CHUNKS = 1024;
+
+	/** Number of items a sendq ring may keep allocated while it is empty */
+	const size_t IDLE_RING_SIZE = 16;
+}
+
+StreamSocket::SendQueue::Chunk* StreamSocket::SendQueue::AllocChunk()
+{
+	if (!freechunks)
+		return new Chunk;
+
+	Chunk* chunk = freechunks;
+	freechunks = chunk->next;
+	freechunkcount--;
+	return chunk;
+}
+
+void StreamSocket::SendQueue::FreeChunk(Chunk* chunk)
+{
+	if (freechunkcount >= MAX_FREE_CHUNKS)
+	{
+		delete chunk;
+		return;
+	}
+
+	chunk->next = freechunks;
+	freechunks = chunk;
+	freechunkcount++;
+}
+
+StreamSocket::SendQueue::Item& StreamSocket::SendQueue::push_back()
+{
+	if (count == items.size())
+	{
+		// The ring is full (or was never allocated), double its size
+		std::vector<Item> newitems(items.empty() ? 4 : items.size() * 2);
+		for (size_t i = 0; i < count; i++)
+			newitems[i] = at(i);
+		items.swap(newitems);
+		head = 0;
+	}
+
+	count++;
+	return at(count - 1);
+}
+
+void StreamSocket::SendQueue::pop_front()
+{
+	Item& item = at(0);
+	if (item.chunk)
+		FreeChunk(item.chunk);
+	item = Item();
+
+	head = (head + 1) & (items.size() - 1);
+	count--;
+	if (count == 0)
+	{
+		head = 0;
+		// Don't let a single burst of output pin a large ring to an idle socket
+		if (items.size() > IDLE_RING_SIZE)
+			std::vector<Item>().swap(items);
+	}
+}
+
+void StreamSocket::SendQueue::push_back(const char* data, size_t len)
+{
+	nbytes += len;
+	while (len)
+	{
+		Item* item = count ? &at(count - 1) : NULL;
+		if (!item || !item->chunk || item->end == sizeof(item->chunk->data))
+		{
+			// The last item is either a shared buffer or a full chunk, start a new chunk
+			item = &push_back();
+			item->chunk = AllocChunk();
+		}
+
+		size_t space = sizeof(item->chunk->data) - item->end;
+		size_t copylen = (len < space ? len : space);
+		memcpy(item->chunk->data + item->end, data, copylen);
+		item->end += copylen;
+		data += copylen;
+		len -= copylen;
+	}
+}
+
+void StreamSocket::SendQueue::push_back(const SharedBufferRef& buffer)
+{
+	if (!buffer->length())
+		return;
+
+	Item& item = push_back();
+	item.shared = buffer;
+	item.end = buffer->length();
+	nbytes += item.end;
+}
+
+size_t StreamSocket::SendQueue::Peek(char* buf, size_t len) const
+{
+	size_t copied = 0;
+	for (size_t i = 0; i < count && copied < len; i++)
+	{
+		const Item& item = at(i);
+		size_t copylen = std::min(item.length(), len - copied);
+		memcpy(buf + copied, item.data(), copylen);
+		copied += copylen;
+	}
+	return copied;
+}
+
+void StreamSocket::SendQueue::erase_front(size_t len)
+{
+	nbytes -= len;
+	while (len && count)
+	{
+		Item& item = at(0);
+		if (item.length() <= len)
+		{
+			// this item got fully written out
+			len -= item.length();
+			pop_front();
+		}
+		else
+		{
+			// stopped in the middle of this item
+			item.begin += len;
+			len = 0;
+		}
+	}
+}
+
+void StreamSocket::SendQueue::clear()
+{
+	while (count)
+		pop_front();
+	nbytes = 0;
+}
+
 void StreamSocket::DoWrite()
 {
 	if (sendq.empty())
@@ -229,206 +400,171 @@ void StreamSocket::DoWrite()
 		return;
 	}
 
-#ifndef DISABLE_WRITEV
-	if (GetIOHook())
-#endif
+	if ((GetIOHook()) && (!GetIOHook()->plainwrite))
 	{
 		int rv = -1;
 		try
 		{
-			while (error.empty() && !sendq.empty())
-			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
-				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
-					// by the IOHook.
-					//
-					// The length limit of 1024 is to prevent merging strings
-					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(1280);
-					while (!sendq.empty() && tmp.length() < 1024)
-					{
-						tmp.append(sendq.front());
-						sendq.pop_front();
-					}
-					sendq.push_front(tmp);
-				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
-				if (GetIOHook())
-				{
-					rv = GetIOHook()->OnStreamSocketWrite(this, front);
-					if (rv > 0)
-					{
-						// consumed the entire string, and is ready for more
-						sendq_len -= itemlen;
-						sendq.pop_front();
-					}
-					else if (rv == 0)
-					{
-						// socket has blocked. Stop trying to send data.
-						// IOHook has requested unblock notification from the socketengine
-
-						// Since it is possible that a partial write took place, adjust sendq_len
-						sendq_len = sendq_len - itemlen + front.length();
-						return;
-					}
-					else
-					{
-						SetError("Write Error"); // will not overwrite a better error message
-						return;
-					}
-				}
-#ifdef DISABLE_WRITEV
-				else
-				{
-					rv = SocketEngine::Send(this, front.data(), itemlen, 0);
-					if (rv == 0)
-					{
-						SetError("Connection closed");
-						return;
-					}
-					else if (rv < 0)
-					{
-						if (errno == EINTR || SocketEngine::IgnoreError())
-							SocketEngine::ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						else
-							SetError(SocketEngine::LastError());
-						return;
-					}
-					else if (rv < itemlen)
-					{
-						SocketEngine::ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
-						sendq_len -= rv;
-						return;
-					}
-					else
-					{
-						sendq_len -= itemlen;
-						sendq.pop_front();
-						if (sendq.empty())
-							SocketEngine::ChangeEventMask(this, FD_WANT_EDGE_WRITE);
-					}
-				}
-#endif
-			}
+			rv = GetIOHook()->OnStreamSocketWrite(this, sendq);
 		}
 		catch (CoreException& modexcept)
 		{
 			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "%s threw an exception: %s",
 				modexcept.GetSource().c_str(), modexcept.GetReason().c_str());
+			return;
 		}
+		// If rv is 0 the socket has blocked and the IOHook has requested unblock notification
+		if (rv < 0)
+			SetError("Write Error"); // will not overwrite a better error message
+		return;
 	}
-#ifndef DISABLE_WRITEV
-	else
+
+#ifdef DISABLE_WRITEV
+	while (error.empty() && !sendq.empty())
 	{
-		// don't even try if we are known to be blocking
-		if (GetEventMask() & FD_WRITE_WILL_BLOCK)
+		// Merge small buffers into one to avoid a send() call for each
+		std::string tmp;
+		for (size_t i = 0; i < sendq.size() && tmp.length() < 1024; i++)
+		{
+			size_t len;
+			const char* data = sendq.GetBlock(i, len);
+			tmp.append(data, len);
+		}
+
+		size_t itemlen = tmp.length();
+		int rv = SocketEngine::Send(this, tmp.data(), itemlen, 0);
+		if (rv == 0)
+		{
+			SetError("Connection closed");
+			return;
+		}
+		else if (rv < 0)
+		{
+			if (errno == EINTR || SocketEngine::IgnoreError())
+				SocketEngine::ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
+			else
+				SetError(SocketEngine::LastError());
 			return;
-		// start out optimistic - we won't need to write any more
-		int eventChange = FD_WANT_EDGE_WRITE;
-		while (error.empty() && sendq_len && eventChange == FD_WANT_EDGE_WRITE)
+		}
+		else if ((size_t)rv < itemlen)
 		{
-			// Prepare a writev() call to write all buffers efficiently
-			int bufcount = sendq.size();
+			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
+			sendq.erase_front(rv);
+			return;
+		}
+		else
+		{
+			sendq.erase_front(itemlen);
+			if (sendq.empty())
+				SocketEngine::ChangeEventMask(this, FD_WANT_EDGE_WRITE);
+		}
+	}
+#else
+	// don't even try if we are known to be blocking
+	if (GetEventMask() & FD_WRITE_WILL_BLOCK)
+		return;
+	// start out optimistic - we won't need to write any more
+	int eventChange = FD_WANT_EDGE_WRITE;
+	while (error.empty() && !sendq.empty() && eventChange == FD_WANT_EDGE_WRITE)
+	{
+		// Prepare a writev() call to write all buffers efficiently
+		int bufcount = sendq.size();
 
-			// cap the number of buffers at MYIOV_MAX
-			if (bufcount > MYIOV_MAX)
-			{
-				bufcount = MYIOV_MAX;
-			}
+		// cap the number of buffers at MYIOV_MAX
+		if (bufcount > MYIOV_MAX)
+		{
+			bufcount = MYIOV_MAX;
+		}
 
-			int rv_max = 0;
-			iovec* iovecs = new iovec[bufcount];
-			for(int i=0; i < bufcount; i++)
-			{
-				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
-				iovecs[i].iov_len = sendq[i].length();
-				rv_max += sendq[i].length();
-			}
-			int rv = writev(fd, iovecs, bufcount);
-			delete[] iovecs;
+		// The iovecs point straight into the chunks and shared buffers on the sendq
+		iovec iovecs[MYIOV_MAX];
+		size_t rv_max = 0;
+		for (int i = 0; i < bufcount; i++)
+		{
+			size_t len;
+			iovecs[i].iov_base = const_cast<char*>(sendq.GetBlock(i, len));
+			iovecs[i].iov_len = len;
+			rv_max += len;
+		}
+		int rv = writev(fd, iovecs, bufcount);
 
-			if (rv == (int)sendq_len)
-			{
-				// it's our lucky day, everything got written out. Fast cleanup.
-				// This won't ever happen if the number of buffers got capped.
-				sendq_len = 0;
-				sendq.clear();
-			}
-			else if (rv > 0)
-			{
-				// Partial write. Clean out strings from the sendq
-				if (rv < rv_max)
-				{
-					// it's going to block now
-					eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
-				}
-				sendq_len -= rv;
-				while (rv > 0 && !sendq.empty())
-				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
-					{
-						// this string got fully written out
-						rv -= front.length();
-						sendq.pop_front();
-					}
-					else
-					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
-						rv = 0;
-					}
-				}
-			}
-			else if (rv == 0)
-			{
-				error = "Connection closed";
-			}
-			else if (SocketEngine::IgnoreError())
+		if (rv == (int)sendq.bytes())
+		{
+			// it's our lucky day, everything got written out. Fast cleanup.
+			// This won't ever happen if the number of buffers got capped.
+			sendq.clear();
+		}
+		else if (rv > 0)
+		{
+			// Partial write. Clean out buffers from the sendq
+			if ((size_t)rv < rv_max)
 			{
+				// it's going to block now
 				eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
 			}
-			else if (errno == EINTR)
-			{
-				// restart interrupted syscall
-				errno = 0;
-			}
-			else
-			{
-				error = SocketEngine::LastError();
-			}
+			sendq.erase_front(rv);
 		}
-		if (!error.empty())
+		else if (rv == 0)
 		{
-			// error - kill all events
-			SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+			error = "Connection closed";
+		}
+		else if (SocketEngine::IgnoreError())
+		{
+			eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
+		}
+		else if (errno == EINTR)
+		{
+			// restart interrupted syscall
+			errno = 0;
 		}
 		else
 		{
-			SocketEngine::ChangeEventMask(this, eventChange);
+			error = SocketEngine::LastError();
 		}
 	}
+	if (!error.empty())
+	{
+		// error - kill all events
+		SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+	}
+	else
+	{
+		SocketEngine::ChangeEventMask(this, eventChange);
+	}
 #endif
 }
 
 void StreamSocket::WriteData(const std::string &data)
+{
+	WriteData(data.data(), data.length());
+}
+
+void StreamSocket::WriteData(const char* data, size_t len)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %.*s",
+			(int)len, data);
+		return;
+	}
+
+	/* Append the data to the back of the queue ready for writing */
+	sendq.push_back(data, len);
+
+	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
+void StreamSocket::WriteData(const SharedBufferRef& data)
 {
 	if (fd < 0)
 	{
 		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
-			data.c_str());
+			data->str().c_str());
 		return;
 	}
 
 	/* Append the data to the back of the queue ready for writing */
 	sendq.push_back(data);
-	sendq_len += data.length();
 
 	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
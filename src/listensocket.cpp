@@ -29,6 +29,7 @@
 ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to)
 	: bind_tag(tag)
 	, iohookprov(NULL, std::string())
+	, accept_batch(tag->getInt("acceptbatch", 16, 1, 1024))
 {
 	irc::sockets::satoap(bind_to, bind_addr, bind_port);
 	bind_desc = bind_to.str();
@@ -103,7 +104,7 @@ ListenSocket::~ListenSocket()
 }
 
 /* Just seperated into another func for tidiness really.. */
-void ListenSocket::AcceptInternal()
+bool ListenSocket::AcceptInternal()
 {
 	irc::sockets::sockaddrs client;
 	irc::sockets::sockaddrs server;
@@ -114,8 +115,9 @@ void ListenSocket::AcceptInternal()
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "HandleEvent for Listensocket %s nfd=%d", bind_desc.c_str(), incomingSockfd);
 	if (incomingSockfd < 0)
 	{
-		ServerInstance->stats->statsRefused++;
-		return;
+		if (!SocketEngine::IgnoreError())
+			ServerInstance->stats->statsRefused++;
+		return false;
 	}
 
 	socklen_t sz = sizeof(server);
@@ -141,7 +143,7 @@ void ListenSocket::AcceptInternal()
 		SocketEngine::Shutdown(incomingSockfd, 2);
 		SocketEngine::Close(incomingSockfd);
 		ServerInstance->stats->statsRefused++;
-		return;
+		return true;
 	}
 
 	if (client.sa.sa_family == AF_INET6)
@@ -198,6 +200,7 @@ void ListenSocket::AcceptInternal()
 			bind_desc.c_str(), res == MOD_RES_DENY ? "Connection refused by module" : "Module for this port not found");
 		SocketEngine::Close(incomingSockfd);
 	}
+	return true;
 }
 
 void ListenSocket::HandleEvent(EventType e, int err)
@@ -211,7 +214,15 @@ void ListenSocket::HandleEvent(EventType e, int err)
 			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "*** BUG *** ListenSocket::HandleEvent() got a WRITE event!!!");
 			break;
 		case EVENT_READ:
-			this->AcceptInternal();
+			/* Drain the backlog rather than returning to the socket engine
+			 * after every connection, so a connection storm costs one
+			 * readiness event per batch instead of one per client.
+			 */
+			for (unsigned int i = 0; i < accept_batch; i++)
+			{
+				if (!this->AcceptInternal())
+					break;
+			}
 			break;
 	}
 }
@@ -638,7 +638,12 @@ bool ModeParser::AddMode(ModeHandler* mh)
 	// Everything is fine, add the mode
 	slot = mh;
 	if (pm)
+	{
 		mhlist.prefix.push_back(pm);
+		if (pm->GetPrefix())
+			prefixes[(unsigned char)pm->GetPrefix()] = pm;
+		prefixserial++;
+	}
 	else if (mh->IsListModeBase())
 		mhlist.list.push_back(mh->IsListModeBase());
 
@@ -690,8 +695,14 @@ bool ModeParser::DelMode(ModeHandler* mh)
 	}
 
 	slot = NULL;
-	if (mh->IsPrefixMode())
-		mhlist.prefix.erase(std::find(mhlist.prefix.begin(), mhlist.prefix.end(), mh->IsPrefixMode()));
+	PrefixMode* pm = mh->IsPrefixMode();
+	if (pm)
+	{
+		mhlist.prefix.erase(std::find(mhlist.prefix.begin(), mhlist.prefix.end(), pm));
+		if (pm->GetPrefix())
+			prefixes[(unsigned char)pm->GetPrefix()] = NULL;
+		prefixserial++;
+	}
 	else if (mh->IsListModeBase())
 		mhlist.list.erase(std::find(mhlist.list.begin(), mhlist.list.end(), mh->IsListModeBase()));
 
@@ -736,14 +747,9 @@ void ModeParser::RecreateModeListFor004Numeric()
 
 PrefixMode* ModeParser::FindPrefix(unsigned const char pfxletter)
 {
-	const PrefixModeList& list = GetPrefixModes();
-	for (PrefixModeList::const_iterator i = list.begin(); i != list.end(); ++i)
-	{
-		PrefixMode* pm = *i;
-		if (pm->GetPrefix() == pfxletter)
-			return pm;
-	}
-	return NULL;
+	if (!pfxletter)
+		return NULL;
+	return prefixes[pfxletter];
 }
 
 std::string ModeParser::GiveModeList(ModeType mt)
@@ -798,17 +804,17 @@ std::string ModeParser::BuildPrefixes(bool lettersAndModes)
 {
 	std::string mletters;
 	std::string mprefixes;
-	std::map<int,std::pair<char,char> > prefixes;
+	std::map<int,std::pair<char,char> > ranked;
 
 	const PrefixModeList& list = GetPrefixModes();
 	for (PrefixModeList::const_iterator i = list.begin(); i != list.end(); ++i)
 	{
 		PrefixMode* pm = *i;
 		if (pm->GetPrefix())
-			prefixes[pm->GetPrefixRank()] = std::make_pair(pm->GetPrefix(), pm->GetModeChar());
+			ranked[pm->GetPrefixRank()] = std::make_pair(pm->GetPrefix(), pm->GetModeChar());
 	}
 
-	for(std::map<int,std::pair<char,char> >::reverse_iterator n = prefixes.rbegin(); n != prefixes.rend(); n++)
+	for(std::map<int,std::pair<char,char> >::reverse_iterator n = ranked.rbegin(); n != ranked.rend(); n++)
 	{
 		mletters = mletters + n->second.first;
 		mprefixes = mprefixes + n->second.second;
@@ -916,6 +922,9 @@ ModeParser::ModeParser()
 
 	seq = 0;
 	memset(&sent, 0, sizeof(sent));
+
+	memset(prefixes, 0, sizeof(prefixes));
+	prefixserial = 1;
 }
 
 ModeParser::~ModeParser()
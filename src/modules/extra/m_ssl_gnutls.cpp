@@ -33,6 +33,10 @@
 #include <gnutls/crypto.h>
 #endif
 
+#if (GNUTLS_VERSION_MAJOR > 2 || GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR >= 10)
+# define GNUTLS_HAS_SESSION_TICKETS
+#endif
+
 #if (GNUTLS_VERSION_MAJOR > 2 || GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR > 12)
 # define GNUTLS_HAS_RND
 #else
@@ -71,6 +75,10 @@ typedef gnutls_dh_params_t gnutls_dh_params;
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING_READ, ISSL_HANDSHAKING_WRITE, ISSL_HANDSHAKEN, ISSL_CLOSING, ISSL_CLOSED };
 
+/** Runs inbound handshakes if <performance:handshakethreads> is set, NULL otherwise
+ */
+static SSLHandshakePool* handshakepool = NULL;
+
 #if (GNUTLS_VERSION_MAJOR > 2 || (GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR >= 12))
 #define GNUTLS_NEW_CERT_CALLBACK_API
 typedef gnutls_retr2_st cert_cb_last_param_type;
@@ -468,17 +476,64 @@ namespace GnuTLS
 		 */
 		Priority priority;
 
+		/** Sessions which clients can resume by session ID
+		 */
+		SSLSessionCache sessions;
+
+		/** Key protecting session tickets, data is NULL if tickets are disabled.
+		 * GnuTLS derives the keys it uses from this one and rotates them by itself.
+		 */
+		gnutls_datum_t ticketkey;
+
 		Profile(const std::string& profilename, const std::string& certstr, const std::string& keystr,
 				std::auto_ptr<DHParams>& DH, unsigned int mindh, const std::string& hashstr,
-				const std::string& priostr, std::auto_ptr<X509CertList>& CA, std::auto_ptr<X509CRL>& CRL)
+				const std::string& priostr, std::auto_ptr<X509CertList>& CA, std::auto_ptr<X509CRL>& CRL,
+				size_t cachesize, time_t sessiontimeout, bool tickets)
 			: name(profilename)
 			, x509cred(certstr, keystr)
 			, min_dh_bits(mindh)
 			, hash(hashstr)
 			, priority(priostr)
+			, sessions(cachesize, sessiontimeout)
 		{
 			x509cred.SetDH(DH);
 			x509cred.SetCA(CA, CRL);
+
+			ticketkey.data = NULL;
+			ticketkey.size = 0;
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+			if (tickets)
+				ThrowOnError(gnutls_session_ticket_key_generate(&ticketkey), "gnutls_session_ticket_key_generate() failed");
+#endif
+		}
+
+		static int OnStoreSession(void* ptr, gnutls_datum_t key, gnutls_datum_t data)
+		{
+			static_cast<Profile*>(ptr)->sessions.Store(std::string(reinterpret_cast<const char*>(key.data), key.size), std::string(reinterpret_cast<const char*>(data.data), data.size));
+			return 0;
+		}
+
+		static gnutls_datum_t OnRetrieveSession(void* ptr, gnutls_datum_t key)
+		{
+			gnutls_datum_t data = { NULL, 0 };
+			std::string session;
+			if (static_cast<Profile*>(ptr)->sessions.Find(std::string(reinterpret_cast<const char*>(key.data), key.size), session))
+			{
+				// GnuTLS frees the data
+				data.data = static_cast<unsigned char*>(gnutls_malloc(session.length()));
+				if (data.data)
+				{
+					memcpy(data.data, session.data(), session.length());
+					data.size = session.length();
+				}
+			}
+			return data;
+		}
+
+		static int OnRemoveSession(void* ptr, gnutls_datum_t key)
+		{
+			static_cast<Profile*>(ptr)->sessions.Remove(std::string(reinterpret_cast<const char*>(key.data), key.size));
+			return 0;
 		}
 
 		static std::string ReadFile(const std::string& filename)
@@ -524,7 +579,20 @@ namespace GnuTLS
 					crl.reset(new X509CRL(ReadFile(filename)));
 			}
 
-			return new Profile(profilename, certstr, keystr, dh, mindh, hashstr, priostr, ca, crl);
+			size_t cachesize = tag->getInt("sessioncachesize", 10000, 0);
+			time_t sessiontimeout = tag->getDuration("sessiontimeout", 3600, 60);
+			bool tickets = tag->getBool("tickets", true);
+
+			return new Profile(profilename, certstr, keystr, dh, mindh, hashstr, priostr, ca, crl, cachesize, sessiontimeout, tickets);
+		}
+
+		~Profile()
+		{
+			if (ticketkey.data)
+			{
+				memset(ticketkey.data, 0, ticketkey.size);
+				gnutls_free(ticketkey.data);
+			}
 		}
 
 		/** Set up the given session with the settings in this profile
@@ -536,48 +604,185 @@ namespace GnuTLS
 			gnutls_dh_set_prime_bits(sess, min_dh_bits);
 		}
 
+		/** Set up the given server session to let clients resume their earlier sessions
+		 */
+		void SetupServerSession(gnutls_session_t sess)
+		{
+			gnutls_db_set_cache_expiration(sess, sessions.GetTimeout());
+			if (sessions.GetMaxSize())
+			{
+				gnutls_db_set_ptr(sess, this);
+				gnutls_db_set_store_function(sess, OnStoreSession);
+				gnutls_db_set_retrieve_function(sess, OnRetrieveSession);
+				gnutls_db_set_remove_function(sess, OnRemoveSession);
+			}
+
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+			if (ticketkey.data)
+				gnutls_session_ticket_enable_server(sess, &ticketkey);
+#endif
+		}
+
 		const std::string& GetName() const { return name; }
 		X509Credentials& GetX509Credentials() { return x509cred; }
 		gnutls_digest_algorithm_t GetHash() const { return hash.get(); }
+		SSLSessionCache& GetSessionCache() { return sessions; }
 	};
 }
 
+class GnuTLSIOHook;
+
+/** One step of an inbound handshake, run by the handshake pool
+ */
+class GnuTLSHandshake : public SSLHandshakeJob
+{
+ public:
+	/** The hook doing the handshake, NULL if it was closed while the job was running
+	 */
+	GnuTLSIOHook* hook;
+
+	/** The socket of the hook
+	 */
+	StreamSocket* const sock;
+
+	/** The session of the hook, owned by the job if the hook was closed
+	 */
+	gnutls_session_t sess;
+
+	/** Copy of the socket fd used by the session, owned by the job if the hook was closed
+	 */
+	int fd;
+
+	/** The profile, its callbacks are called while the job runs
+	 */
+	reference<GnuTLS::Profile> profile;
+
+	/** Result of gnutls_handshake()
+	 */
+	int ret;
+
+	GnuTLSHandshake(GnuTLSIOHook* sslhook, StreamSocket* user, gnutls_session_t session, const reference<GnuTLS::Profile>& sslprofile)
+		: hook(sslhook)
+		, sock(user)
+		, sess(session)
+		, fd(-1)
+		, profile(sslprofile)
+		, ret(0)
+	{
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		ret = gnutls_handshake(sess);
+	}
+
+	void Finish() CXX11_OVERRIDE;
+};
+
 class GnuTLSIOHook : public SSLIOHook
 {
  private:
 	gnutls_session_t sess;
 	issl_status status;
 	reference<GnuTLS::Profile> profile;
+	bool server;
+
+	/** The step of the handshake being run by the handshake pool, if any
+	 */
+	GnuTLSHandshake* handshake;
+
+	/** Copy of the socket fd, used by the session while the handshake pool works on it
+	 */
+	int threadfd;
+
+	void SetTransport(StreamSocket* user)
+	{
+		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(user));
+		gnutls_transport_set_push_function(sess, gnutls_push_wrapper);
+		gnutls_transport_set_pull_function(sess, gnutls_pull_wrapper);
+	}
 
 	void InitSession(StreamSocket* user, bool me_server)
 	{
 		gnutls_init(&sess, me_server ? GNUTLS_SERVER : GNUTLS_CLIENT);
 
 		profile->SetupSession(sess);
-		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(user));
-		gnutls_transport_set_push_function(sess, gnutls_push_wrapper);
-		gnutls_transport_set_pull_function(sess, gnutls_pull_wrapper);
+		// Used by the certificate callback, which may run on a thread of the handshake pool
+		gnutls_session_set_ptr(sess, static_cast<GnuTLS::Profile*>(profile));
+		SetTransport(user);
 
+		server = me_server;
 		if (me_server)
+		{
 			gnutls_certificate_server_set_request(sess, GNUTLS_CERT_REQUEST); // Request client certificate if any.
+			profile->SetupServerSession(sess);
+		}
 	}
 
 	void CloseSession()
 	{
-		if (this->sess)
+		if (handshake)
+		{
+			// A thread is still using the session, the job frees it when it's done
+			handshake->hook = NULL;
+			handshake->fd = threadfd;
+			handshake = NULL;
+			threadfd = -1;
+		}
+		else if (this->sess)
 		{
 			gnutls_bye(this->sess, GNUTLS_SHUT_WR);
 			gnutls_deinit(this->sess);
 		}
+
+		if (threadfd >= 0)
+		{
+			SocketEngine::Close(threadfd);
+			threadfd = -1;
+		}
 		sess = NULL;
 		certificate = NULL;
 		status = ISSL_NONE;
 	}
 
+	/** Give the next step of the handshake to the handshake pool
+	 * @return True if the pool took it, false if the handshake has to be done here
+	 */
+	bool StartThreadedHandshake(StreamSocket* user)
+	{
+		// The socket may be closed while a thread uses it, give the session a copy
+		// of the fd so the thread never writes to a different connection with the same fd
+		if (threadfd < 0)
+		{
+			threadfd = dup(user->GetFd());
+			if (threadfd < 0)
+				return false;
+			gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(static_cast<intptr_t>(threadfd)));
+			gnutls_transport_set_push_function(sess, thread_push);
+			gnutls_transport_set_pull_function(sess, thread_pull);
+		}
+
+		handshake = new GnuTLSHandshake(this, user, sess, profile);
+		status = ISSL_HANDSHAKING_READ;
+		SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		handshakepool->Submit(handshake);
+		return true;
+	}
+
 	bool Handshake(StreamSocket* user)
 	{
-		int ret = gnutls_handshake(this->sess);
+		// The socket isn't used until the pool is done with the handshake
+		if (handshake)
+			return false;
+
+		if ((handshakepool) && (server) && (StartThreadedHandshake(user)))
+			return false;
 
+		return HandshakeResult(user, gnutls_handshake(this->sess));
+	}
+
+	bool HandshakeResult(StreamSocket* user, int ret)
+	{
 		if (ret < 0)
 		{
 			if(ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
@@ -611,7 +816,16 @@ class GnuTLSIOHook : public SSLIOHook
 			// Change the seesion state
 			this->status = ISSL_HANDSHAKEN;
 
+			if (threadfd >= 0)
+			{
+				SetTransport(user);
+				SocketEngine::Close(threadfd);
+				threadfd = -1;
+			}
+
 			VerifyCertificate();
+			if (server)
+				profile->GetSessionCache().CountHandshake(gnutls_session_is_resumed(this->sess));
 
 			// Finish writing, if any left
 			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
@@ -717,6 +931,18 @@ info_done_dealloc:
 		return str ? str : "UNKNOWN";
 	}
 
+	/** Transport functions used while a handshake is run by the handshake pool
+	 */
+	static ssize_t thread_pull(gnutls_transport_ptr_t fd, void* buffer, size_t size)
+	{
+		return recv(static_cast<int>(reinterpret_cast<intptr_t>(fd)), buffer, size, 0);
+	}
+
+	static ssize_t thread_push(gnutls_transport_ptr_t fd, const void* buffer, size_t size)
+	{
+		return send(static_cast<int>(reinterpret_cast<intptr_t>(fd)), buffer, size, 0);
+	}
+
 	static ssize_t gnutls_pull_wrapper(gnutls_transport_ptr_t session_wrap, void* buffer, size_t size)
 	{
 		StreamSocket* sock = reinterpret_cast<StreamSocket*>(session_wrap);
@@ -795,10 +1021,28 @@ info_done_dealloc:
 		, sess(NULL)
 		, status(ISSL_NONE)
 		, profile(sslprofile)
+		, handshake(NULL)
+		, threadfd(-1)
 	{
 		InitSession(sock, outbound);
 		sock->AddIOHook(this);
-		Handshake(sock);
+		// The client speaks first, don't bother the handshake pool before it did
+		if ((!server) || (!handshakepool))
+			Handshake(sock);
+		else
+			status = ISSL_HANDSHAKING_READ;
+	}
+
+	/** Called by the job when the handshake pool has run the next step of the handshake
+	 */
+	void OnThreadedHandshake(GnuTLSHandshake* job)
+	{
+		handshake = NULL;
+		HandshakeResult(job->sock, job->ret);
+
+		// Let the socket read what the client sent after the handshake (or fail if the handshake failed)
+		if ((status != ISSL_HANDSHAKING_READ) && (status != ISSL_HANDSHAKING_WRITE))
+			SocketEngine::ChangeEventMask(job->sock, FD_ADD_TRIAL_READ);
 	}
 
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
@@ -862,7 +1106,7 @@ info_done_dealloc:
 		return 0;
 	}
 
-	int OnStreamSocketWrite(StreamSocket* user, std::string& sendq) CXX11_OVERRIDE
+	int OnStreamSocketWrite(StreamSocket* user, StreamSocket::SendQueue& sendq) CXX11_OVERRIDE
 	{
 		if (!this->sess)
 		{
@@ -880,34 +1124,35 @@ info_done_dealloc:
 			return -1;
 		}
 
-		int ret = 0;
-
 		if (this->status == ISSL_HANDSHAKEN)
 		{
-			ret = gnutls_record_send(this->sess, sendq.data(), sendq.length());
-
-			if (ret == (int)sendq.length())
-			{
-				SocketEngine::ChangeEventMask(user, FD_WANT_NO_WRITE);
-				return 1;
-			}
-			else if (ret > 0)
+			while (!sendq.empty())
 			{
-				sendq = sendq.substr(ret);
-				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-				return 0;
-			}
-			else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED || ret == 0)
-			{
-				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-				return 0;
-			}
-			else // (ret < 0)
-			{
-				user->SetError(gnutls_strerror(ret));
-				CloseSession();
-				return -1;
+				// Each gnutls_record_send() call sends at most one record. After GNUTLS_E_AGAIN
+				// it only finishes sending the pending record and returns its length.
+				size_t len;
+				const char* data = GetRecordData(sendq, len);
+				int ret = gnutls_record_send(this->sess, data, len);
+
+				if (ret > 0)
+				{
+					sendq.erase_front(ret);
+				}
+				else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED || ret == 0)
+				{
+					SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
+					return 0;
+				}
+				else // (ret < 0)
+				{
+					user->SetError(gnutls_strerror(ret));
+					CloseSession();
+					return -1;
+				}
 			}
+
+			SocketEngine::ChangeEventMask(user, FD_WANT_NO_WRITE);
+			return 1;
 		}
 
 		return 0;
@@ -941,8 +1186,7 @@ int GnuTLS::X509Credentials::cert_callback(gnutls_session_t sess, const gnutls_d
 	st->cert_type = GNUTLS_CRT_X509;
 	st->key_type = GNUTLS_PRIVKEY_X509;
 #endif
-	StreamSocket* sock = reinterpret_cast<StreamSocket*>(gnutls_transport_get_ptr(sess));
-	GnuTLS::X509Credentials& cred = static_cast<GnuTLSIOHook*>(sock->GetIOHook())->GetProfile()->GetX509Credentials();
+	GnuTLS::X509Credentials& cred = static_cast<GnuTLS::Profile*>(gnutls_session_get_ptr(sess))->GetX509Credentials();
 
 	st->ncerts = cred.certs.size();
 	st->cert.x509 = cred.certs.raw();
@@ -952,6 +1196,19 @@ int GnuTLS::X509Credentials::cert_callback(gnutls_session_t sess, const gnutls_d
 	return 0;
 }
 
+void GnuTLSHandshake::Finish()
+{
+	if (hook)
+	{
+		hook->OnThreadedHandshake(this);
+		return;
+	}
+
+	gnutls_deinit(sess);
+	if (fd >= 0)
+		SocketEngine::Close(fd);
+}
+
 class GnuTLSIOHookProvider : public refcountbase, public IOHookProvider
 {
 	reference<GnuTLS::Profile> profile;
@@ -978,6 +1235,8 @@ class GnuTLSIOHookProvider : public refcountbase, public IOHookProvider
 	{
 		new GnuTLSIOHook(this, sock, false, profile);
 	}
+
+	GnuTLS::Profile* GetProfile() { return profile; }
 };
 
 class ModuleSSLGnuTLS : public Module
@@ -989,6 +1248,20 @@ class ModuleSSLGnuTLS : public Module
 	RandGen randhandler;
 	ProfileList profiles;
 
+	void ReadHandshakeThreads()
+	{
+		unsigned int threads = ServerInstance->Config->ConfValue("performance")->getInt("handshakethreads", 0, 0, 64);
+#if defined _WIN32 || GNUTLS_VERSION_MAJOR < 3
+		// Older versions of GnuTLS need thread callbacks to be used from multiple threads
+		if (threads)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Running SSL handshakes on threads is not supported with this version of GnuTLS, ignoring <performance:handshakethreads>");
+			threads = 0;
+		}
+#endif
+		SSLHandshakePool::Resize(handshakepool, threads);
+	}
+
 	void ReadProfiles()
 	{
 		// First, store all profiles in a new, temporary container. If no problems occur, swap the two
@@ -1057,6 +1330,7 @@ class ModuleSSLGnuTLS : public Module
 	void init() CXX11_OVERRIDE
 	{
 		ReadProfiles();
+		ReadHandshakeThreads();
 		ServerInstance->GenRandom = &randhandler;
 	}
 
@@ -1073,13 +1347,29 @@ class ModuleSSLGnuTLS : public Module
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason() + " Not applying settings.");
 		}
+		ReadHandshakeThreads();
 	}
 
 	~ModuleSSLGnuTLS()
 	{
+		SSLHandshakePool::Resize(handshakepool, 0);
 		ServerInstance->GenRandom = &ServerInstance->HandleGenRandom;
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 't')
+			return MOD_RES_PASSTHRU;
+
+		for (ProfileList::const_iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			GnuTLS::Profile* profile = (*i)->GetProfile();
+			results.push_back("304 " + user->nick + " :SSLSTATS gnutls profile \"" + profile->GetName() + "\": " + profile->GetSessionCache().GetStats());
+		}
+
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnCleanup(int target_type, void* item) CXX11_OVERRIDE
 	{
 		if(target_type == TYPE_USER)
@@ -34,6 +34,11 @@
 #include "iohook.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#endif
 #include "modules/ssl.h"
 
 #ifdef _WIN32
@@ -53,7 +58,9 @@
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
-static bool SelfSigned = false;
+/** Runs inbound handshakes if <performance:handshakethreads> is set, NULL otherwise
+ */
+static SSLHandshakePool* handshakepool = NULL;
 
 char* get_error()
 {
@@ -99,6 +106,8 @@ namespace OpenSSL
 		}
 	};
 
+	class Profile;
+
 	class Context
 	{
 		SSL_CTX* const ctx;
@@ -145,6 +154,19 @@ namespace OpenSSL
 		{
 			return SSL_new(ctx);
 		}
+
+		/** Let clients resume sessions from the session cache of the profile and with session tickets
+		 */
+		void EnableResumption(Profile* profile, bool tickets);
+
+#ifdef SSL_OP_ENABLE_KTLS
+		/** Let OpenSSL give the keys of established sessions to the kernel if it supports kTLS
+		 */
+		void EnableKTLS()
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		}
+#endif
 	};
 
 	class Profile : public refcountbase
@@ -170,6 +192,33 @@ namespace OpenSSL
 		 */
 		std::string lasterr;
 
+		/** Sessions which clients can resume by session ID
+		 */
+		SSLSessionCache sessions;
+
+		struct TicketKey
+		{
+			unsigned char name[16];
+			unsigned char hmac[32];
+			unsigned char aes[32];
+			time_t created;
+		};
+
+		/** Keys protecting session tickets, the newest first. New tickets use the newest key,
+		 * older keys are kept until the tickets they protect have expired.
+		 */
+		std::deque<TicketKey> ticketkeys;
+
+		/** Number of seconds after which a new ticket key is made
+		 */
+		const time_t ticketrotate;
+
+		/** Guards ticketkeys, tickets are also made and checked by handshakes run on other threads
+		 */
+		Mutex ticketlock;
+
+		friend class Context;
+
 		static int error_callback(const char* str, size_t len, void* u)
 		{
 			Profile* profile = reinterpret_cast<Profile*>(u);
@@ -177,12 +226,154 @@ namespace OpenSSL
 			return 0;
 		}
 
+		/** Make a new ticket key if the newest one is too old, and forget the ones no ticket can use anymore
+		 */
+		void RotateTicketKeys()
+		{
+			const time_t now = ServerInstance->Time();
+			if ((!ticketkeys.empty()) && (ticketkeys.front().created + ticketrotate > now))
+				return;
+
+			TicketKey key;
+			if ((RAND_bytes(key.name, sizeof(key.name)) <= 0) || (RAND_bytes(key.hmac, sizeof(key.hmac)) <= 0) || (RAND_bytes(key.aes, sizeof(key.aes)) <= 0))
+				return;
+			key.created = now;
+			ticketkeys.push_front(key);
+
+			// Tickets made with a key can be used until a session timeout after the key was replaced
+			while (ticketkeys.back().created + ticketrotate + sessions.GetTimeout() <= now)
+				ticketkeys.pop_back();
+		}
+
+		const TicketKey* FindTicketKey(const unsigned char* keyname) const
+		{
+			for (std::deque<TicketKey>::const_iterator i = ticketkeys.begin(); i != ticketkeys.end(); ++i)
+			{
+				if (!memcmp(i->name, keyname, sizeof(i->name)))
+					return &*i;
+			}
+			return NULL;
+		}
+
+		/** Copy a ticket key, making a new key first if the newest one is too old
+		 * @param keyname Name of the key to copy, NULL to copy the newest key
+		 * @param key Set to the key
+		 * @param newest Set to true if the key is the newest one
+		 * @return True if the key was found
+		 */
+		bool GetTicketKey(const unsigned char* keyname, TicketKey& key, bool& newest)
+		{
+			ticketlock.Lock();
+			RotateTicketKeys();
+			const TicketKey* found = NULL;
+			if (!ticketkeys.empty())
+				found = (keyname ? FindTicketKey(keyname) : &ticketkeys.front());
+			if (found)
+			{
+				key = *found;
+				newest = (found == &ticketkeys.front());
+			}
+			ticketlock.Unlock();
+			return (found != NULL);
+		}
+
+		static Profile* GetProfile(SSL* ssl)
+		{
+			return static_cast<Profile*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+		}
+
+		static int OnNewSession(SSL* ssl, SSL_SESSION* sess)
+		{
+			unsigned int idlen;
+			const unsigned char* id = SSL_SESSION_get_id(sess, &idlen);
+			int len = i2d_SSL_SESSION(sess, NULL);
+			if (len <= 0)
+				return 0;
+
+			std::string data(len, '\0');
+			unsigned char* out = reinterpret_cast<unsigned char*>(&data[0]);
+			i2d_SSL_SESSION(sess, &out);
+			GetProfile(ssl)->sessions.Store(std::string(reinterpret_cast<const char*>(id), idlen), data);
+
+			// We did not keep a reference to sess
+			return 0;
+		}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		static SSL_SESSION* OnGetSession(SSL* ssl, const unsigned char* id, int idlen, int* copy)
+#else
+		static SSL_SESSION* OnGetSession(SSL* ssl, unsigned char* id, int idlen, int* copy)
+#endif
+		{
+			*copy = 0;
+			std::string data;
+			if (!GetProfile(ssl)->sessions.Find(std::string(reinterpret_cast<const char*>(id), idlen), data))
+				return NULL;
+
+			const unsigned char* in = reinterpret_cast<const unsigned char*>(data.data());
+			return d2i_SSL_SESSION(NULL, &in, data.length());
+		}
+
+		static void OnRemoveSession(SSL_CTX* context, SSL_SESSION* sess)
+		{
+			unsigned int idlen;
+			const unsigned char* id = SSL_SESSION_get_id(sess, &idlen);
+			static_cast<Profile*>(SSL_CTX_get_app_data(context))->sessions.Remove(std::string(reinterpret_cast<const char*>(id), idlen));
+		}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		static int OnTicketKey(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc)
+#else
+		static int OnTicketKey(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cctx, HMAC_CTX* hctx, int enc)
+#endif
+		{
+			Profile* profile = GetProfile(ssl);
+			TicketKey key;
+			bool newest;
+			if (enc)
+			{
+				if (!profile->GetTicketKey(NULL, key, newest))
+					return -1;
+				if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+					return -1;
+				memcpy(keyname, key.name, sizeof(key.name));
+			}
+			else if (!profile->GetTicketKey(keyname, key, newest))
+			{
+				// The ticket expired with its key, do a full handshake
+				return 0;
+			}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			OSSL_PARAM params[] = {
+				OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac)),
+				OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+				OSSL_PARAM_construct_end()
+			};
+			if (!EVP_MAC_CTX_set_params(hctx, params))
+				return -1;
+#else
+			if (!HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL))
+				return -1;
+#endif
+
+			if (enc)
+				return EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv) ? 1 : -1;
+
+			if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv))
+				return -1;
+			// Ask for a new ticket if this one was made with an old key
+			return newest ? 1 : 2;
+		}
+
 	 public:
 		Profile(const std::string& profilename, ConfigTag* tag)
 			: name(profilename)
 			, dh(ServerInstance->Config->Paths.PrependConfig(tag->getString("dhfile", "dh.pem")))
 			, ctx(SSL_CTX_new(SSLv23_server_method()))
 			, clictx(SSL_CTX_new(SSLv23_client_method()))
+			, sessions(tag->getInt("sessioncachesize", 10000, 0), tag->getDuration("sessiontimeout", 3600, 60))
+			, ticketrotate(tag->getDuration("ticketrotate", 3600, 60))
 		{
 			if ((!ctx.SetDH(dh)) || (!clictx.SetDH(dh)))
 				throw Exception("Couldn't set DH parameters");
@@ -226,13 +417,60 @@ namespace OpenSSL
 				ERR_print_errors_cb(error_callback, this);
 				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Can't read CA list from %s. This is only a problem if you want to verify client certificates, otherwise it's safe to ignore this message. Error: %s", filename.c_str(), lasterr.c_str());
 			}
+
+			ctx.EnableResumption(this, tag->getBool("tickets", true));
+
+			if (tag->getBool("ktls"))
+			{
+#ifdef SSL_OP_ENABLE_KTLS
+				ctx.EnableKTLS();
+				clictx.EnableKTLS();
+#else
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Kernel TLS is not supported by this version of OpenSSL, ignoring the ktls setting of profile \"%s\"", name.c_str());
+#endif
+			}
 		}
 
 		const std::string& GetName() const { return name; }
+		SSLSessionCache& GetSessionCache() { return sessions; }
 		SSL* CreateServerSession() { return ctx.CreateSession(); }
 		SSL* CreateClientSession() { return clictx.CreateSession(); }
 		const EVP_MD* GetDigest() { return digest; }
 	};
+
+	void Context::EnableResumption(Profile* profile, bool tickets)
+	{
+		SSL_CTX_set_app_data(ctx, profile);
+		// Sessions can't be resumed without this when client certificates are requested
+		const std::string& sidctx = profile->GetName();
+		SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>(sidctx.data()), std::min<size_t>(sidctx.length(), SSL_MAX_SID_CTX_LENGTH));
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+		// Clients often disconnect without closing the session, don't make that session unusable
+		SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+		SSLSessionCache& cache = profile->GetSessionCache();
+		SSL_CTX_set_timeout(ctx, cache.GetTimeout());
+		if (cache.GetMaxSize())
+		{
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL | SSL_SESS_CACHE_NO_AUTO_CLEAR);
+			SSL_CTX_sess_set_new_cb(ctx, Profile::OnNewSession);
+			SSL_CTX_sess_set_get_cb(ctx, Profile::OnGetSession);
+			SSL_CTX_sess_set_remove_cb(ctx, Profile::OnRemoveSession);
+		}
+		else
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+		if (tickets)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, Profile::OnTicketKey);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, Profile::OnTicketKey);
+#endif
+		else
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
 }
 
 static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
@@ -242,13 +480,64 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 * we can just return preverify_ok here, and openssl
 	 * will boot off self-signed and invalid peer certs.
 	 */
-	int ve = X509_STORE_CTX_get_error(ctx);
-
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
-
 	return 1;
 }
 
+class OpenSSLIOHook;
+
+/** One step of an inbound handshake, run by the handshake pool
+ */
+class OpenSSLHandshake : public SSLHandshakeJob
+{
+ public:
+	/** The hook doing the handshake, NULL if it was closed while the job was running
+	 */
+	OpenSSLIOHook* hook;
+
+	/** The socket of the hook
+	 */
+	StreamSocket* const sock;
+
+	/** The session of the hook, owned by the job if the hook was closed
+	 */
+	SSL* sess;
+
+	/** Copy of the socket fd used by the session, owned by the job if the hook was closed
+	 */
+	int fd;
+
+	/** The profile, its callbacks are called while the job runs
+	 */
+	reference<OpenSSL::Profile> profile;
+
+	/** Result of SSL_accept() and SSL_get_error()
+	 */
+	int ret;
+	int err;
+
+	OpenSSLHandshake(OpenSSLIOHook* sslhook, StreamSocket* user, SSL* session, const reference<OpenSSL::Profile>& sslprofile)
+		: hook(sslhook)
+		, sock(user)
+		, sess(session)
+		, fd(-1)
+		, profile(sslprofile)
+		, ret(0)
+		, err(SSL_ERROR_NONE)
+	{
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		ERR_clear_error();
+		ret = SSL_accept(sess);
+		err = (ret > 0) ? SSL_ERROR_NONE : SSL_get_error(sess, ret);
+		// The error queue belongs to this thread, don't leave anything behind
+		ERR_clear_error();
+	}
+
+	void Finish() CXX11_OVERRIDE;
+};
+
 class OpenSSLIOHook : public SSLIOHook
 {
  private:
@@ -258,8 +547,63 @@ class OpenSSLIOHook : public SSLIOHook
 	bool data_to_write;
 	reference<OpenSSL::Profile> profile;
 
+	/** The step of the handshake being run by the handshake pool, if any
+	 */
+	OpenSSLHandshake* handshake;
+
+	/** Copy of the socket fd, used by the session while the handshake pool works on it
+	 */
+	int threadfd;
+
+	/** Make the session use another fd. The BIOs are kept rather than replaced as SSL_set_fd()
+	 * would do, because a new BIO doesn't know that OpenSSL gave the keys to the kernel.
+	 */
+	void SetSessionFd(int fd)
+	{
+		BIO* rbio = SSL_get_rbio(sess);
+		BIO* wbio = SSL_get_wbio(sess);
+		BIO_set_fd(rbio, fd, BIO_NOCLOSE);
+		if (wbio != rbio)
+			BIO_set_fd(wbio, fd, BIO_NOCLOSE);
+	}
+
+	/** Give the next step of the handshake to the handshake pool
+	 * @return True if the pool took it, false if the handshake has to be done here
+	 */
+	bool StartThreadedHandshake(StreamSocket* user)
+	{
+		// The socket may be closed while a thread uses it, give the session a copy
+		// of the fd so the thread never writes to a different connection with the same fd
+		if (threadfd < 0)
+		{
+			threadfd = dup(user->GetFd());
+			if (threadfd < 0)
+				return false;
+			if (SSL_set_fd(sess, threadfd) == 0)
+			{
+				SocketEngine::Close(threadfd);
+				threadfd = -1;
+				SSL_set_fd(sess, user->GetFd());
+				return false;
+			}
+		}
+
+		handshake = new OpenSSLHandshake(this, user, sess, profile);
+		status = ISSL_HANDSHAKING;
+		SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		handshakepool->Submit(handshake);
+		return true;
+	}
+
 	bool Handshake(StreamSocket* user)
 	{
+		// The socket isn't used until the pool is done with the handshake
+		if (handshake)
+			return true;
+
+		if ((handshakepool) && (!outbound) && (StartThreadedHandshake(user)))
+			return true;
+
 		int ret;
 
 		if (outbound)
@@ -267,10 +611,13 @@ class OpenSSLIOHook : public SSLIOHook
 		else
 			ret = SSL_accept(sess);
 
+		return HandshakeResult(user, ret, (ret > 0) ? SSL_ERROR_NONE : SSL_get_error(sess, ret));
+	}
+
+	bool HandshakeResult(StreamSocket* user, int ret, int err)
+	{
 		if (ret < 0)
 		{
-			int err = SSL_get_error(sess, ret);
-
 			if (err == SSL_ERROR_WANT_READ)
 			{
 				SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
@@ -293,11 +640,30 @@ class OpenSSLIOHook : public SSLIOHook
 		else if (ret > 0)
 		{
 			// Handshake complete.
+#ifdef SSL_OP_ENABLE_KTLS
+			// If OpenSSL has given the keys to the kernel, the socket can read and write
+			// plain text, this is zero if the kernel or OpenSSL doesn't support kTLS
+			plainread = BIO_get_ktls_recv(SSL_get_rbio(sess));
+			plainwrite = BIO_get_ktls_send(SSL_get_wbio(sess));
+			if ((plainread) || (plainwrite))
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Kernel TLS enabled on fd %d for%s%s", user->GetFd(), plainread ? " receiving" : "", plainwrite ? " sending" : "");
+#endif
+
+			// The pool is done with the session, it can use the real fd again
+			if (threadfd >= 0)
+			{
+				SetSessionFd(user->GetFd());
+				SocketEngine::Close(threadfd);
+				threadfd = -1;
+			}
+
 			VerifyCertificate();
+			if (!outbound)
+				profile->GetSessionCache().CountHandshake(SSL_session_reused(sess));
 
 			status = ISSL_OPEN;
 
-			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
+			SocketEngine::ChangeEventMask(user, (plainread ? FD_WANT_FAST_READ : FD_WANT_POLL_READ) | (plainwrite ? FD_WANT_EDGE_WRITE : FD_WANT_NO_WRITE) | FD_ADD_TRIAL_WRITE);
 
 			return true;
 		}
@@ -312,11 +678,25 @@ class OpenSSLIOHook : public SSLIOHook
 
 	void CloseSession()
 	{
-		if (sess)
+		if (handshake)
+		{
+			// A thread is still using the session, the job frees it when it's done
+			handshake->hook = NULL;
+			handshake->fd = threadfd;
+			handshake = NULL;
+			threadfd = -1;
+		}
+		else if (sess)
 		{
 			SSL_shutdown(sess);
 			SSL_free(sess);
 		}
+
+		if (threadfd >= 0)
+		{
+			SocketEngine::Close(threadfd);
+			threadfd = -1;
+		}
 		sess = NULL;
 		certificate = NULL;
 		status = ISSL_NONE;
@@ -339,9 +719,10 @@ class OpenSSLIOHook : public SSLIOHook
 			return;
 		}
 
-		certinfo->invalid = (SSL_get_verify_result(sess) != X509_V_OK);
+		long verifyresult = SSL_get_verify_result(sess);
+		certinfo->invalid = (verifyresult != X509_V_OK);
 
-		if (!SelfSigned)
+		if (verifyresult != X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT)
 		{
 			certinfo->unknownsigner = false;
 			certinfo->trusted = true;
@@ -380,6 +761,8 @@ class OpenSSLIOHook : public SSLIOHook
 		, outbound(is_outbound)
 		, data_to_write(false)
 		, profile(sslprofile)
+		, handshake(NULL)
+		, threadfd(-1)
 	{
 		if (sess == NULL)
 			return;
@@ -387,7 +770,23 @@ class OpenSSLIOHook : public SSLIOHook
 			throw ModuleException("Can't set fd with SSL_set_fd: " + ConvToStr(sock->GetFd()));
 
 		sock->AddIOHook(this);
-		Handshake(sock);
+		// The client speaks first, don't bother the handshake pool before it did
+		if ((outbound) || (!handshakepool))
+			Handshake(sock);
+		else
+			status = ISSL_HANDSHAKING;
+	}
+
+	/** Called by the job when the handshake pool has run the next step of the handshake
+	 */
+	void OnThreadedHandshake(OpenSSLHandshake* job)
+	{
+		handshake = NULL;
+		HandshakeResult(job->sock, job->ret, job->err);
+
+		// Let the socket read what the client sent after the handshake (or fail if the handshake failed)
+		if (status != ISSL_HANDSHAKING)
+			SocketEngine::ChangeEventMask(job->sock, FD_ADD_TRIAL_READ);
 	}
 
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
@@ -462,7 +861,7 @@ class OpenSSLIOHook : public SSLIOHook
 		return 0;
 	}
 
-	int OnStreamSocketWrite(StreamSocket* user, std::string& buffer) CXX11_OVERRIDE
+	int OnStreamSocketWrite(StreamSocket* user, StreamSocket::SendQueue& sendq) CXX11_OVERRIDE
 	{
 		if (!sess)
 		{
@@ -485,44 +884,46 @@ class OpenSSLIOHook : public SSLIOHook
 
 		if (status == ISSL_OPEN)
 		{
-			int ret = SSL_write(sess, buffer.data(), buffer.size());
-			if (ret == (int)buffer.length())
-			{
-				data_to_write = false;
-				SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
-				return 1;
-			}
-			else if (ret > 0)
-			{
-				buffer = buffer.substr(ret);
-				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-				return 0;
-			}
-			else if (ret == 0)
-			{
-				CloseSession();
-				return -1;
-			}
-			else if (ret < 0)
+			while (!sendq.empty())
 			{
-				int err = SSL_get_error(sess, ret);
-
-				if (err == SSL_ERROR_WANT_WRITE)
+				// Each SSL_write() call sends at most one record
+				size_t len;
+				const char* data = GetRecordData(sendq, len);
+				int ret = SSL_write(sess, data, len);
+				if (ret > 0)
 				{
-					SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-					return 0;
+					sendq.erase_front(ret);
 				}
-				else if (err == SSL_ERROR_WANT_READ)
+				else if (ret == 0)
 				{
-					SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ);
-					return 0;
+					CloseSession();
+					return -1;
 				}
 				else
 				{
-					CloseSession();
-					return -1;
+					int err = SSL_get_error(sess, ret);
+
+					if (err == SSL_ERROR_WANT_WRITE)
+					{
+						SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
+						return 0;
+					}
+					else if (err == SSL_ERROR_WANT_READ)
+					{
+						SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ);
+						return 0;
+					}
+					else
+					{
+						CloseSession();
+						return -1;
+					}
 				}
 			}
+
+			data_to_write = false;
+			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+			return 1;
 		}
 		return 0;
 	}
@@ -541,6 +942,19 @@ class OpenSSLIOHook : public SSLIOHook
 	}
 };
 
+void OpenSSLHandshake::Finish()
+{
+	if (hook)
+	{
+		hook->OnThreadedHandshake(this);
+		return;
+	}
+
+	SSL_free(sess);
+	if (fd >= 0)
+		SocketEngine::Close(fd);
+}
+
 class OpenSSLIOHookProvider : public refcountbase, public IOHookProvider
 {
 	reference<OpenSSL::Profile> profile;
@@ -567,6 +981,8 @@ class OpenSSLIOHookProvider : public refcountbase, public IOHookProvider
 	{
 		new OpenSSLIOHook(this, sock, true, profile->CreateClientSession(), profile);
 	}
+
+	OpenSSL::Profile* GetProfile() { return profile; }
 };
 
 class ModuleSSLOpenSSL : public Module
@@ -575,6 +991,21 @@ class ModuleSSLOpenSSL : public Module
 
 	ProfileList profiles;
 
+	void ReadHandshakeThreads()
+	{
+		unsigned int threads = ServerInstance->Config->ConfValue("performance")->getInt("handshakethreads", 0, 0, 64);
+#if defined _WIN32 || OPENSSL_VERSION_NUMBER < 0x10100000L
+		// Older versions of OpenSSL need locking callbacks to be used from multiple threads
+		if (threads)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Running SSL handshakes on threads is not supported with this version of OpenSSL, ignoring <performance:handshakethreads>");
+			threads = 0;
+		}
+#endif
+
+		SSLHandshakePool::Resize(handshakepool, threads);
+	}
+
 	void ReadProfiles()
 	{
 		ProfileList newprofiles;
@@ -634,9 +1065,15 @@ class ModuleSSLOpenSSL : public Module
 		SSL_load_error_strings();
 	}
 
+	~ModuleSSLOpenSSL()
+	{
+		SSLHandshakePool::Resize(handshakepool, 0);
+	}
+
 	void init() CXX11_OVERRIDE
 	{
 		ReadProfiles();
+		ReadHandshakeThreads();
 	}
 
 	void OnModuleRehash(User* user, const std::string &param) CXX11_OVERRIDE
@@ -652,6 +1089,7 @@ class ModuleSSLOpenSSL : public Module
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason() + " Not applying settings.");
 		}
+		ReadHandshakeThreads();
 	}
 
 	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
@@ -661,6 +1099,20 @@ class ModuleSSLOpenSSL : public Module
 			static_cast<OpenSSLIOHook*>(hook)->TellCiphersAndFingerprint(user);
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 't')
+			return MOD_RES_PASSTHRU;
+
+		for (ProfileList::const_iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			OpenSSL::Profile* profile = (*i)->GetProfile();
+			results.push_back("304 " + user->nick + " :SSLSTATS openssl profile \"" + profile->GetName() + "\": " + profile->GetSessionCache().GetStats());
+		}
+
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnCleanup(int target_type, void* item) CXX11_OVERRIDE
 	{
 		if (target_type == TYPE_USER)
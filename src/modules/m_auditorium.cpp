@@ -85,6 +85,12 @@ class ModuleAuditorium : public Module
 		return false;
 	}
 
+	ModResult OnNamesListCacheKey(User* issuer, Channel* chan, std::string& key) CXX11_OVERRIDE
+	{
+		// Who can be seen depends on the issuer
+		return (chan->IsModeSet(&aum) ? MOD_RES_DENY : MOD_RES_PASSTHRU);
+	}
+
 	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
 	{
 		// Some module already hid this from being displayed, don't bother
@@ -83,18 +83,16 @@ class ModuleChannelNames : public Module
 
 				ServerInstance->Modes->Process(modes, ServerInstance->FakeClient);
 			}
+			// KickUser invalidates iterators of the userlist, collect the local users first
+			std::vector<User*> kicklist;
 			const UserMembList* users = c->GetUsers();
-			for(UserMembCIter j = users->begin(); j != users->end(); )
+			for (UserMembCIter j = users->begin(); j != users->end(); ++j)
 			{
-				if (IS_LOCAL(j->first))
-				{
-					// KickUser invalidates the iterator
-					UserMembCIter it = j++;
-					c->KickUser(ServerInstance->FakeClient, it->first, "Channel name no longer valid");
-				}
-				else
-					++j;
+				if (j->IsLocal())
+					kicklist.push_back(j->first);
 			}
+			for (std::vector<User*>::const_iterator j = kicklist.begin(); j != kicklist.end(); ++j)
+				c->KickUser(ServerInstance->FakeClient, *j, "Channel name no longer valid");
 		}
 		badchan = false;
 	}
@@ -92,15 +92,19 @@ class CommandClearChan : public Command
 		ServerInstance->Modules->Attach(hook, creator);
 
 		std::string mask;
-		// Now remove all local non-opers from the channel
+		// Now remove all local non-opers from the channel. Removing a user invalidates
+		// iterators of the userlist, so collect the users first.
+		std::vector<User*> victims;
 		const UserMembList* users = chan->GetUsers();
-		for (UserMembCIter i = users->begin(); i != users->end(); )
+		for (UserMembCIter i = users->begin(); i != users->end(); ++i)
 		{
-			User* curr = i->first;
-			++i;
+			if (i->IsLocal() && !i->first->IsOper())
+				victims.push_back(i->first);
+		}
 
-			if (!IS_LOCAL(curr) || curr->IsOper())
-				continue;
+		for (std::vector<User*>::const_iterator i = victims.begin(); i != victims.end(); ++i)
+		{
+			User* curr = *i;
 
 			// If kicking users, remove them and skip the QuitUser()
 			if (kick)
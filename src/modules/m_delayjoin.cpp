@@ -46,6 +46,7 @@ class ModuleDelayJoin : public Module
 
 	Version GetVersion() CXX11_OVERRIDE;
 	void OnNamesListItem(User* issuer, Membership*, std::string &prefixes, std::string &nick) CXX11_OVERRIDE;
+	ModResult OnNamesListCacheKey(User* issuer, Channel* chan, std::string& key) CXX11_OVERRIDE;
 	void OnUserJoin(Membership*, bool, bool, CUList&) CXX11_OVERRIDE;
 	void CleanUser(User* user);
 	void OnUserPart(Membership*, std::string &partmessage, CUList&) CXX11_OVERRIDE;
@@ -91,6 +92,12 @@ void ModuleDelayJoin::OnNamesListItem(User* issuer, Membership* memb, std::strin
 		nick.clear();
 }
 
+ModResult ModuleDelayJoin::OnNamesListCacheKey(User* issuer, Channel* chan, std::string& key)
+{
+	/* Who is hidden depends on the issuer, only lists without hidden users are cached */
+	return (chan->IsModeSet(djm) ? MOD_RES_DENY : MOD_RES_PASSTHRU);
+}
+
 static void populate(CUList& except, Membership* memb)
 {
 	const UserMembList* users = memb->chan->GetUsers();
@@ -32,6 +32,10 @@ static ModuleHttpServer* HttpModule;
 static bool claimed;
 static std::set<HttpServerSocket*> sockets;
 
+/** Size of the sendq below which the next part of a streamed response is produced
+ */
+static const size_t STREAM_SENDQ = 32 * 1024;
+
 /** HTTP socket states
  */
 enum HttpState
@@ -56,12 +60,30 @@ class HttpServerSocket : public BufferedSocket
 	std::string uri;
 	std::string http_version;
 
+	/** Producer of the response being streamed, NULL if none */
+	HTTPStreamProducer* producer;
+
+	/** Module which created the producer */
+	Module* producermod;
+
+	/** True if the streamed response is sent with chunked transfer encoding */
+	bool chunked;
+
+	/** True once the whole response has been queued, the connection is then closed
+	 * when the sendq is empty
+	 */
+	bool finished;
+
  public:
-	const time_t createtime;
+	/** Time the connection was accepted or the last part of a streamed response was queued,
+	 * the connection is closed when this is longer ago than the timeout
+	 */
+	time_t activitytime;
 
 	HttpServerSocket(int newfd, const std::string& IP, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 		: BufferedSocket(newfd), ip(IP), postsize(0)
-		, createtime(ServerInstance->Time())
+		, producer(NULL), producermod(NULL), chunked(false), finished(false)
+		, activitytime(ServerInstance->Time())
 	{
 		InternalState = HTTP_SERVE_WAIT_REQUEST;
 
@@ -71,11 +93,20 @@ class HttpServerSocket : public BufferedSocket
 
 	~HttpServerSocket()
 	{
+		delete producer;
 		sockets.erase(this);
 	}
 
+	/** Check whether the response is being produced by the given module
+	 */
+	bool IsStreamFrom(Module* mod) const
+	{
+		return ((producer) && (producermod == mod));
+	}
+
 	void OnError(BufferedSocketError) CXX11_OVERRIDE
 	{
+		StopStream();
 		ServerInstance->GlobalCulls.AddItem(this);
 	}
 
@@ -182,7 +213,18 @@ class HttpServerSocket : public BufferedSocket
 
 	void SendHeaders(unsigned long size, int response, HTTPHeaders &rheaders)
 	{
+		rheaders.SetHeader("Content-Length", ConvToStr(size));
+
+		if (size)
+			rheaders.CreateHeader("Content-Type", "text/html");
+		else
+			rheaders.RemoveHeader("Content-Type");
+
+		WriteHeaders(response, rheaders);
+	}
 
+	void WriteHeaders(int response, HTTPHeaders &rheaders)
+	{
 		WriteData(http_version + " "+ConvToStr(response)+" "+Response(response)+"\r\n");
 
 		time_t local = ServerInstance->Time();
@@ -192,12 +234,6 @@ class HttpServerSocket : public BufferedSocket
 		rheaders.CreateHeader("Date", date);
 
 		rheaders.CreateHeader("Server", BRANCH);
-		rheaders.SetHeader("Content-Length", ConvToStr(size));
-
-		if (size)
-			rheaders.CreateHeader("Content-Type", "text/html");
-		else
-			rheaders.RemoveHeader("Content-Type");
 
 		/* Supporting Connection: keep-alive causes a whole world of hurt syncronizing timeouts,
 		 * so remove it, its not essential for what we need.
@@ -334,6 +370,75 @@ class HttpServerSocket : public BufferedSocket
 		SendHeaders(n->str().length(), response, *hheaders);
 		WriteData(n->str());
 	}
+
+	void Stream(HTTPStreamProducer* prod, Module* mod, int response, HTTPHeaders *hheaders)
+	{
+		producer = prod;
+		producermod = mod;
+		chunked = (http_version == "HTTP/1.1");
+
+		hheaders->RemoveHeader("Content-Length");
+		if (chunked)
+			hheaders->SetHeader("Transfer-Encoding", "chunked");
+		else
+			hheaders->RemoveHeader("Transfer-Encoding");
+		hheaders->CreateHeader("Content-Type", "text/html");
+		WriteHeaders(response, *hheaders);
+
+		ContinueStream();
+	}
+
+	/** Queue the next part of the streamed response
+	 */
+	void ContinueStream()
+	{
+		// A client which keeps reading a long response is not idle
+		activitytime = ServerInstance->Time();
+
+		std::string data;
+		bool more;
+		do
+		{
+			more = producer->Produce(data);
+		} while ((more) && (data.empty()));
+
+		if ((chunked) && (!data.empty()))
+		{
+			char size[20];
+			snprintf(size, sizeof(size), "%lx\r\n", static_cast<unsigned long>(data.length()));
+			WriteData(size);
+			data.append("\r\n");
+		}
+		WriteData(data);
+
+		if (!more)
+		{
+			if (chunked)
+				WriteData("0\r\n\r\n");
+			StopStream();
+			finished = true;
+		}
+	}
+
+	void StopStream()
+	{
+		delete producer;
+		producer = NULL;
+		producermod = NULL;
+	}
+
+	void DoWrite() CXX11_OVERRIDE
+	{
+		BufferedSocket::DoWrite();
+		if (!getError().empty())
+			return;
+
+		// Produce more of the response once the client has taken most of what was sent so far
+		if ((producer) && (getSendQSize() <= STREAM_SENDQ))
+			ContinueStream();
+		else if ((finished) && (!getSendQSize()))
+			ServerInstance->GlobalCulls.AddItem(this);
+	}
 };
 
 class HTTPdAPIImpl : public HTTPdAPIBase
@@ -347,7 +452,10 @@ class HTTPdAPIImpl : public HTTPdAPIBase
 	void SendResponse(HTTPDocumentResponse& resp) CXX11_OVERRIDE
 	{
 		claimed = true;
-		resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
+		if (resp.producer)
+			resp.src.sock->Stream(resp.producer, resp.module, resp.responsecode, &resp.headers);
+		else
+			resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
 	}
 };
 
@@ -395,7 +503,22 @@ class ModuleHttpServer : public Module
 		{
 			HttpServerSocket* sock = *i;
 			++i;
-			if (sock->createtime < oldest_allowed)
+			if (sock->activitytime < oldest_allowed)
+			{
+				sock->cull();
+				delete sock;
+			}
+		}
+	}
+
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		// Drop the responses which are still being produced by the module
+		for (std::set<HttpServerSocket*>::const_iterator i = sockets.begin(); i != sockets.end(); )
+		{
+			HttpServerSocket* sock = *i;
+			++i;
+			if (sock->IsStreamFrom(mod))
 			{
 				sock->cull();
 				delete sock;
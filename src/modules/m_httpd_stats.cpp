@@ -26,17 +26,20 @@
 #include "xline.h"
 #include "protocol.h"
 
-class ModuleHttpStats : public Module
+namespace
 {
-	static std::map<char, char const*> const &entities;
-	HTTPdAPI API;
-
- public:
-	ModuleHttpStats()
-		: API(this)
+	std::map<char, char const*> const& init_entities()
 	{
+		static std::map<char, char const*> entities;
+		entities['<'] = "lt";
+		entities['>'] = "gt";
+		entities['&'] = "amp";
+		entities['"'] = "quot";
+		return entities;
 	}
 
+	std::map<char, char const*> const& entities = init_entities();
+
 	std::string Sanitize(const std::string &str)
 	{
 		std::string ret;
@@ -73,165 +76,499 @@ class ModuleHttpStats : public Module
 		return ret;
 	}
 
-	void DumpMeta(std::stringstream& data, Extensible* ext)
+	/** Quote a string for a JSON document. Bytes outside of printable ASCII are escaped
+	 * as the code point with the same value, so the document is valid UTF-8 whatever the
+	 * encoding of the string.
+	 */
+	std::string Quote(const std::string& str)
 	{
-		data << "<metadata>";
+		std::string ret;
+		ret.reserve(str.length() + 2);
+		ret.push_back('"');
+		for (std::string::const_iterator x = str.begin(); x != str.end(); ++x)
+		{
+			unsigned char c = *x;
+			if ((c == '"') || (c == '\\'))
+			{
+				ret.push_back('\\');
+				ret.push_back(c);
+			}
+			else if ((c < 0x20) || (c > 0x7e))
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				ret.append(buf);
+			}
+			else
+				ret.push_back(c);
+		}
+		ret.push_back('"');
+		return ret;
+	}
+
+	std::string DecodeURL(const std::string& str)
+	{
+		std::string ret;
+		ret.reserve(str.length());
+		for (std::string::size_type i = 0; i < str.length(); ++i)
+		{
+			if (str[i] == '+')
+				ret.push_back(' ');
+			else if ((str[i] == '%') && (i + 2 < str.length()) && (isxdigit(str[i+1])) && (isxdigit(str[i+2])))
+			{
+				ret.push_back(static_cast<char>(strtol(str.substr(i + 1, 2).c_str(), NULL, 16)));
+				i += 2;
+			}
+			else
+				ret.push_back(str[i]);
+		}
+		return ret;
+	}
+
+	typedef std::map<std::string, std::string> QueryParams;
+
+	/** Split a request URI into the path and the parameters in the query string
+	 */
+	void ParseURI(const std::string& uri, std::string& path, QueryParams& params)
+	{
+		std::string::size_type sep = uri.find('?');
+		path = uri.substr(0, sep);
+		if (sep == std::string::npos)
+			return;
+
+		irc::sepstream stream(uri.substr(sep + 1), '&');
+		std::string token;
+		while (stream.GetToken(token))
+		{
+			std::string::size_type eq = token.find('=');
+			params[DecodeURL(token.substr(0, eq))] = (eq == std::string::npos ? "" : DecodeURL(token.substr(eq + 1)));
+		}
+	}
+
+	/** Keep only the items at offset to offset + limit in sorted order. This is cheaper
+	 * than sorting the whole list when only a page of a large list is wanted.
+	 */
+	void SelectPage(std::vector<std::string>& items, size_t offset, size_t limit)
+	{
+		if (offset >= items.size())
+		{
+			items.clear();
+			return;
+		}
+
+		std::nth_element(items.begin(), items.begin() + offset, items.end());
+		items.erase(items.begin(), items.begin() + offset);
+		if (limit < items.size())
+		{
+			std::nth_element(items.begin(), items.begin() + limit, items.end());
+			items.resize(limit);
+		}
+		std::sort(items.begin(), items.end());
+	}
+
+	void DumpMeta(std::stringstream& data, Extensible* ext, bool json)
+	{
+		data << (json ? "\"metadata\":{" : "<metadata>");
+		bool first = true;
 		for(Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
 		{
 			ExtensionItem* item = i->first;
 			std::string value = item->serialize(FORMAT_USER, ext, i->second);
-			if (!value.empty())
+			if (json)
+			{
+				if ((value.empty()) && (item->name.empty()))
+					continue;
+				data << (first ? "" : ",") << Quote(item->name) << ':' << (value.empty() ? "null" : Quote(value));
+				first = false;
+			}
+			else if (!value.empty())
 				data << "<meta name=\"" << item->name << "\">" << Sanitize(value) << "</meta>";
 			else if (!item->name.empty())
 				data << "<meta name=\"" << item->name << "\"/>";
 		}
-		data << "</metadata>";
+		data << (json ? "}" : "</metadata>");
 	}
 
-	void OnEvent(Event& event) CXX11_OVERRIDE
+	void DumpChannel(std::stringstream& data, Channel* c, bool json)
 	{
-		std::stringstream data("");
+		const UserMembList* ulist = c->GetUsers();
+		if (json)
+		{
+			data << "{\"channelname\":" << Quote(c->name) << ",\"usercount\":" << ulist->size()
+				<< ",\"channeltopic\":{\"topictext\":" << Quote(c->topic) << ",\"setby\":" << Quote(c->setby)
+				<< ",\"settime\":" << c->topicset << "},\"channelmodes\":" << Quote(c->ChanModes(true))
+				<< ",\"channelmembers\":[";
 
-		if (event.id == "httpd_url")
+			for (UserMembCIter x = ulist->begin(); x != ulist->end(); ++x)
+			{
+				Membership* memb = x->second;
+				data << (x == ulist->begin() ? "" : ",") << "{\"uid\":" << Quote(memb->user->uuid)
+					<< ",\"privs\":" << Quote(memb->GetAllPrefixChars()) << ",\"modes\":" << Quote(memb->modes) << ',';
+				DumpMeta(data, memb, json);
+				data << '}';
+			}
+
+			data << "],";
+			DumpMeta(data, c, json);
+			data << '}';
+			return;
+		}
+
+		data << "<channel>";
+		data << "<usercount>" << ulist->size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
+		data << "<channeltopic>";
+		data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
+		data << "<setby>" << Sanitize(c->setby) << "</setby>";
+		data << "<settime>" << c->topicset << "</settime>";
+		data << "</channeltopic>";
+		data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
+
+		for (UserMembCIter x = ulist->begin(); x != ulist->end(); ++x)
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd event");
-			HTTPRequest* http = (HTTPRequest*)&event;
+			Membership* memb = x->second;
+			data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
+				<< Sanitize(memb->GetAllPrefixChars()) << "</privs><modes>"
+				<< memb->modes << "</modes>";
+			DumpMeta(data, memb, json);
+			data << "</channelmember>";
+		}
+
+		DumpMeta(data, c, json);
+
+		data << "</channel>";
+	}
+
+	void DumpUser(std::stringstream& data, User* u, bool json)
+	{
+		LocalUser* lu = IS_LOCAL(u);
+		if (json)
+		{
+			data << "{\"nickname\":" << Quote(u->nick) << ",\"uuid\":" << Quote(u->uuid) << ",\"realhost\":" << Quote(u->host)
+				<< ",\"displayhost\":" << Quote(u->dhost) << ",\"gecos\":" << Quote(u->fullname)
+				<< ",\"server\":" << Quote(u->server->GetName());
+			if (u->IsAway())
+				data << ",\"away\":" << Quote(u->awaymsg) << ",\"awaytime\":" << u->awaytime;
+			if (u->IsOper())
+				data << ",\"opertype\":" << Quote(u->oper->name);
+			data << ",\"modes\":" << Quote(u->FormatModes()) << ",\"ident\":" << Quote(u->ident);
+			if (lu)
+				data << ",\"port\":" << lu->GetServerPort() << ",\"servaddr\":" << Quote(lu->server_sa.str());
+			data << ",\"ipaddress\":" << Quote(u->GetIPString()) << ',';
+			DumpMeta(data, u, json);
+			data << '}';
+			return;
+		}
+
+		data << "<user>";
+		data << "<nickname>" << u->nick << "</nickname><uuid>" << u->uuid << "</uuid><realhost>"
+			<< u->host << "</realhost><displayhost>" << u->dhost << "</displayhost><gecos>"
+			<< Sanitize(u->fullname) << "</gecos><server>" << u->server->GetName() << "</server>";
+		if (u->IsAway())
+			data << "<away>" << Sanitize(u->awaymsg) << "</away><awaytime>" << u->awaytime << "</awaytime>";
+		if (u->IsOper())
+			data << "<opertype>" << Sanitize(u->oper->name) << "</opertype>";
+		data << "<modes>" << u->FormatModes() << "</modes><ident>" << Sanitize(u->ident) << "</ident>";
+		if (lu)
+			data << "<port>" << lu->GetServerPort() << "</port><servaddr>"
+				<< lu->server_sa.str() << "</servaddr>";
+		data << "<ipaddress>" << u->GetIPString() << "</ipaddress>";
+
+		DumpMeta(data, u, json);
+
+		data << "</user>";
+	}
+
+	/** Streams a document made of sections of text, each followed by a list of channels
+	 * or users. The channels and users are looked up when it is their turn, so the ones
+	 * which are gone by then are skipped.
+	 */
+	class StatsStream : public HTTPStreamProducer
+	{
+	 public:
+		enum ItemType
+		{
+			ITEM_NONE,
+			ITEM_CHANNEL,
+			ITEM_USER
+		};
 
-			if ((http->GetURI() == "/stats") || (http->GetURI() == "/stats/"))
+	 private:
+		struct Section
+		{
+			std::string text;
+			ItemType type;
+			std::vector<std::string> items;
+		};
+
+		std::vector<Section> sections;
+
+		/** Index of the section being sent */
+		size_t current;
+
+		/** Position in the current section, 0 if its text has not been sent yet,
+		 * otherwise one more than the index of the next item
+		 */
+		size_t pos;
+
+		/** True if no item of the current section has been sent yet */
+		bool first;
+
+		const bool json;
+
+		/** Number of items sent per call to Produce() */
+		const unsigned int batch;
+
+	 public:
+		StatsStream(bool usejson, unsigned int batchsize)
+			: current(0), pos(0), first(true), json(usejson), batch(batchsize)
+		{
+		}
+
+		/** Add a section to the end of the document
+		 * @return The list of channel names or UUIDs to send after the text, which must be
+		 * filled in before the next section is added
+		 */
+		std::vector<std::string>& AddSection(const std::string& text, ItemType type = ITEM_NONE)
+		{
+			sections.push_back(Section());
+			sections.back().text = text;
+			sections.back().type = type;
+			return sections.back().items;
+		}
+
+		bool Produce(std::string& data) CXX11_OVERRIDE
+		{
+			std::stringstream out;
+			for (unsigned int count = 0; (count < batch) && (current < sections.size()); )
 			{
-				data << "<inspircdstats><server><name>" << ServerInstance->Config->ServerName << "</name><gecos>"
-					<< Sanitize(ServerInstance->Config->ServerDesc) << "</gecos><version>"
-					<< Sanitize(ServerInstance->GetVersionString()) << "</version></server>";
-
-				data << "<general>";
-				data << "<usercount>" << ServerInstance->Users->clientlist->size() << "</usercount>";
-				data << "<channelcount>" << ServerInstance->chanlist->size() << "</channelcount>";
-				data << "<opercount>" << ServerInstance->Users->all_opers.size() << "</opercount>";
-				data << "<socketcount>" << (SocketEngine::GetUsedFds()) << "</socketcount><socketmax>" << SocketEngine::GetMaxFds() << "</socketmax><socketengine>" INSPIRCD_SOCKETENGINE_NAME "</socketengine>";
-
-				time_t current_time = 0;
-				current_time = ServerInstance->Time();
-				time_t server_uptime = current_time - ServerInstance->startup_time;
-				struct tm* stime;
-				stime = gmtime(&server_uptime);
-				data << "<uptime><days>" << stime->tm_yday << "</days><hours>" << stime->tm_hour << "</hours><mins>" << stime->tm_min << "</mins><secs>" << stime->tm_sec << "</secs><boot_time_t>" << ServerInstance->startup_time << "</boot_time_t></uptime>";
-
-				data << "<isupport>";
-				const std::vector<std::string>& isupport = ServerInstance->ISupport.GetLines();
-				for (std::vector<std::string>::const_iterator it = isupport.begin(); it != isupport.end(); it++)
+				Section& section = sections[current];
+				if (pos == 0)
 				{
-					data << Sanitize(*it) << std::endl;
+					out << section.text;
+					first = true;
 				}
-				data << "</isupport></general><xlines>";
-				std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
-				for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
-				{
-					XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
 
-					if (!lookup)
-						continue;
-					for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-					{
-						data << "<xline type=\"" << it->c_str() << "\"><mask>"
-							<< Sanitize(i->second->Displayable()) << "</mask><settime>"
-							<< i->second->set_time << "</settime><duration>" << i->second->duration
-							<< "</duration><reason>" << Sanitize(i->second->reason)
-							<< "</reason></xline>";
-					}
+				if (pos >= section.items.size())
+				{
+					std::vector<std::string>().swap(section.items);
+					current++;
+					pos = 0;
+					continue;
 				}
 
-				data << "</xlines><modulelist>";
-				const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
-
-				for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+				const std::string& item = section.items[pos++];
+				count++;
+				if (section.type == ITEM_CHANNEL)
 				{
-					Version v = i->second->GetVersion();
-					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
+					Channel* c = ServerInstance->FindChan(item);
+					if (!c)
+						continue;
+					if ((json) && (!first))
+						out << ',';
+					DumpChannel(out, c, json);
+					first = false;
 				}
-				data << "</modulelist><channellist>";
-
-				for (chan_hash::const_iterator a = ServerInstance->chanlist->begin(); a != ServerInstance->chanlist->end(); ++a)
+				else
 				{
-					Channel* c = a->second;
-
-					data << "<channel>";
-					data << "<usercount>" << c->GetUsers()->size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
-					data << "<channeltopic>";
-					data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
-					data << "<setby>" << Sanitize(c->setby) << "</setby>";
-					data << "<settime>" << c->topicset << "</settime>";
-					data << "</channeltopic>";
-					data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
-					const UserMembList* ulist = c->GetUsers();
-
-					for (UserMembCIter x = ulist->begin(); x != ulist->end(); ++x)
-					{
-						Membership* memb = x->second;
-						data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
-							<< Sanitize(memb->GetAllPrefixChars()) << "</privs><modes>"
-							<< memb->modes << "</modes>";
-						DumpMeta(data, memb);
-						data << "</channelmember>";
-					}
-
-					DumpMeta(data, c);
-
-					data << "</channel>";
+					User* u = ServerInstance->FindUUID(item);
+					if ((!u) || (u->quitting))
+						continue;
+					if ((json) && (!first))
+						out << ',';
+					DumpUser(out, u, json);
+					first = false;
 				}
+			}
 
-				data << "</channellist><userlist>";
+			data.append(out.str());
+			return (current < sections.size());
+		}
+	};
+}
 
-				for (user_hash::const_iterator a = ServerInstance->Users->clientlist->begin(); a != ServerInstance->Users->clientlist->end(); ++a)
-				{
-					User* u = a->second;
-
-					data << "<user>";
-					data << "<nickname>" << u->nick << "</nickname><uuid>" << u->uuid << "</uuid><realhost>"
-						<< u->host << "</realhost><displayhost>" << u->dhost << "</displayhost><gecos>"
-						<< Sanitize(u->fullname) << "</gecos><server>" << u->server << "</server>";
-					if (u->IsAway())
-						data << "<away>" << Sanitize(u->awaymsg) << "</away><awaytime>" << u->awaytime << "</awaytime>";
-					if (u->IsOper())
-						data << "<opertype>" << Sanitize(u->oper->name) << "</opertype>";
-					data << "<modes>" << u->FormatModes() << "</modes><ident>" << Sanitize(u->ident) << "</ident>";
-					LocalUser* lu = IS_LOCAL(u);
-					if (lu)
-						data << "<port>" << lu->GetServerPort() << "</port><servaddr>"
-							<< lu->server_sa.str() << "</servaddr>";
-					data << "<ipaddress>" << u->GetIPString() << "</ipaddress>";
-
-					DumpMeta(data, u);
-
-					data << "</user>";
-				}
+class ModuleHttpStats : public Module
+{
+	HTTPdAPI API;
 
-				data << "</userlist><serverlist>";
+	/** Number of channels or users streamed per main loop iteration */
+	unsigned int batch;
 
-				ProtocolInterface::ServerList sl;
-				ServerInstance->PI->GetServerList(sl);
+ public:
+	ModuleHttpStats()
+		: API(this)
+	{
+	}
 
-				for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
-				{
-					data << "<server>";
-					data << "<servername>" << b->servername << "</servername>";
-					data << "<parentname>" << b->parentname << "</parentname>";
-					data << "<gecos>" << b->gecos << "</gecos>";
-					data << "<usercount>" << b->usercount << "</usercount>";
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("httpstats");
+		batch = tag->getInt("batch", 100, 1, 100000);
+	}
+
+	void SendStream(HTTPRequest& http, StatsStream* stream, bool json)
+	{
+		/* Send the document back to m_httpd */
+		HTTPDocumentResponse response(this, http, stream, 200);
+		response.headers.SetHeader("X-Powered-By", MODNAME);
+		response.headers.SetHeader("Content-Type", json ? "application/json" : "text/xml");
+		API->SendResponse(response);
+	}
+
+	void SendStats(HTTPRequest& http)
+	{
+		std::stringstream data("");
+
+		data << "<inspircdstats><server><name>" << ServerInstance->Config->ServerName << "</name><gecos>"
+			<< Sanitize(ServerInstance->Config->ServerDesc) << "</gecos><version>"
+			<< Sanitize(ServerInstance->GetVersionString()) << "</version></server>";
+
+		data << "<general>";
+		data << "<usercount>" << ServerInstance->Users->clientlist->size() << "</usercount>";
+		data << "<channelcount>" << ServerInstance->chanlist->size() << "</channelcount>";
+		data << "<opercount>" << ServerInstance->Users->all_opers.size() << "</opercount>";
+		data << "<socketcount>" << (SocketEngine::GetUsedFds()) << "</socketcount><socketmax>" << SocketEngine::GetMaxFds() << "</socketmax><socketengine>" INSPIRCD_SOCKETENGINE_NAME "</socketengine>";
+
+		time_t current_time = 0;
+		current_time = ServerInstance->Time();
+		time_t server_uptime = current_time - ServerInstance->startup_time;
+		struct tm* stime;
+		stime = gmtime(&server_uptime);
+		data << "<uptime><days>" << stime->tm_yday << "</days><hours>" << stime->tm_hour << "</hours><mins>" << stime->tm_min << "</mins><secs>" << stime->tm_sec << "</secs><boot_time_t>" << ServerInstance->startup_time << "</boot_time_t></uptime>";
+
+		data << "<isupport>";
+		const std::vector<std::string>& isupport = ServerInstance->ISupport.GetLines();
+		for (std::vector<std::string>::const_iterator it = isupport.begin(); it != isupport.end(); it++)
+		{
+			data << Sanitize(*it) << std::endl;
+		}
+		data << "</isupport></general><xlines>";
+		std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
+		for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
+		{
+			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
+
+			if (!lookup)
+				continue;
+			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
+			{
+				data << "<xline type=\"" << it->c_str() << "\"><mask>"
+					<< Sanitize(i->second->Displayable()) << "</mask><settime>"
+					<< i->second->set_time << "</settime><duration>" << i->second->duration
+					<< "</duration><reason>" << Sanitize(i->second->reason)
+					<< "</reason></xline>";
+			}
+		}
+
+		data << "</xlines><modulelist>";
+		const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+
+		for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+		{
+			Version v = i->second->GetVersion();
+			data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
+		}
+		data << "</modulelist><channellist>";
+
+		// Channels and users are sent a batch at a time, everything else is small enough to build now
+		StatsStream* stream = new StatsStream(false, batch);
+		std::vector<std::string>& chans = stream->AddSection(data.str(), StatsStream::ITEM_CHANNEL);
+		chans.reserve(ServerInstance->chanlist->size());
+		for (chan_hash::const_iterator a = ServerInstance->chanlist->begin(); a != ServerInstance->chanlist->end(); ++a)
+			chans.push_back(a->second->name);
+
+		std::vector<std::string>& users = stream->AddSection("</channellist><userlist>", StatsStream::ITEM_USER);
+		users.reserve(ServerInstance->Users->clientlist->size());
+		for (user_hash::const_iterator a = ServerInstance->Users->clientlist->begin(); a != ServerInstance->Users->clientlist->end(); ++a)
+			users.push_back(a->second->uuid);
+
+		data.str("");
+		data << "</userlist><serverlist>";
+
+		ProtocolInterface::ServerList sl;
+		ServerInstance->PI->GetServerList(sl);
+
+		for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
+		{
+			data << "<server>";
+			data << "<servername>" << b->servername << "</servername>";
+			data << "<parentname>" << b->parentname << "</parentname>";
+			data << "<gecos>" << b->gecos << "</gecos>";
+			data << "<usercount>" << b->usercount << "</usercount>";
 // This is currently not implemented, so, commented out.
-//					data << "<opercount>" << b->opercount << "</opercount>";
-					data << "<lagmillisecs>" << b->latencyms << "</lagmillisecs>";
-					data << "</server>";
-				}
+//			data << "<opercount>" << b->opercount << "</opercount>";
+			data << "<lagmillisecs>" << b->latencyms << "</lagmillisecs>";
+			data << "</server>";
+		}
+
+		data << "</serverlist></inspircdstats>";
+		stream->AddSection(data.str());
 
-				data << "</serverlist></inspircdstats>";
+		SendStream(http, stream, false);
+	}
 
-				/* Send the document back to m_httpd */
-				HTTPDocumentResponse response(this, *http, &data, 200);
-				response.headers.SetHeader("X-Powered-By", MODNAME);
-				response.headers.SetHeader("Content-Type", "text/xml");
-				API->SendResponse(response);
+	/** Send a page of the user or channel list, in UUID or channel name order
+	 */
+	void SendList(HTTPRequest& http, StatsStream::ItemType type, QueryParams& params)
+	{
+		const bool json = (params["format"] == "json");
+		const long offset = std::max(ConvToInt(params["offset"]), 0L);
+		const long limit = params.count("limit") ? std::max(ConvToInt(params["limit"]), 0L) : LONG_MAX;
+		const std::string& server = params["server"];
+		const char* listname = (type == StatsStream::ITEM_USER ? "users" : "channels");
+
+		std::vector<std::string> items;
+		if (type == StatsStream::ITEM_USER)
+		{
+			const user_hash& clients = *ServerInstance->Users->clientlist;
+			items.reserve(clients.size());
+			for (user_hash::const_iterator i = clients.begin(); i != clients.end(); ++i)
+			{
+				User* u = i->second;
+				if ((server.empty()) || (InspIRCd::Match(u->server->GetName(), server)))
+					items.push_back(u->uuid);
 			}
 		}
+		else
+		{
+			items.reserve(ServerInstance->chanlist->size());
+			for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+				items.push_back(i->second->name);
+		}
+
+		const size_t total = items.size();
+		SelectPage(items, offset, limit);
+
+		std::stringstream data;
+		if (json)
+			data << "{\"total\":" << total << ",\"offset\":" << offset << ",\"" << listname << "\":[";
+		else
+			data << "<inspircdstats><" << listname << " total=\"" << total << "\" offset=\"" << offset << "\">";
+
+		StatsStream* stream = new StatsStream(json, batch);
+		stream->AddSection(data.str(), type).swap(items);
+		stream->AddSection(json ? "]}" : std::string("</") + listname + "></inspircdstats>");
+
+		SendStream(http, stream, json);
+	}
+
+	void OnEvent(Event& event) CXX11_OVERRIDE
+	{
+		if (event.id == "httpd_url")
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd event");
+			HTTPRequest* http = (HTTPRequest*)&event;
+
+			std::string path;
+			QueryParams params;
+			ParseURI(http->GetURI(), path, params);
+
+			if ((path == "/stats") || (path == "/stats/"))
+				SendStats(*http);
+			else if (path == "/stats/users")
+				SendList(*http, StatsStream::ITEM_USER, params);
+			else if (path == "/stats/channels")
+				SendList(*http, StatsStream::ITEM_CHANNEL, params);
+		}
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -240,16 +577,4 @@ class ModuleHttpStats : public Module
 	}
 };
 
-static std::map<char, char const*> const &init_entities()
-{
-	static std::map<char, char const*> entities;
-	entities['<'] = "lt";
-	entities['>'] = "gt";
-	entities['&'] = "amp";
-	entities['"'] = "quot";
-	return entities;
-}
-
-std::map<char, char const*> const &ModuleHttpStats::entities = init_entities ();
-
 MODULE_INIT(ModuleHttpStats)
@@ -59,6 +59,13 @@ class ModuleNamesX : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	ModResult OnNamesListCacheKey(User* issuer, Channel* chan, std::string& key) CXX11_OVERRIDE
+	{
+		if (cap.ext.get(issuer))
+			key.append(" NAMESX");
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
 	{
 		if (!cap.ext.get(issuer))
@@ -0,0 +1,744 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include "main.h"
+#include "treesocket.h"
+#include "commandbuilder.h"
+
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+#include <iostream>
+#endif
+
+/* Binary encoding of server to server lines, used after BURST when both sides sent BINARY=2
+ * in CAPAB CAPABILITIES. Lines are still built as text (e.g. by CmdBuilder) and split into
+ * the same fields TreeSocket::Split() would produce, so a line means exactly the same thing
+ * in both encodings.
+ *
+ * Every line is sent as a frame: the length of the frame body as a varint, then the body.
+ * The body holds the prefix (empty if there is none), the command and the parameters, each
+ * starting with a type byte. Frames with fields which could not be sent as text in the same
+ * place, such as a parameter other than the last one containing a space, are invalid.
+ * The types are:
+ *  0x00-0x7F  a string of that many bytes follows
+ *  0x80       a longer string, its length as a varint and the bytes
+ *  0x81       a UUID, packed into 6 bytes (base 36, most significant byte first)
+ *  0x82       a SID, packed into 2 bytes
+ *  0x83       a decimal number without leading zeroes, such as a TS, as a varint
+ *  0x84       a command, one byte indexing the command table below
+ *  0x85       the member list of an FJOIN: a varint holding the number of members times
+ *             two, plus one if the list ends with a space, then for every member the
+ *             length of its modes as a varint, the modes and its packed UUID
+ * Varints hold 7 bits per byte, least significant first, the high bit is set on all but the last byte.
+ */
+namespace
+{
+	enum FieldType
+	{
+		FIELD_STRING = 0x80,
+		FIELD_UUID,
+		FIELD_SID,
+		FIELD_NUMBER,
+		FIELD_COMMAND,
+		FIELD_MEMBERS
+	};
+
+	/** Frames with a longer body are refused */
+	const size_t MAX_FRAME = 65536;
+
+	/** Commands which are sent as a single byte. This table is part of the protocol, entries
+	 * must never be moved or removed; a different table needs a different BINARY value in CAPAB.
+	 */
+	const char* const commands[] = {
+		"UID", "FJOIN", "FMODE", "METADATA", "OPERTYPE", "AWAY", "FTOPIC", "SERVER",
+		"VERSION", "BURST", "ENDBURST", "PRIVMSG", "NOTICE", "QUIT", "PART", "NICK",
+		"MODE", "PING", "PONG", "ADDLINE", "DELLINE", "IJOIN", "RESYNC", "ENCAP",
+		"KICK", "TOPIC", "SQUIT", "FHOST", "FIDENT", "FNAME", "SAVE", "KILL",
+		"IDLE", "PUSH", "INVITE", "SVSNICK", "SVSJOIN", "SVSPART", "ERROR", "SNONOTICE"
+	};
+	const size_t command_count = sizeof(commands) / sizeof(commands[0]);
+
+	const char base36[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+	/** Packed UUIDs and SIDs are below these values as their first character is a digit */
+	const uint64_t UUID_LIMIT = static_cast<uint64_t>(10) * 36 * 36 * 36 * 36 * 36 * 36 * 36 * 36;
+	const uint64_t SID_LIMIT = 10 * 36 * 36;
+
+	unsigned char GetCommandIndex(const irc::string_view& field)
+	{
+		const std::string command(field.data(), field.length());
+		static std::map<std::string, unsigned char> indexes;
+		if (indexes.empty())
+		{
+			for (size_t i = 0; i < command_count; ++i)
+				indexes[commands[i]] = i;
+		}
+
+		std::map<std::string, unsigned char>::const_iterator it = indexes.find(command);
+		return (it != indexes.end() ? it->second : command_count);
+	}
+
+	/** Pack a UUID or SID of the given length into an integer
+	 * @return True if the string is a valid UUID or SID
+	 */
+	bool PackID(const irc::string_view& id, size_t length, uint64_t& value)
+	{
+		if ((id.length() != length) || (!isdigit(id[0])))
+			return false;
+
+		value = 0;
+		for (size_t i = 0; i < id.length(); ++i)
+		{
+			const char c = id[i];
+			if ((c >= '0') && (c <= '9'))
+				value = (value * 36) + (c - '0');
+			else if ((c >= 'A') && (c <= 'Z'))
+				value = (value * 36) + (c - 'A' + 10);
+			else
+				return false;
+		}
+		return true;
+	}
+
+	std::string UnpackID(uint64_t value, size_t length)
+	{
+		std::string id(length, '0');
+		for (size_t i = length; i-- > 0; value /= 36)
+			id[i] = base36[value % 36];
+		return id;
+	}
+
+	/** Parse a decimal number which survives the trip through a varint unchanged
+	 * @return True if the string is such a number
+	 */
+	bool ParseNumber(const irc::string_view& str, uint64_t& value)
+	{
+		if ((str.empty()) || (str.length() > 19) || ((str[0] == '0') && (str.length() > 1)))
+			return false;
+
+		value = 0;
+		for (size_t i = 0; i < str.length(); ++i)
+		{
+			if ((str[i] < '0') || (str[i] > '9'))
+				return false;
+			value = (value * 10) + (str[i] - '0');
+		}
+		return true;
+	}
+
+	std::string FormatNumber(uint64_t value)
+	{
+		char buf[20];
+		char* p = buf + sizeof(buf);
+		do
+		{
+			*--p = '0' + (value % 10);
+			value /= 10;
+		} while (value);
+		return std::string(p, buf + sizeof(buf) - p);
+	}
+
+	void AppendVarint(std::string& out, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+			value >>= 7;
+		}
+		out.push_back(static_cast<char>(value));
+	}
+
+	void AppendPacked(std::string& out, uint64_t value, size_t bytes)
+	{
+		while (bytes-- > 0)
+			out.push_back(static_cast<char>((value >> (bytes * 8)) & 0xFF));
+	}
+
+	void AppendField(std::string& out, const irc::string_view& field)
+	{
+		uint64_t value;
+		if (ParseNumber(field, value))
+		{
+			out.push_back(static_cast<char>(FIELD_NUMBER));
+			AppendVarint(out, value);
+		}
+		else if (PackID(field, UIDGenerator::UUID_LENGTH, value))
+		{
+			out.push_back(static_cast<char>(FIELD_UUID));
+			AppendPacked(out, value, 6);
+		}
+		else if (PackID(field, 3, value))
+		{
+			out.push_back(static_cast<char>(FIELD_SID));
+			AppendPacked(out, value, 2);
+		}
+		else
+		{
+			if (field.length() < 0x80)
+			{
+				out.push_back(static_cast<char>(field.length()));
+			}
+			else
+			{
+				out.push_back(static_cast<char>(FIELD_STRING));
+				AppendVarint(out, field.length());
+			}
+			out.append(field.data(), field.length());
+		}
+	}
+
+	/** Pack the member list of an FJOIN, "modes,UUID" entries separated by single spaces
+	 * @return True if the list was packed, false if it has to be sent as a string
+	 */
+	bool AppendMembers(std::string& out, const irc::string_view& field)
+	{
+		std::string packed;
+		uint64_t count = 0;
+		size_t pos = 0;
+		while (pos < field.length())
+		{
+			const size_t comma = field.find(',', pos);
+			if (comma == std::string::npos)
+				return false;
+
+			uint64_t uuid;
+			if (!PackID(field.substr(comma + 1, UIDGenerator::UUID_LENGTH), UIDGenerator::UUID_LENGTH, uuid))
+				return false;
+
+			// Entries must be separated by exactly one space for the list to decode to the same text
+			const irc::string_view modes = field.substr(pos, comma - pos);
+			if (modes.find(' ') != std::string::npos)
+				return false;
+
+			pos = comma + 1 + UIDGenerator::UUID_LENGTH;
+			if ((pos < field.length()) && (field[pos++] != ' '))
+				return false;
+
+			AppendVarint(packed, modes.length());
+			packed.append(modes.data(), modes.length());
+			AppendPacked(packed, uuid, 6);
+			count++;
+		}
+
+		if (!count)
+			return false;
+
+		out.push_back(static_cast<char>(FIELD_MEMBERS));
+		AppendVarint(out, (count * 2) + (field[field.length() - 1] == ' ' ? 1 : 0));
+		out.append(packed);
+		return true;
+	}
+
+	/** Encode a parameter of a command
+	 * @param command The command the parameter belongs to
+	 * @param index The position of the parameter, 0 for the first one
+	 */
+	void AppendParameter(std::string& out, const irc::string_view& command, size_t index, const irc::string_view& field)
+	{
+		// The member list of an FJOIN makes up most of a netburst
+		if ((index == 3) && (irc::string_view("FJOIN") == command) && (AppendMembers(out, field)))
+			return;
+		AppendField(out, field);
+	}
+
+	void AppendCommand(std::string& out, const irc::string_view& command)
+	{
+		unsigned char index = GetCommandIndex(command);
+		if (index < command_count)
+		{
+			out.push_back(static_cast<char>(FIELD_COMMAND));
+			out.push_back(static_cast<char>(index));
+		}
+		else
+			AppendField(out, command);
+	}
+
+	/** Reads fields from a frame, all reads fail at the end of the data */
+	class FrameReader
+	{
+		irc::string_view data;
+		size_t pos;
+
+	 public:
+		FrameReader(const irc::string_view& buf) : data(buf), pos(0) { }
+
+		size_t GetPosition() const { return pos; }
+		bool AtEnd() const { return (pos >= data.length()); }
+
+		bool ReadVarint(uint64_t& value)
+		{
+			value = 0;
+			for (unsigned int shift = 0; shift < 64; shift += 7)
+			{
+				if (AtEnd())
+					return false;
+				unsigned char c = data[pos++];
+				value |= static_cast<uint64_t>(c & 0x7F) << shift;
+				if (!(c & 0x80))
+					return true;
+			}
+			return false;
+		}
+
+		bool ReadPacked(size_t bytes, uint64_t& value)
+		{
+			if (data.length() - pos < bytes)
+				return false;
+			value = 0;
+			while (bytes-- > 0)
+				value = (value << 8) | static_cast<unsigned char>(data[pos++]);
+			return true;
+		}
+
+		bool ReadString(uint64_t length, std::string& str)
+		{
+			if (data.length() - pos < length)
+				return false;
+			str.assign(data.data() + pos, length);
+			pos += length;
+			// Same restrictions as for lines of text, which can't contain these
+			return (str.find_first_of(std::string("\0\r\n", 3)) == std::string::npos);
+		}
+
+		bool ReadField(std::string& field)
+		{
+			if (AtEnd())
+				return false;
+
+			uint64_t value;
+			unsigned char type = data[pos++];
+			if (type < 0x80)
+				return ReadString(type, field);
+
+			switch (type)
+			{
+				case FIELD_STRING:
+					return ((ReadVarint(value)) && (ReadString(value, field)));
+				case FIELD_UUID:
+					if ((!ReadPacked(6, value)) || (value >= UUID_LIMIT))
+						return false;
+					field = UnpackID(value, UIDGenerator::UUID_LENGTH);
+					return true;
+				case FIELD_SID:
+					if ((!ReadPacked(2, value)) || (value >= SID_LIMIT))
+						return false;
+					field = UnpackID(value, 3);
+					return true;
+				case FIELD_NUMBER:
+					if (!ReadVarint(value))
+						return false;
+					field = FormatNumber(value);
+					return true;
+				case FIELD_COMMAND:
+					if ((AtEnd()) || (static_cast<unsigned char>(data[pos]) >= command_count))
+						return false;
+					field = commands[static_cast<unsigned char>(data[pos++])];
+					return true;
+				case FIELD_MEMBERS:
+					return ReadMembers(field);
+			}
+			return false;
+		}
+
+		bool ReadMembers(std::string& field)
+		{
+			uint64_t count;
+			if ((!ReadVarint(count)) || (count < 2))
+				return false;
+
+			field.clear();
+			for (uint64_t i = 0; i < count / 2; ++i)
+			{
+				uint64_t length;
+				std::string modes;
+				uint64_t uuid;
+				if ((!ReadVarint(length)) || (!ReadString(length, modes)) || (!ReadPacked(6, uuid)) || (uuid >= UUID_LIMIT))
+					return false;
+
+				// The encoder never produces these, the list would split differently as text
+				if (modes.find_first_of(", ") != std::string::npos)
+					return false;
+
+				if (i)
+					field.push_back(' ');
+				field.append(modes).append(1, ',').append(UnpackID(uuid, UIDGenerator::UUID_LENGTH));
+			}
+
+			if (count & 1)
+				field.push_back(' ');
+			return true;
+		}
+	};
+
+	void AppendFrame(std::string& frame, const std::string& body)
+	{
+		frame.reserve(body.length() + 3);
+		AppendVarint(frame, body.length());
+		frame.append(body);
+	}
+
+	/** Check that a field can be sent as text somewhere other than at the end of a line
+	 */
+	bool IsMiddleField(const std::string& field)
+	{
+		return ((!field.empty()) && (field[0] != ':') && (field.find(' ') == std::string::npos));
+	}
+
+	/** Decode the body of a frame
+	 * @return An empty string if the frame is valid, the reason why it is not otherwise
+	 */
+	std::string DecodeFrame(const irc::string_view& data, std::string& prefix, std::string& command, parameterlist& params)
+	{
+		FrameReader body(data);
+		if ((!body.ReadField(prefix)) || (!body.ReadField(command)) || (!IsMiddleField(command)))
+			return "no command";
+
+		if ((!prefix.empty()) && (!IsMiddleField(prefix)))
+			return "bad prefix for " + command;
+
+		while (!body.AtEnd())
+		{
+			params.push_back(std::string());
+			if (!body.ReadField(params.back()))
+				return "bad field in " + command;
+
+			// Only the last parameter may be empty, contain spaces or start with a colon
+			if ((params.size() > 1) && (!IsMiddleField(params[params.size() - 2])))
+				return "bad parameter in " + command;
+		}
+		return std::string();
+	}
+
+	/** Split a line of text into fields and encode them as a frame
+	 * @return False if the line holds no command
+	 */
+	bool EncodeLine(const std::string& line, std::string& frame)
+	{
+		irc::tokenstream tokens(line);
+		std::string token;
+		if (!tokens.GetToken(token))
+			return false;
+
+		std::string body;
+		if (token[0] == ':')
+		{
+			AppendField(body, token.substr(1));
+			if (!tokens.GetToken(token))
+				return false;
+		}
+		else
+		{
+			// No prefix
+			body.push_back(0);
+		}
+		AppendCommand(body, token);
+
+		const std::string command(token);
+		for (size_t index = 0; tokens.GetToken(token); ++index)
+			AppendParameter(body, command, index, token);
+
+		AppendFrame(frame, body);
+		return true;
+	}
+
+	/** Turn a decoded frame back into text, for the raw log */
+	std::string FormatLine(const std::string& prefix, const std::string& command, const parameterlist& params)
+	{
+		std::string line;
+		if (!prefix.empty())
+			line.append(1, ':').append(prefix).push_back(' ');
+		line.append(command);
+		for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+		{
+			line.push_back(' ');
+			if ((i+1 == params.end()) && ((i->empty()) || ((*i)[0] == ':') || (i->find(' ') != std::string::npos)))
+				line.push_back(':');
+			line.append(*i);
+		}
+		return line;
+	}
+}
+
+void TreeSocket::WriteFrame(const std::string& line)
+{
+	std::string frame;
+	if (EncodeLine(line, frame))
+		this->WriteData(frame);
+}
+
+void TreeSocket::WriteLine(const CmdBuilder& line)
+{
+	if (!binaryout)
+	{
+		WriteLine(line.str());
+		return;
+	}
+
+	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.str().c_str());
+	this->WriteData(line.GetFrame());
+}
+
+void CmdBuilder::Scan() const
+{
+	for (std::string::size_type i = scanned; (i < content.length()) && (!trailing); ++i)
+	{
+		const bool infield = ((!fields.empty()) && (fields.back().second == std::string::npos));
+		if (content[i] == ' ')
+		{
+			if (infield)
+				fields.back().second = i;
+		}
+		else if (!infield)
+		{
+			trailing = ((content[i] == ':') && (!fields.empty()));
+			fields.push_back(FieldPos(trailing ? i + 1 : i, std::string::npos));
+		}
+	}
+	scanned = content.length();
+}
+
+const std::string& CmdBuilder::GetFrame() const
+{
+	if ((!frame.empty()) && (framelength == content.length()))
+		return frame;
+
+	frame.clear();
+	framelength = content.length();
+
+	std::string body;
+	irc::string_view command;
+	size_t index = 0;
+	const std::vector<FieldPos>& linefields = GetFields();
+	for (std::vector<FieldPos>::const_iterator i = linefields.begin(); i != linefields.end(); ++i)
+	{
+		const std::string::size_type end = (i->second == std::string::npos ? content.length() : i->second);
+		irc::string_view field(content.data() + i->first, end - i->first);
+		if (i == linefields.begin())
+		{
+			if (field[0] == ':')
+			{
+				AppendField(body, field.substr(1));
+				continue;
+			}
+			// No prefix
+			body.push_back(0);
+		}
+
+		if (!command.data())
+		{
+			command = field;
+			AppendCommand(body, command);
+		}
+		else
+			AppendParameter(body, command, index++, field);
+	}
+
+	AppendFrame(frame, body);
+	return frame;
+}
+
+bool TreeSocket::GetNextFrame(std::string& prefix, std::string& command, parameterlist& params)
+{
+	irc::string_view pending = GetRecvQ();
+	FrameReader header(pending);
+	uint64_t length;
+	if (!header.ReadVarint(length))
+	{
+		// A varint is at most 10 bytes long
+		if (pending.length() >= 10)
+			SendError("Invalid frame length received");
+		return false;
+	}
+
+	if (length > MAX_FRAME)
+	{
+		SendError("Frame too long (" + ConvToStr(length) + " bytes) received");
+		return false;
+	}
+
+	if (pending.length() - header.GetPosition() < length)
+		return false;
+
+	const std::string reason = DecodeFrame(pending.substr(header.GetPosition(), length), prefix, command, params);
+	if (!reason.empty())
+	{
+		SendError("Invalid frame received: " + reason);
+		return false;
+	}
+
+	ConsumeRecvQ(header.GetPosition() + length);
+
+	if (ServerInstance->Config->RawLog)
+		ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] I %s", this->GetFd(), FormatLine(prefix, command, params).c_str());
+	return true;
+}
+
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+namespace
+{
+	bool TestResult(const std::string& what, bool passed)
+	{
+		std::cout << what << (passed ? " SUCCESS!\n" : " FAILURE\n");
+		return passed;
+	}
+
+	bool TestVarint(uint64_t value)
+	{
+		std::string buf;
+		AppendVarint(buf, value);
+		FrameReader reader(buf);
+		uint64_t result;
+		return TestResult("varint " + ConvToStr(value), ((reader.ReadVarint(result)) && (result == value) && (reader.AtEnd())));
+	}
+
+	/** Check that a field is encoded with the given type and decodes to itself */
+	bool TestField(const std::string& field, unsigned char type)
+	{
+		std::string buf;
+		AppendField(buf, field);
+		FrameReader reader(buf);
+		std::string result;
+		return TestResult("field \"" + field + "\"", ((static_cast<unsigned char>(buf[0]) == type) && (reader.ReadField(result)) && (result == field) && (reader.AtEnd())));
+	}
+
+	bool TestFrame(const CmdBuilder& line, const std::string& prefix, const std::string& command, const parameterlist& params)
+	{
+		std::string frame;
+		EncodeLine(line.str(), frame);
+
+		FrameReader header(line.GetFrame());
+		uint64_t length;
+		std::string fprefix;
+		std::string fcommand;
+		parameterlist fparams;
+		bool passed = ((frame == line.GetFrame()) && (header.ReadVarint(length)) && (length == frame.length() - header.GetPosition()));
+		passed = ((passed) && (DecodeFrame(irc::string_view(frame).substr(header.GetPosition()), fprefix, fcommand, fparams).empty()));
+		return TestResult("frame \"" + line.str() + "\"", ((passed) && (fprefix == prefix) && (fcommand == command) && (fparams == params)));
+	}
+
+	bool TestInvalidFrame(const std::string& what, const std::string& body)
+	{
+		std::string prefix;
+		std::string command;
+		parameterlist params;
+		return TestResult("invalid frame (" + what + ")", !DecodeFrame(body, prefix, command, params).empty());
+	}
+}
+
+bool TreeSocket::TestBinaryEncoding()
+{
+	std::cout << "\n\nBinary server protocol tests\n\n";
+	bool passed = true;
+
+	const uint64_t varints[] = { 0, 1, 127, 128, 16383, 16384, 0xFFFFFFFFULL, 0x100000000ULL, 0xFFFFFFFFFFFFFFFFULL };
+	for (size_t i = 0; i < sizeof(varints) / sizeof(varints[0]); ++i)
+		passed &= TestVarint(varints[i]);
+
+	// Varints longer than 64 bits and truncated ones are refused
+	uint64_t value;
+	passed &= TestResult("overlong varint", !FrameReader(std::string(10, '\xFF') + '\x01').ReadVarint(value));
+	passed &= TestResult("truncated varint", !FrameReader(std::string(1, '\x80')).ReadVarint(value));
+
+	passed &= TestField("000AAAAAA", FIELD_UUID);
+	passed &= TestField("9ZZZZZZZZ", FIELD_UUID);
+	passed &= TestField("000", FIELD_SID);
+	passed &= TestField("9ZZ", FIELD_SID);
+	passed &= TestField("0", FIELD_NUMBER);
+	passed &= TestField("1234567890", FIELD_NUMBER);
+	passed &= TestField("9999999999999999999", FIELD_NUMBER);
+
+	// These must survive as they are, so they are not packed
+	passed &= TestField("A00AAAAAA", 9);
+	passed &= TestField("000aaaaaa", 9);
+	passed &= TestField("9ZZZZZZZZZ", 10);
+	passed &= TestField("0ZZ!", 4);
+	passed &= TestField("0123", 4);
+	passed &= TestField("18446744073709551615", 20);
+	passed &= TestField("", 0);
+	passed &= TestField(std::string(200, 'x'), FIELD_STRING);
+
+	// Packed IDs past the last valid one are refused
+	std::string field;
+	std::string buf(1, static_cast<char>(FIELD_SID));
+	AppendPacked(buf, SID_LIMIT, 2);
+	passed &= TestResult("SID out of range", !FrameReader(buf).ReadField(field));
+	buf.assign(1, static_cast<char>(FIELD_UUID));
+	AppendPacked(buf, UUID_LIMIT, 6);
+	passed &= TestResult("UUID out of range", !FrameReader(buf).ReadField(field));
+
+	parameterlist params;
+	params.push_back("#chan");
+	params.push_back("1234");
+	params.push_back("+nt");
+	params.push_back("o,000AAAAAB");
+	CmdBuilder fjoin("000", "FJOIN");
+	fjoin.push("#chan").push_int(1234).push_raw(" +nt").push_raw(" :o,000AAAAAB");
+	passed &= TestFrame(fjoin, "000", "FJOIN", params);
+	passed &= TestResult("packed member list", (fjoin.GetFrame().find(static_cast<char>(FIELD_MEMBERS)) != std::string::npos));
+
+	// Lines which grow after they were sent are encoded again
+	params.back().append(" ov,000AAAAAC ,000AAAAAD ");
+	fjoin.push_raw(" ov,000AAAAAC ,000AAAAAD ");
+	passed &= TestFrame(fjoin, "000", "FJOIN", params);
+
+	// Member lists which would not decode to the same text are sent as strings
+	const char* const badmembers[] = { "o,000AAAAAB  v,000AAAAAC", " o,000AAAAAB", "o,000AAAAAB,", "o,000aaaaab", "o 000AAAAAB" };
+	for (size_t i = 0; i < sizeof(badmembers) / sizeof(badmembers[0]); ++i)
+	{
+		const std::string members(badmembers[i]);
+		std::string packed;
+		passed &= TestResult("unpacked member list \"" + members + "\"", !AppendMembers(packed, members));
+	}
+
+	params.clear();
+	params.push_back("000AAAAAB");
+	params.push_back("");
+	CmdBuilder empty("000AAAAAA", "PRIVMSG");
+	empty.push("000AAAAAB").push_last("");
+	passed &= TestFrame(empty, "000AAAAAA", "PRIVMSG", params);
+
+	params.clear();
+	params.push_back("#chan");
+	params.push_back(":hello  world ");
+	CmdBuilder privmsg("000AAAAAA", "PRIVMSG");
+	privmsg.push("#chan").push_last(":hello  world ");
+	passed &= TestFrame(privmsg, "000AAAAAA", "PRIVMSG", params);
+
+	params.clear();
+	params.push_back("9ZZ");
+	CmdBuilder ping("PING");
+	ping.push("9ZZ");
+	passed &= TestFrame(ping, ServerInstance->Config->GetSID(), "PING", params);
+
+	passed &= TestInvalidFrame("empty", "");
+	passed &= TestInvalidFrame("no command", std::string(1, '\0'));
+	passed &= TestInvalidFrame("command with space", std::string(1, '\0') + "\x03" "A B");
+	passed &= TestInvalidFrame("prefix with space", "\x03" "A B\x04PING");
+	passed &= TestInvalidFrame("prefix with colon", "\x02:A\x04PING");
+	passed &= TestInvalidFrame("empty middle parameter", std::string(1, '\0') + "\x04PING" + std::string(1, '\0') + "\x01x");
+	passed &= TestInvalidFrame("middle parameter with space", std::string(1, '\0') + "\x04PING\x03" "a b\x01x");
+	passed &= TestInvalidFrame("middle parameter with colon", std::string(1, '\0') + "\x04PING\x02:a\x01x");
+	passed &= TestInvalidFrame("truncated field", std::string(1, '\0') + "\x04PING\x05" "abc");
+	passed &= TestInvalidFrame("line break", std::string(1, '\0') + "\x04PING\x03" "a\nb");
+	passed &= TestInvalidFrame("unknown command", std::string(1, '\0') + "\x84\xFF");
+	passed &= TestInvalidFrame("empty member list", std::string(1, '\0') + "\x84\x01\x85\x00");
+	passed &= TestInvalidFrame("member modes with space", std::string(1, '\0') + "\x84\x01\x85\x02\x02o " + std::string(6, '\0'));
+
+	return passed;
+}
+#endif
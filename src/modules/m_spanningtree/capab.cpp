@@ -135,6 +135,9 @@ void TreeSocket::SendCapabilities(int phase)
 		extra = " CHALLENGE=" + this->GetOurChallenge();
 	}
 
+	if (Utils->BinaryLinks)
+		extra.append(" BINARY=2");
+
 	// 2.0 needs this key
 	if (proto_version == 1202)
 		extra.append(" PROTOCOL="+ConvToStr(ProtocolVersion));
@@ -309,6 +312,10 @@ bool TreeSocket::Capab(const parameterlist &params)
 				reason = "One or more of the user modes on the remote server are invalid on this server.";
 		}
 
+		/* Switch to the binary encoding after BURST only if both sides offered it */
+		std::map<std::string,std::string>::const_iterator binary = this->capab->CapKeys.find("BINARY");
+		binaryproto = ((Utils->BinaryLinks) && (binary != this->capab->CapKeys.end()) && (binary->second == "2"));
+
 		/* Challenge response, store their challenge for our password */
 		std::map<std::string,std::string>::iterator n = this->capab->CapKeys.find("CHALLENGE");
 		if (Utils->ChallengeResponse && (n != this->capab->CapKeys.end()) && (ServerInstance->Modules->Find("m_sha256.so")))
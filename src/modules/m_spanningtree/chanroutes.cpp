@@ -0,0 +1,137 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include "chanroutes.h"
+#include "treeserver.h"
+
+unsigned int ChannelRoutes::Route::CountRanked(unsigned int minrank) const
+{
+	unsigned int count = 0;
+	for (std::map<unsigned int, unsigned int>::const_iterator i = ranks.lower_bound(minrank); i != ranks.end(); ++i)
+		count += i->second;
+	return count;
+}
+
+ChannelRoutes::RouteList::iterator ChannelRoutes::FindRoute(TreeSocket* sock)
+{
+	RouteList::iterator i = routes.begin();
+	while ((i != routes.end()) && (i->sock != sock))
+		++i;
+	return i;
+}
+
+void ChannelRoutes::CountRank(Route& route, unsigned int rank, int change)
+{
+	if (!rank)
+		return;
+
+	std::map<unsigned int, unsigned int>::iterator it = route.ranks.find(rank);
+	if (it == route.ranks.end())
+	{
+		if (change > 0)
+			route.ranks.insert(std::make_pair(rank, change));
+		return;
+	}
+
+	it->second += change;
+	if (!it->second)
+		route.ranks.erase(it);
+}
+
+TreeSocket* ChannelRoutes::GetSocket(User* user)
+{
+	return TreeServer::Get(user)->GetSocket();
+}
+
+void ChannelRoutes::Add(Membership* memb)
+{
+	if (IS_LOCAL(memb->user))
+		return;
+
+	TreeSocket* sock = GetSocket(memb->user);
+	RouteList::iterator route = FindRoute(sock);
+	if (route == routes.end())
+	{
+		routes.push_back(Route(sock));
+		route = routes.end() - 1;
+	}
+
+	route->members++;
+	CountRank(*route, memb->getRank(), 1);
+}
+
+void ChannelRoutes::Remove(Membership* memb)
+{
+	if (IS_LOCAL(memb->user))
+		return;
+
+	RouteList::iterator route = FindRoute(GetSocket(memb->user));
+	if (route == routes.end())
+		return;
+
+	CountRank(*route, memb->getRank(), -1);
+	// Forget links with nobody behind them, the socket may go away
+	if (!--route->members)
+		routes.erase(route);
+}
+
+void ChannelRoutes::UpdateRank(Membership* memb, const std::string& oldmodes)
+{
+	if (IS_LOCAL(memb->user))
+		return;
+
+	// The prefix modes of a member are sorted by rank, Membership::getRank() looks at the first one too
+	PrefixMode* mh = (oldmodes.empty() ? NULL : ServerInstance->Modes->FindPrefixMode(oldmodes[0]));
+	const unsigned int oldrank = (mh ? mh->GetPrefixRank() : 0);
+
+	const unsigned int newrank = memb->getRank();
+	if (oldrank == newrank)
+		return;
+
+	RouteList::iterator route = FindRoute(GetSocket(memb->user));
+	if (route == routes.end())
+		return;
+
+	CountRank(*route, oldrank, -1);
+	CountRank(*route, newrank, 1);
+}
+
+void ChannelRoutes::GetSockets(Channel* chan, unsigned int minrank, const CUList& exempt, std::set<TreeSocket*>& list) const
+{
+	for (RouteList::const_iterator i = routes.begin(); i != routes.end(); ++i)
+	{
+		const Route& route = *i;
+		unsigned int count = (minrank ? route.CountRanked(minrank) : route.members);
+
+		// Members who are exempt don't need the message, so a link which only leads to them can be skipped
+		for (CUList::const_iterator j = exempt.begin(); (count) && (j != exempt.end()); ++j)
+		{
+			User* user = *j;
+			if ((IS_LOCAL(user)) || (GetSocket(user) != route.sock))
+				continue;
+
+			Membership* memb = chan->GetUser(user);
+			if ((memb) && (memb->getRank() >= minrank))
+				count--;
+		}
+
+		if (count)
+			list.insert(route.sock);
+	}
+}
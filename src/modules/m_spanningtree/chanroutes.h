@@ -0,0 +1,95 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+class TreeSocket;
+
+/** Counts the remote members of a channel behind each of our direct links, in
+ * total and by prefix rank, so that a message to the channel or to the members
+ * with a status can be routed without looking at every member. Only remote
+ * members are counted. The ranks are read from the memberships, so they have to
+ * be recounted with UpdateRank() whenever the prefix modes of a member change.
+ */
+class ChannelRoutes
+{
+	/** The members of the channel behind one direct link
+	 */
+	struct Route
+	{
+		/** The link the members are behind */
+		TreeSocket* sock;
+
+		/** Number of members behind the link */
+		unsigned int members;
+
+		/** Number of members behind the link by prefix rank, for ranks above zero */
+		std::map<unsigned int, unsigned int> ranks;
+
+		Route(TreeSocket* s) : sock(s), members(0) { }
+
+		/** Count the members with at least the given rank */
+		unsigned int CountRanked(unsigned int minrank) const;
+	};
+
+	typedef std::vector<Route> RouteList;
+
+	/** The links which have members of this channel behind them. This only
+	 * ever holds a handful of entries, so it is searched linearly.
+	 */
+	RouteList routes;
+
+	/** Find the entry for a link
+	 * @return The entry, or routes.end() if nobody is counted behind the link
+	 */
+	RouteList::iterator FindRoute(TreeSocket* sock);
+
+	/** Adjust the count of members with a rank on a link
+	 */
+	static void CountRank(Route& route, unsigned int rank, int change);
+
+	/** Get the link a remote user is behind
+	 */
+	static TreeSocket* GetSocket(User* user);
+
+ public:
+	/** Count a member which joined the channel
+	 */
+	void Add(Membership* memb);
+
+	/** Stop counting a member which is leaving the channel
+	 */
+	void Remove(Membership* memb);
+
+	/** Recount a member whose prefix modes were changed
+	 * @param memb The member, which already has its new prefix modes
+	 * @param oldmodes The prefix mode letters the member had before the change
+	 */
+	void UpdateRank(Membership* memb, const std::string& oldmodes);
+
+	/** Add the links which lead to members of the channel to a list
+	 * @param chan The channel these are the routes of
+	 * @param minrank Only count members with at least this rank
+	 * @param exempt Members not to count
+	 * @param list The list to add the links to
+	 */
+	void GetSockets(Channel* chan, unsigned int minrank, const CUList& exempt, std::set<TreeSocket*>& list) const;
+
+	/** Check whether no remote members are counted
+	 */
+	bool empty() const { return routes.empty(); }
+};
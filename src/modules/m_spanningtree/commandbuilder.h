@@ -25,26 +25,69 @@ class TreeServer;
 
 class CmdBuilder
 {
+ public:
+	/** Start and end of a field of the line in content, the end is npos if the field
+	 * extends to the end of the line
+	 */
+	typedef std::pair<std::string::size_type, std::string::size_type> FieldPos;
+
+ private:
+	/** The fields of the line: the prefix (with the colon), the command and the parameters,
+	 * split the same way as TreeSocket::Split() would split the line. Only found when the
+	 * line is sent in the binary encoding, see GetFields().
+	 */
+	mutable std::vector<FieldPos> fields;
+
+	/** True if the last field is the trailing parameter, which takes the rest of the line */
+	mutable bool trailing;
+
+	/** Length of the start of the line which has been split into fields */
+	mutable std::string::size_type scanned;
+
+	/** The line in the binary encoding, built on first use */
+	mutable std::string frame;
+
+	/** Length of the line when frame was built */
+	mutable std::string::size_type framelength;
+
+	/** Find the fields in the part of the line which has not been split yet
+	 */
+	void Scan() const;
+
  protected:
 	std::string content;
 
+	/** Remove the end of the line, starting at the given position
+	 */
+	void erase(std::string::size_type pos)
+	{
+		content.erase(pos);
+		frame.clear();
+		if (pos < scanned)
+		{
+			fields.clear();
+			trailing = false;
+			scanned = 0;
+		}
+	}
+
  public:
-	CmdBuilder(const char* cmd)
-		: content(1, ':')
+	explicit CmdBuilder(const char* cmd)
+		: trailing(false), scanned(0), framelength(0), content(1, ':')
 	{
 		content.append(ServerInstance->Config->GetSID());
 		push(cmd);
 	}
 
 	CmdBuilder(const std::string& src, const char* cmd)
-		: content(1, ':')
+		: trailing(false), scanned(0), framelength(0), content(1, ':')
 	{
 		content.append(src);
 		push(cmd);
 	}
 
 	CmdBuilder(User* src, const char* cmd)
-		: content(1, ':')
+		: trailing(false), scanned(0), framelength(0), content(1, ':')
 	{
 		content.append(src->uuid);
 		push(cmd);
@@ -118,6 +161,20 @@ class CmdBuilder
 	const std::string& str() const { return content; }
 	operator const std::string&() const { return str(); }
 
+	/** Get the fields of the line, as TreeSocket::Split() would split it. The line is
+	 * only split when this is first called, and again only if it changed since.
+	 */
+	const std::vector<FieldPos>& GetFields() const
+	{
+		Scan();
+		return fields;
+	}
+
+	/** Get the line in the binary encoding used on server links. It is encoded once,
+	 * no matter how many links it is sent to.
+	 */
+	const std::string& GetFrame() const;
+
 	void Broadcast() const
 	{
 		Utils->DoOneToMany(*this);
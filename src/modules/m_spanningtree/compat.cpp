@@ -171,6 +171,11 @@ void TreeSocket::WriteLine(const std::string& original_line)
 				}
 			}
 			ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
+			if (binaryout)
+			{
+				WriteFrame(line);
+				return;
+			}
 			this->WriteData(line);
 			this->WriteData(newline);
 			return;
@@ -178,6 +183,11 @@ void TreeSocket::WriteLine(const std::string& original_line)
 	}
 
 	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), original_line.c_str());
+	if (binaryout)
+	{
+		WriteFrame(original_line);
+		return;
+	}
 	this->WriteData(original_line);
 	this->WriteData(newline);
 }
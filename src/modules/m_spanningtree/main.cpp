@@ -35,6 +35,10 @@
 #include "commands.h"
 #include "protocolinterface.h"
 
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+#include <iostream>
+#endif
+
 ModuleSpanningTree::ModuleSpanningTree()
 	: rconnect(this), rsquit(this), map(this)
 	, commands(NULL), DNS(this, "DNS")
@@ -493,7 +497,10 @@ void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by
 {
 	// Only do this for local users
 	if (!IS_LOCAL(memb->user))
+	{
+		Utils->chanroutes[memb->chan].Add(memb);
 		return;
+	}
 
 	if (created_by_local)
 	{
@@ -551,6 +558,8 @@ void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage,
 			params.push_last(partmessage);
 		params.Broadcast();
 	}
+	else
+		RemoveRoute(memb);
 }
 
 void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const std::string &oper_message)
@@ -577,6 +586,13 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 
 	// Regardless, We need to modify the user Counts..
 	TreeServer::Get(user)->UserCount--;
+
+	// The user is removed from their channels without any further events
+	if (!IS_LOCAL(user))
+	{
+		for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+			RemoveRoute(*i);
+	}
 }
 
 void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
@@ -606,6 +622,9 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	if (!IS_LOCAL(memb->user))
+		RemoveRoute(memb);
+
 	if ((!IS_LOCAL(source)) && (source != ServerInstance->FakeClient))
 		return;
 
@@ -616,6 +635,94 @@ void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::s
 	params.Broadcast();
 }
 
+void ModuleSpanningTree::RemoveRoute(Membership* memb)
+{
+	chanroute_hash::iterator it = Utils->chanroutes.find(memb->chan);
+	if (it == Utils->chanroutes.end())
+		return;
+
+	it->second.Remove(memb);
+	if (it->second.empty())
+		Utils->chanroutes.erase(it);
+}
+
+void ModuleSpanningTree::OnMode(User* user, User* usertarget, Channel* chantarget, const std::vector<std::string>& modes, const std::vector<TranslateType>& translate)
+{
+	if (!chantarget)
+		return;
+
+	chanroute_hash::iterator it = Utils->chanroutes.find(chantarget);
+	if (it == Utils->chanroutes.end())
+		return;
+
+	// Find the prefix modes which were changed on remote members, in the order they were applied
+	std::vector<std::pair<Membership*, std::pair<PrefixMode*, bool> > > changes;
+	bool adding = true;
+	unsigned int param = 1;
+	const std::string& modestr = modes[0];
+	for (std::string::const_iterator i = modestr.begin(); (i != modestr.end()) && (param < modes.size()); ++i)
+	{
+		if ((*i == '+') || (*i == '-'))
+		{
+			adding = (*i == '+');
+			continue;
+		}
+
+		ModeHandler* mh = ServerInstance->Modes->FindMode(*i, MODETYPE_CHANNEL);
+		if ((!mh) || (!mh->GetNumParams(adding)))
+			continue;
+
+		const std::string& nick = modes[param++];
+		PrefixMode* pm = mh->IsPrefixMode();
+		if (!pm)
+			continue;
+
+		User* target = ServerInstance->FindNick(nick);
+		Membership* memb = (target ? chantarget->GetUser(target) : NULL);
+		if ((memb) && (!IS_LOCAL(target)))
+			changes.push_back(std::make_pair(memb, std::make_pair(pm, adding)));
+	}
+
+	// Undo the changes, last first, to get the prefix modes each member had before
+	std::map<Membership*, std::string> oldmodes;
+	for (size_t i = changes.size(); i-- > 0; )
+	{
+		Membership* memb = changes[i].first;
+		std::map<Membership*, std::string>::iterator old = oldmodes.find(memb);
+		if (old == oldmodes.end())
+			old = oldmodes.insert(std::make_pair(memb, memb->modes)).first;
+
+		PrefixMode* pm = changes[i].second.first;
+		std::string& prefixes = old->second;
+		if (changes[i].second.second)
+		{
+			const std::string::size_type pos = prefixes.find(pm->GetModeChar());
+			if (pos != std::string::npos)
+				prefixes.erase(pos, 1);
+		}
+		else if (prefixes.find(pm->GetModeChar()) == std::string::npos)
+		{
+			// Keep the list sorted by rank like Membership::SetPrefix() does
+			std::string::iterator pos = prefixes.begin();
+			for (; pos != prefixes.end(); ++pos)
+			{
+				PrefixMode* other = ServerInstance->Modes->FindPrefixMode(*pos);
+				if ((other) && (other->GetPrefixRank() <= pm->GetPrefixRank()))
+					break;
+			}
+			prefixes.insert(pos, pm->GetModeChar());
+		}
+	}
+
+	for (std::map<Membership*, std::string>::const_iterator i = oldmodes.begin(); i != oldmodes.end(); ++i)
+		it->second.UpdateRank(i->first, i->second);
+}
+
+void ModuleSpanningTree::OnChannelDelete(Channel* chan)
+{
+	Utils->chanroutes.erase(chan);
+}
+
 void ModuleSpanningTree::OnPreRehash(User* user, const std::string &parameter)
 {
 	if (loopCall)
@@ -735,6 +842,13 @@ ModResult ModuleSpanningTree::OnSetAway(User* user, const std::string &awaymsg)
 	return MOD_RES_PASSTHRU;
 }
 
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+void ModuleSpanningTree::OnRunTestSuite()
+{
+	std::cout << (TreeSocket::TestBinaryEncoding() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+}
+#endif
+
 CullResult ModuleSpanningTree::cull()
 {
 	if (Utils)
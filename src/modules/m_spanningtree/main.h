@@ -63,6 +63,10 @@ class ModuleSpanningTree : public Module
 	 */
 	SpanningTreeCommands* commands;
 
+	/** Stop counting a remote member in the routes of its channel
+	 */
+	void RemoveRoute(Membership* memb);
+
  public:
 	dynamic_reference<DNS::Manager> DNS;
 
@@ -158,6 +162,8 @@ class ModuleSpanningTree : public Module
 	void OnUserQuit(User* user, const std::string &reason, const std::string &oper_message) CXX11_OVERRIDE;
 	void OnUserPostNick(User* user, const std::string &oldnick) CXX11_OVERRIDE;
 	void OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts) CXX11_OVERRIDE;
+	void OnMode(User* user, User* usertarget, Channel* chantarget, const std::vector<std::string>& modes, const std::vector<TranslateType>& translate) CXX11_OVERRIDE;
+	void OnChannelDelete(Channel* chan) CXX11_OVERRIDE;
 	void OnPreRehash(User* user, const std::string &parameter) CXX11_OVERRIDE;
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE;
 	void OnOper(User* user, const std::string &opertype) CXX11_OVERRIDE;
@@ -170,6 +176,9 @@ class ModuleSpanningTree : public Module
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
 	ModResult OnAcceptConnection(int newsock, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE;
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE;
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+	void OnRunTestSuite() CXX11_OVERRIDE;
+#endif
 	CullResult cull();
 	~ModuleSpanningTree();
 	Version GetVersion() CXX11_OVERRIDE;
@@ -61,7 +61,7 @@ class FModeBuilder : public CmdBuilder
 	 */
 	void clear()
 	{
-		content.erase(startpos);
+		erase(startpos);
 		params.clear();
 		modes = 0;
 	}
@@ -92,8 +92,60 @@ class FModeBuilder : public CmdBuilder
 
 struct TreeSocket::BurstState
 {
+	/** Parts of a netburst which are sent in slices, in the order they are sent
+	 */
+	enum Phase
+	{
+		PHASE_USERS,
+		PHASE_CHANNELS
+	};
+
 	SpanningTreeProtocolInterface::Server server;
-	BurstState(TreeSocket* sock) : server(sock) { }
+
+	/** The part of the netburst being sent
+	 */
+	Phase phase;
+
+	/** UUIDs of the users or names of the channels to send in this phase. Users and channels
+	 * which are gone by the time their turn comes are skipped.
+	 */
+	std::vector<std::string> items;
+
+	/** Index of the next item to send
+	 */
+	size_t pos;
+
+	/** Time the netburst started
+	 */
+	time_t started;
+
+	/** Number of slices the netburst was sent in so far
+	 */
+	unsigned long slices;
+
+	/** Largest size the sendq reached during the netburst
+	 */
+	size_t peaksendq;
+
+	/** Longest time in milliseconds spent queueing a single slice, during which nothing else is processed
+	 */
+	unsigned long maxslicetime;
+
+	BurstState(TreeSocket* sock)
+		: server(sock), phase(PHASE_USERS), pos(0), started(ServerInstance->Time()), slices(0), peaksendq(0), maxslicetime(0)
+	{
+	}
+
+	/** Record how long a slice which started at the given time took
+	 */
+	void EndSlice(uint64_t slicestart)
+	{
+		// The time is only updated once per main loop iteration, which the slice is part of
+		ServerInstance->UpdateTime();
+		const uint64_t now = Timer::GetTimeMs();
+		if (now > slicestart)
+			maxslicetime = std::max(maxslicetime, static_cast<unsigned long>(now - slicestart));
+	}
 };
 
 /** This function is called when we want to send a netburst to a local
@@ -109,22 +161,109 @@ void TreeSocket::DoBurst(TreeServer* s)
 		capab->auth_challenge ? "challenge-response" : "plaintext password");
 	this->CleanNegotiationInfo();
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " BURST " + ConvToStr(ServerInstance->Time()));
+	/* everything after BURST is sent in the binary encoding if both sides offered it */
+	binaryout = binaryproto;
 	/* send our version string */
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " VERSION :"+ServerInstance->GetVersionString());
 	/* Send server tree */
 	this->SendServers(Utils->TreeRoot, s);
 
-	BurstState bs(this);
-	/* Send users and their oper status */
-	this->SendUsers(bs);
+	/* Users which register from now on are introduced to the server by the usual UID broadcast */
+	StopBurst();
+	burst = new BurstState(this);
+	const user_hash& users = *ServerInstance->Users->clientlist;
+	burst->items.reserve(users.size());
+	for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if (i->second->registered == REG_ALL)
+			burst->items.push_back(i->second->uuid);
+	}
+
+	this->ContinueBurst();
+}
+
+void TreeSocket::ContinueBurst()
+{
+	const uint64_t slicestart = Timer::GetTimeMs();
+	const size_t limit = getSendQSize() + Utils->BurstSlice;
+	burst->slices++;
+	while (getSendQSize() < limit)
+	{
+		// Nothing more can be sent on a link which has failed, don't keep the burst around until it is culled
+		if ((!getError().empty()) || (LinkState == DYING))
+		{
+			StopBurst();
+			return;
+		}
+
+		if (burst->pos < burst->items.size())
+		{
+			const std::string& item = burst->items[burst->pos++];
+			if (burst->phase == BurstState::PHASE_USERS)
+			{
+				User* user = ServerInstance->FindUUID(item);
+				if ((user) && (!user->quitting))
+					SendUser(user, *burst);
+			}
+			else
+			{
+				Channel* chan = ServerInstance->FindChan(item);
+				if (chan)
+					SyncChannel(chan, *burst);
+			}
+			continue;
+		}
+
+		if (burst->phase == BurstState::PHASE_USERS)
+		{
+			/* All users the server may find on a channel are known to it now, channels
+			 * created from now on are introduced by the usual FJOIN broadcast
+			 */
+			burst->phase = BurstState::PHASE_CHANNELS;
+			burst->items.clear();
+			burst->items.reserve(ServerInstance->chanlist->size());
+			for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+				burst->items.push_back(i->first);
+			burst->pos = 0;
+			continue;
+		}
+
+		this->SendXLines();
+		FOREACH_MOD(OnSyncNetwork, (burst->server));
+		this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
+		burst->EndSlice(slicestart);
+		ServerInstance->SNO->WriteToSnoMask('l', "Finished bursting to \2%s\2 (%lu seconds, %lu slices, longest slice %lu ms, peak sendq %lu bytes).",
+			MyRoot->GetName().c_str(), (unsigned long)(ServerInstance->Time() - burst->started), burst->slices,
+			burst->maxslicetime, (unsigned long)std::max(burst->peaksendq, getSendQSize()));
+		StopBurst();
+		return;
+	}
 
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
-		SyncChannel(i->second, bs);
+	// A module may have closed the link while the last item was sent
+	if (!burst)
+		return;
 
-	this->SendXLines();
-	FOREACH_MOD(OnSyncNetwork, (bs.server));
-	this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ s->GetName()+"\2.");
+	burst->peaksendq = std::max(burst->peaksendq, getSendQSize());
+	burst->EndSlice(slicestart);
+}
+
+void TreeSocket::StopBurst()
+{
+	delete burst;
+	burst = NULL;
+}
+
+void TreeSocket::DoWrite()
+{
+	BufferedSocket::DoWrite();
+	if (!burst)
+		return;
+
+	if ((!getError().empty()) || (LinkState == DYING))
+		StopBurst();
+	// Send more of the netburst once the server has taken most of what was sent so far
+	else if (getSendQSize() <= Utils->BurstSendQ)
+		ContinueBurst();
 }
 
 /** Recursively send the server tree.
@@ -266,33 +405,25 @@ void TreeSocket::SyncChannel(Channel* chan)
 	SyncChannel(chan, bs);
 }
 
-/** send all users and their oper state/modes */
-void TreeSocket::SendUsers(BurstState& bs)
+/** Send a user and their oper state, away state and metadata */
+void TreeSocket::SendUser(User* user, BurstState& bs)
 {
-	ProtocolInterface::Server& piserver = bs.server;
-	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
-	{
-		User* user = u->second;
-		if (user->registered != REG_ALL)
-			continue;
+	this->WriteLine(CommandUID::Builder(user));
 
-		this->WriteLine(CommandUID::Builder(user));
+	if (user->IsOper())
+		this->WriteLine(CommandOpertype::Builder(user));
 
-		if (user->IsOper())
-			this->WriteLine(CommandOpertype::Builder(user));
+	if (user->IsAway())
+		this->WriteLine(CommandAway::Builder(user));
 
-		if (user->IsAway())
-			this->WriteLine(CommandAway::Builder(user));
-
-		const Extensible::ExtensibleStore& exts = user->GetExtList();
-		for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
-		{
-			ExtensionItem* item = i->first;
-			std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-			if (!value.empty())
-				this->WriteLine(CommandMetadata::Builder(user, item->name, value));
-		}
-
-		FOREACH_MOD(OnSyncUser, (user, piserver));
+	const Extensible::ExtensibleStore& exts = user->GetExtList();
+	for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, user, i->second);
+		if (!value.empty())
+			this->WriteLine(CommandMetadata::Builder(user, item->name, value));
 	}
+
+	FOREACH_MOD(OnSyncUser, (user, bs.server));
 }
@@ -99,6 +99,10 @@ class TreeSocket : public BufferedSocket
 	bool LastPingWasGood;			/* Responded to last ping we sent? */
 	int proto_version;			/* Remote protocol version */
 	bool ConnectionFailureShown; /* Set to true if a connection failure message was shown */
+	BurstState* burst;			/* Progress of the netburst we are sending, NULL if not bursting */
+	bool binaryproto;			/* Both sides offered the binary encoding in CAPAB */
+	bool binaryin;				/* Lines from the server are binary frames (after their BURST) */
+	bool binaryout;				/* Lines to the server are sent as binary frames (after our BURST) */
 
 	/** Checks if the given servername and sid are both free
 	 */
@@ -111,8 +115,26 @@ class TreeSocket : public BufferedSocket
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan, BurstState& bs);
 
-	/** Send all users and their oper state, away state and metadata */
-	void SendUsers(BurstState& bs);
+	/** Send a user and their oper state, away state and metadata */
+	void SendUser(User* user, BurstState& bs);
+
+	/** Send the next part of the netburst, at most Utils->BurstSlice bytes.
+	 * The rest is sent from DoWrite() once the sendq has drained below Utils->BurstSendQ.
+	 */
+	void ContinueBurst();
+
+	/** Stop sending the netburst and free its state
+	 */
+	void StopBurst();
+
+	/** Encode a line in the binary encoding and queue it
+	 */
+	void WriteFrame(const std::string& line);
+
+	/** Decode the next binary frame from the recvq
+	 * @return True if a complete frame was read, false if more data is needed or the frame was invalid
+	 */
+	bool GetNextFrame(std::string& prefix, std::string& command, parameterlist& params);
 
  public:
 	const time_t age;
@@ -236,9 +258,18 @@ class TreeSocket : public BufferedSocket
 	 * server. There is a set order we must do this, because for example
 	 * users require their servers to exist, and channels require their
 	 * users to exist. You get the idea.
+	 * Only the servers are sent right away, users, channels and X-lines
+	 * follow in slices from DoWrite() so a large burst does not stall the
+	 * server or fill the sendq. Changes made to the network in the meantime
+	 * are sent to the server as usual; changes to users and channels it
+	 * does not know yet are ignored there and reach it with the burst.
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Write the sendq to the socket and continue the netburst if there is room
+	 */
+	void DoWrite() CXX11_OVERRIDE;
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -248,6 +279,10 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(const std::string& line);
 
+	/** Send a line down the socket, in the binary encoding if it is in use
+	 */
+	void WriteLine(const CmdBuilder& line);
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
@@ -267,6 +302,10 @@ class TreeSocket : public BufferedSocket
 	 */
 	void ProcessLine(std::string &line);
 
+	/** Process a line which has already been split into its parts
+	 */
+	void ProcessLine(std::string& prefix, std::string& command, parameterlist& params);
+
 	void ProcessConnectedLine(std::string& prefix, std::string& command, parameterlist& params);
 
 	/** Handle socket timeout from connect()
@@ -283,4 +322,11 @@ class TreeSocket : public BufferedSocket
 	/** Fixes messages coming from old servers so the new command handlers understand them
 	 */
 	bool PreProcessOldProtocolMessage(User*& who, std::string& cmd, std::vector<std::string>& params);
+
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+	/** Check that lines survive the binary encoding unchanged and that invalid frames are refused
+	 * @return True if all tests passed
+	 */
+	static bool TestBinaryEncoding();
+#endif
 };
@@ -38,7 +38,7 @@
  */
 TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const std::string& ipaddr)
 	: linkID(assign(link->Name)), LinkState(CONNECTING), MyRoot(NULL), proto_version(0), ConnectionFailureShown(false)
-	, age(ServerInstance->Time())
+	, burst(NULL), binaryproto(false), binaryin(false), binaryout(false), age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->link = link;
@@ -57,7 +57,8 @@ TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const std::string& ipaddr)
 TreeSocket::TreeSocket(int newfd, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 	: BufferedSocket(newfd)
 	, linkID("inbound from " + client->addr()), LinkState(WAIT_AUTH_1), MyRoot(NULL), proto_version(0)
-	, ConnectionFailureShown(false), age(ServerInstance->Time())
+	, ConnectionFailureShown(false), burst(NULL), binaryproto(false), binaryin(false), binaryout(false)
+	, age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->capab_phase = 0;
@@ -94,6 +95,7 @@ CullResult TreeSocket::cull()
 TreeSocket::~TreeSocket()
 {
 	delete capab;
+	StopBurst();
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -128,6 +130,7 @@ void TreeSocket::OnError(BufferedSocketError e)
 	ServerInstance->SNO->WriteGlobalSno('l', "Connection to '\002%s\002' failed with error: %s",
 		linkID.c_str(), getError().c_str());
 	LinkState = DYING;
+	StopBurst();
 }
 
 void TreeSocket::SendError(const std::string &errormessage)
@@ -136,6 +139,7 @@ void TreeSocket::SendError(const std::string &errormessage)
 	DoWrite();
 	LinkState = DYING;
 	SetError(errormessage);
+	StopBurst();
 }
 
 /** This function forces this server to quit, removing this server
@@ -239,22 +243,36 @@ CmdResult CommandSQuit::HandleServer(TreeServer* server, std::vector<std::string
 void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
-	std::string line;
-	while (GetNextLine(line))
+	irc::string_view rawline;
+	while (true)
 	{
-		std::string::size_type rline = line.find('\r');
-		if (rline != std::string::npos)
-			line = line.substr(0,rline);
-		if (line.find('\0') != std::string::npos)
+		// The server switches to binary frames after its BURST line, which may be in the middle of the recvq
+		if (binaryin)
 		{
-			SendError("Read null character from socket");
-			break;
+			std::string prefix;
+			std::string command;
+			parameterlist params;
+			if (!GetNextFrame(prefix, command, params))
+				break;
+			ProcessLine(prefix, command, params);
+		}
+		else
+		{
+			if (!GetNextLine(rawline))
+				break;
+			rawline = rawline.substr(0, rawline.find('\r'));
+			if (rawline.find('\0') != std::string::npos)
+			{
+				SendError("Read null character from socket");
+				break;
+			}
+			std::string line(rawline.data(), rawline.length());
+			ProcessLine(line);
 		}
-		ProcessLine(line);
 		if (!getError().empty())
 			break;
 	}
-	if (LinkState != CONNECTED && recvq.length() > 4096)
+	if (LinkState != CONNECTED && getRecvQSize() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
 }
@@ -88,6 +88,11 @@ void TreeSocket::ProcessLine(std::string &line)
 	if (command.empty())
 		return;
 
+	ProcessLine(prefix, command, params);
+}
+
+void TreeSocket::ProcessLine(std::string& prefix, std::string& command, parameterlist& params)
+{
 	switch (this->LinkState)
 	{
 		case WAIT_AUTH_1:
@@ -178,6 +183,7 @@ void TreeSocket::ProcessLine(std::string &line)
 
 				MyRoot->bursting = true;
 				this->DoBurst(MyRoot);
+				binaryin = binaryproto;
 
 				CommandServer::Builder(MyRoot).Forward(MyRoot);
 				CmdBuilder(MyRoot->GetID(), "BURST").insert(params).Forward(MyRoot);
@@ -219,6 +225,8 @@ void TreeSocket::ProcessLine(std::string &line)
 			 *  Credentials have been exchanged, we've gotten their 'BURST' (or sent ours).
 			 *  Anything from here on should be accepted a little more reasonably.
 			 */
+			if ((binaryproto) && (!binaryin) && (command == "BURST") && ((prefix.empty()) || (prefix == MyRoot->GetID())))
+				binaryin = true;
 			this->ProcessConnectedLine(prefix, command, params);
 		break;
 		case DYING:
@@ -364,6 +372,7 @@ void TreeSocket::Close()
 		ServerInstance->GlobalCulls.AddItem(this);
 	this->BufferedSocket::Close();
 	SetError("Remote host closed connection");
+	StopBurst();
 
 	// Connection closed.
 	// If the connection is fully up (state CONNECTED)
@@ -166,29 +166,13 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 			minrank = mh->GetPrefixRank();
 	}
 
-	const UserMembList *ulist = c->GetUsers();
-
-	for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			continue;
-
-		if (minrank && i->second->getRank() < minrank)
-			continue;
-
-		if (exempt_list.find(i->first) == exempt_list.end())
-		{
-			TreeServer* best = TreeServer::Get(i->first);
-			list.insert(best->GetSocket());
-		}
-	}
-	return;
+	chanroute_hash::const_iterator routes = chanroutes.find(c);
+	if (routes != chanroutes.end())
+		routes->second.GetSockets(c, minrank, exempt_list, list);
 }
 
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
 {
-	const std::string& FullLine = params.str();
-
 	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
 	{
@@ -196,7 +180,7 @@ void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeSe
 		// Send the line if the route isn't the path to the one to be omitted
 		if (Route != omitroute)
 		{
-			Route->GetSocket()->WriteLine(FullLine);
+			Route->GetSocket()->WriteLine(params);
 		}
 	}
 }
@@ -260,7 +244,11 @@ void SpanningTreeUtilities::ReadConfiguration()
 	AnnounceTSChange = options->getBool("announcets");
 	AllowOptCommon = options->getBool("allowmismatch");
 	ChallengeResponse = !security->getBool("disablehmac");
-	quiet_bursts = ServerInstance->Config->ConfValue("performance")->getBool("quietbursts");
+	ConfigTag* performance = ServerInstance->Config->ConfValue("performance");
+	quiet_bursts = performance->getBool("quietbursts");
+	BurstSlice = performance->getInt("burstslice", 64 * 1024, 1024);
+	BurstSendQ = performance->getInt("burstsendq", 256 * 1024, 0);
+	BinaryLinks = performance->getBool("binarylinks");
 	PingWarnTime = options->getInt("pingwarning");
 	PingFreq = options->getInt("serverpingfreq");
 
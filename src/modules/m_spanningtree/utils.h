@@ -24,6 +24,7 @@
 
 #include "inspircd.h"
 #include "cachetimer.h"
+#include "chanroutes.h"
 
 /* Foward declarations */
 class TreeServer;
@@ -41,6 +42,10 @@ extern SpanningTreeUtilities* Utils;
  */
 typedef TR1NS::unordered_map<std::string, TreeServer*, irc::insensitive, irc::StrHashComp> server_hash;
 
+/* This hash_map holds the links which lead to the remote members of each channel.
+ */
+typedef TR1NS::unordered_map<Channel*, ChannelRoutes> chanroute_hash;
+
 /** Contains helper functions and variables for this module,
  * and keeps them out of the global namespace
  */
@@ -74,6 +79,18 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool quiet_bursts;
 
+	/** Number of bytes of netburst to queue on a link at once
+	 */
+	unsigned long BurstSlice;
+
+	/** Size of the sendq of a link below which more of the netburst is queued
+	 */
+	unsigned long BurstSendQ;
+
+	/** Offer the binary encoding to other servers, used after BURST if they offer it too
+	 */
+	bool BinaryLinks;
+
 	/* Number of seconds that a server can go without ping
 	 * before opers are warned of high latency.
 	 */
@@ -90,6 +107,9 @@ class SpanningTreeUtilities : public classbase
 	/** Hash of currently known server ids
 	 */
 	server_hash sidlist;
+	/** Hash of the links leading to the remote members of each channel
+	 */
+	chanroute_hash chanroutes;
 	/** List of all outgoing sockets and their timeouts
 	 */
 	TimeoutList timeoutlist;
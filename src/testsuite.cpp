@@ -24,6 +24,7 @@
 #include "inspircd.h"
 #include "testsuite.h"
 #include "threadengine.h"
+#include "xline.h"
 #include <iostream>
 
 class TestSuiteThread : public Thread
@@ -64,6 +65,8 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Channel membership benchmark\n";
+		std::cout << "(A) XLine index tests\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -111,6 +114,12 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoMembershipBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoXLineIndexTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -395,6 +404,163 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+/* Print the time taken by a benchmark step since start */
+static void ReportTime(const char* step, clock_t start)
+{
+	std::cout << step << ": " << ((clock() - start) * 1000 / CLOCKS_PER_SEC) << " ms\n";
+}
+
+bool TestSuite::DoMembershipBenchmark()
+{
+	const unsigned int USER_COUNT = 50000;
+	const unsigned int BROADCAST_COUNT = 1000;
+	std::cout << "\n\nChannel membership benchmark with " << USER_COUNT << " members\n\n";
+
+	// Remote users are used so that broadcasts walk the member list without writing to sockets
+	UIDGenerator uidgen;
+	uidgen.init("9ZZ");
+	std::vector<User*> users;
+	for (unsigned int i = 0; i < USER_COUNT; i++)
+		users.push_back(new RemoteUser(uidgen.GetUID(), ServerInstance->FakeClient->server));
+
+	Channel* chan = new Channel("#membership-benchmark", ServerInstance->Time());
+	bool passed = true;
+
+	clock_t start = clock();
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+		chan->AddUser(*i);
+	ReportTime("Join", start);
+
+	if (chan->GetUserCounter() != (long)USER_COUNT)
+	{
+		std::cout << "MEMBERSHIP: Channel has " << chan->GetUserCounter() << " members instead of " << USER_COUNT << std::endl;
+		passed = false;
+	}
+
+	start = clock();
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if (!chan->HasUser(*i))
+		{
+			std::cout << "MEMBERSHIP: User " << (*i)->uuid << " is not on the channel" << std::endl;
+			passed = false;
+			break;
+		}
+	}
+	ReportTime("Lookup", start);
+
+	start = clock();
+	CUList except_list;
+	for (unsigned int i = 0; i < BROADCAST_COUNT; i++)
+	{
+		chan->WriteChannelWithServ("", "NOTICE #membership-benchmark :benchmark");
+		chan->RawWriteAllExcept(ServerInstance->FakeClient, true, '@', except_list, "NOTICE @#membership-benchmark :benchmark");
+	}
+	ReportTime("Broadcast", start);
+
+	// Leave in a different order than the users joined in
+	start = clock();
+	for (unsigned int i = 0; i < USER_COUNT; i++)
+		chan->DelUser(users[(i * 7919) % USER_COUNT]);
+	ReportTime("Part", start);
+
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		ServerInstance->Users->uuidlist->erase((*i)->uuid);
+		delete *i;
+	}
+
+	// The last DelUser() destroyed the channel
+	ServerInstance->GlobalCulls.Apply();
+	return passed;
+}
+
+/* Look up the candidates for a host and IP and compare them to the expected lines, given by position in lines */
+static bool CheckCandidates(const XLineIndex& index, const std::vector<XLine*>& lines, const std::string& host, const std::string& ip, const std::string& expected)
+{
+	irc::sockets::sockaddrs sa;
+	irc::sockets::aptosa(ip, 0, sa);
+	std::vector<XLineIndex::Entry> candidates;
+	index.FindCandidates(host, ip, sa, candidates);
+
+	std::string found;
+	for (std::vector<XLineIndex::Entry>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		if (!found.empty())
+			found.push_back(',');
+		found.append(ConvToStr(std::find(lines.begin(), lines.end(), i->second) - lines.begin()));
+	}
+
+	const bool passed = (found == expected);
+	std::cout << "candidates(" << host << ", " << ip << ") = \"" << found << "\"" << (passed ? " SUCCESS!\n" : " FAILURE\n");
+	return passed;
+}
+
+bool TestSuite::DoXLineIndexTests()
+{
+	std::cout << "\n\nXLine index tests\n\n";
+
+	const char* const masks[] = {
+		"192.0.2.1", "192.0.2.0/24", "*.example.com", "host.example.com",
+		"2001:db8::/32", "192.0.2.1", "192.0.0.0/16", "*@192.0.2.1",
+		"host[1].example.com"
+	};
+	std::vector<XLine*> lines;
+	XLineIndex index;
+	for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); ++i)
+	{
+		lines.push_back(new GLine(0, 0, "test", "test", "*", masks[i]));
+		index.Add(lines.back());
+	}
+
+	bool passed = true;
+
+	// Exact masks and CIDR ranges, in the order the lines were added
+	passed &= CheckCandidates(index, lines, "192.0.2.1", "192.0.2.1", "0,1,5,6");
+	passed &= CheckCandidates(index, lines, "host.example.com", "192.0.2.77", "1,3,6");
+	passed &= CheckCandidates(index, lines, "HOST.Example.COM", "192.0.3.1", "3,6");
+	passed &= CheckCandidates(index, lines, "2001:db8::1", "2001:db8::1", "4");
+	passed &= CheckCandidates(index, lines, "192.0.2.200", "198.51.100.1", "1,6");
+	passed &= CheckCandidates(index, lines, "other.example.net", "198.51.100.1", "");
+
+	// Lines which can't be indexed, including masks which case mappings fold differently, are checked against everyone
+	passed &= CheckCandidates(index, lines, "host{1}.example.com", "198.51.100.1", "");
+	const XLineIndex::LineMap& wildcards = index.GetWildcards();
+	if ((wildcards.size() != 3) || (wildcards.begin()->second != lines[2]) || (wildcards.rbegin()->second != lines[8]))
+	{
+		std::cout << "XLINEINDEX: Wrong lines in the wildcard list" << std::endl;
+		passed = false;
+	}
+
+	// Removing lines takes them out of every lookup, a line added again goes to the back
+	index.Remove(lines[0]);
+	index.Remove(lines[1]);
+	index.Remove(lines[2]);
+	passed &= CheckCandidates(index, lines, "192.0.2.1", "192.0.2.1", "5,6");
+	index.Add(lines[1]);
+	passed &= CheckCandidates(index, lines, "192.0.2.1", "192.0.2.1", "5,6,1");
+	if (wildcards.size() != 2)
+	{
+		std::cout << "XLINEINDEX: Removed line is still in the wildcard list" << std::endl;
+		passed = false;
+	}
+
+	// Removing a line which is not in the index does nothing
+	index.Remove(lines[0]);
+	for (std::vector<XLine*>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+		index.Remove(*i);
+	passed &= CheckCandidates(index, lines, "192.0.2.1", "192.0.2.1", "");
+	if (!index.empty())
+	{
+		std::cout << "XLINEINDEX: Index is not empty after removing every line" << std::endl;
+		passed = false;
+	}
+
+	for (std::vector<XLine*>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+		delete *i;
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
@@ -23,11 +23,43 @@
 #include "inspircd.h"
 #include "timer.h"
 
+namespace
+{
+	/** Value of TimerManager::nextdue when no timers are pending */
+	const uint64_t NEVER = static_cast<uint64_t>(-1);
+}
+
+uint64_t Timer::GetTimeMs()
+{
+	return static_cast<uint64_t>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+}
+
+Timer::Timer(unsigned int secs_from_now, time_t now, bool repeating)
+	: trigger((static_cast<uint64_t>(now) + secs_from_now) * 1000)
+	, interval(static_cast<uint64_t>(secs_from_now) * 1000)
+	, repeat(repeating)
+	, deadline(0)
+	, slot(NULL)
+	, prev(NULL)
+	, next(NULL)
+{
+	/* Keep the fraction of the current second so the timer fires exactly
+	 * secs_from_now seconds from now rather than on a second boundary.
+	 */
+	if (now == ServerInstance->Time())
+		trigger += ServerInstance->Time_ns() / 1000000;
+}
+
 void Timer::SetInterval(time_t newinterval)
+{
+	SetIntervalMs(static_cast<uint64_t>(newinterval) * 1000);
+}
+
+void Timer::SetIntervalMs(uint64_t newinterval)
 {
 	ServerInstance->Timers->DelTimer(this);
-	secs = newinterval;
-	SetTrigger(ServerInstance->Time() + newinterval);
+	interval = newinterval;
+	trigger = GetTimeMs() + newinterval;
 	ServerInstance->Timers->AddTimer(this);
 }
 
@@ -36,42 +68,196 @@ Timer::~Timer()
 	ServerInstance->Timers->DelTimer(this);
 }
 
-void TimerManager::TickTimers(time_t TIME)
+TimerManager::TimerManager()
+	: overflow(NULL)
+	, firstlevelcount(0)
+	, current(0)
+	, wheelnow(0)
+	, lastwall(0)
+	, nextdue(NEVER)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	memset(wheel, 0, sizeof(wheel));
+}
+
+void TimerManager::SyncClock()
+{
+	const uint64_t wall = Timer::GetTimeMs();
+	if ((lastwall) && (wall > lastwall))
+		wheelnow += wall - lastwall;
+	lastwall = wall;
+}
+
+void TimerManager::Insert(Timer* t)
+{
+	const uint64_t due = std::max(t->deadline, current);
+
+	Timer** head = &overflow;
+	if ((due >> WHEEL_BITS) == (current >> WHEEL_BITS))
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
-			break;
+		head = &wheel[0][due & WHEEL_MASK];
+		firstlevelcount++;
+	}
+	else
+	{
+		for (unsigned int level = 1; level < WHEEL_LEVELS; level++)
+		{
+			const unsigned int shift = WHEEL_BITS * (level + 1);
+			if ((due >> shift) == (current >> shift))
+			{
+				head = &wheel[level][(due >> (WHEEL_BITS * level)) & WHEEL_MASK];
+				break;
+			}
+		}
+	}
 
-		Timers.erase(i++);
+	t->slot = head;
+	t->prev = NULL;
+	t->next = *head;
+	if (t->next)
+		t->next->prev = t;
+	*head = t;
 
-		if (!t->Tick(TIME))
-			continue;
+	if (due < nextdue)
+		nextdue = due;
+}
+
+void TimerManager::Unlink(Timer* t)
+{
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		*t->slot = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+
+	if ((t->slot >= &wheel[0][0]) && (t->slot < &wheel[0][WHEEL_SIZE]))
+		firstlevelcount--;
+
+	t->slot = NULL;
+	t->prev = t->next = NULL;
+}
+
+void TimerManager::Cascade(unsigned int level)
+{
+	Timer* list;
+	if (level == WHEEL_LEVELS)
+	{
+		list = overflow;
+		overflow = NULL;
+	}
+	else
+	{
+		const unsigned int index = (current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		// The level above wraps first so its timers are spread into this level before it is emptied
+		if (!index)
+			Cascade(level + 1);
+		list = wheel[level][index];
+		wheel[level][index] = NULL;
+	}
+
+	while (list)
+	{
+		Timer* t = list;
+		list = t->next;
+		Insert(t);
+	}
+}
+
+uint64_t TimerManager::FindNextDue() const
+{
+	if (firstlevelcount)
+	{
+		for (uint64_t tick = current; (tick >> WHEEL_BITS) == (current >> WHEEL_BITS); tick++)
+		{
+			if (wheel[0][tick & WHEEL_MASK])
+				return tick;
+		}
+	}
 
-		if (t->GetRepeat())
+	/* Nothing is due in the first level, so the earliest anything can
+	 * become due is when one of the higher levels is cascaded into it.
+	 */
+	for (unsigned int level = 1; level < WHEEL_LEVELS; level++)
+	{
+		const unsigned int shift = WHEEL_BITS * level;
+		const uint64_t block = current >> shift;
+		for (uint64_t slotblock = block; (slotblock >> WHEEL_BITS) == (block >> WHEEL_BITS); slotblock++)
 		{
-			t->SetTrigger(TIME + t->GetInterval());
-			AddTimer(t);
+			if (wheel[level][slotblock & WHEEL_MASK])
+				return std::max(slotblock << shift, current);
 		}
 	}
+
+	if (overflow)
+		return ((current >> (WHEEL_BITS * WHEEL_LEVELS)) + 1) << (WHEEL_BITS * WHEEL_LEVELS);
+	return NEVER;
 }
 
-void TimerManager::DelTimer(Timer* t)
+void TimerManager::TickTimers(time_t TIME)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	SyncClock();
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+	while (current <= wheelnow)
 	{
-		if (i->second == t)
+		if (!(current & WHEEL_MASK))
+			Cascade(1);
+
+		if (!firstlevelcount)
 		{
-			Timers.erase(i);
-			break;
+			// Nothing can become due before the next cascade, skip straight to it
+			current = std::min((current | WHEEL_MASK) + 1, wheelnow + 1);
+			continue;
+		}
+
+		// Advance first so timers added from Tick() never land on the slot being run
+		Timer** head = &wheel[0][current & WHEEL_MASK];
+		current++;
+
+		while (*head)
+		{
+			Timer* t = *head;
+			Unlink(t);
+
+			if (!t->Tick(TIME))
+				continue;
+
+			if (t->GetRepeat())
+			{
+				t->trigger = Timer::GetTimeMs() + t->interval;
+				AddTimer(t);
+			}
 		}
 	}
+
+	if (nextdue < current)
+		nextdue = FindNextDue();
+}
+
+void TimerManager::DelTimer(Timer* t)
+{
+	if (t->slot)
+		Unlink(t);
 }
 
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	if (t->slot)
+		Unlink(t);
+
+	SyncClock();
+	t->deadline = wheelnow + ((t->trigger > lastwall) ? t->trigger - lastwall : 0);
+	Insert(t);
+}
+
+int TimerManager::GetNextTimeout(int maxwait)
+{
+	SyncClock();
+	if (nextdue < current)
+		nextdue = FindNextDue();
+
+	if (nextdue <= wheelnow)
+		return 0;
+	if (nextdue - wheelnow < static_cast<uint64_t>(maxwait))
+		return nextdue - wheelnow;
+	return maxwait;
 }
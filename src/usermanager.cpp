@@ -82,6 +82,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	ServerInstance->Users->AddGlobalClone(New);
 
 	this->local_users.push_front(New);
+	New->pingtimer.Schedule();
 
 	if ((this->local_users.size() > ServerInstance->Config->SoftLimit) || (this->local_users.size() >= (unsigned int)SocketEngine::GetMaxFds()))
 	{
@@ -270,12 +271,12 @@ void UserManager::ServerNoticeAll(const char* text, ...)
 {
 	std::string message;
 	VAFORMAT(message, text, text);
-	message = "NOTICE $" + ServerInstance->Config->ServerName + " :" + message;
+	const SharedBufferRef line = LocalUser::MakeLine(":" + ServerInstance->Config->ServerName + " NOTICE $" + ServerInstance->Config->ServerName + " :" + message);
 
 	for (LocalUserList::const_iterator i = local_users.begin(); i != local_users.end(); i++)
 	{
-		User* t = *i;
-		t->WriteServ(message);
+		LocalUser* t = *i;
+		t->Write(line);
 	}
 }
 
@@ -300,71 +301,3 @@ bool UserManager::AllModulesReportReady(LocalUser* user)
 	FIRST_MOD_RESULT(OnCheckReady, res, (user));
 	return (res == MOD_RES_PASSTHRU);
 }
-
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the user structs, e.g.
- * stuff like ping checks, registration timeouts, etc.
- */
-void UserManager::DoBackgroundUserStuff()
-{
-	/*
-	 * loop over all local users..
-	 */
-	for (LocalUserList::iterator i = local_users.begin(); i != local_users.end(); ++i)
-	{
-		LocalUser* curr = *i;
-
-		if (curr->quitting)
-			continue;
-
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
-
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (ServerInstance->Time() > curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
-						this->QuitUser(curr, message);
-						continue;
-					}
-
-					curr->Write("PING :" + ServerInstance->Config->ServerName);
-					curr->lastping = 0;
-					curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
-				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
-				}
-				break;
-		}
-
-		if (curr->registered != REG_ALL && (ServerInstance->Time() > (curr->age + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->QuitUser(curr, "Registration timeout");
-			continue;
-		}
-	}
-}
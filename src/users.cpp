@@ -31,6 +31,13 @@
 
 already_sent_t LocalUser::already_sent_id = 0;
 
+namespace
+{
+	/** Privileges checked every time a local user's socket is read from or written to */
+	const PrivilegeID IncreasedBuffersPriv("users/flood/increased-buffers");
+	const PrivilegeID NoFakelagPriv("users/flood/no-fakelag");
+}
+
 bool User::IsNoticeMaskSet(unsigned char sm)
 {
 	if (!isalpha(sm))
@@ -86,6 +93,7 @@ User::User(const std::string& uid, Server* srv, int type)
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL), eh(this),
+	floodtimer(this), pingtimer(this),
 	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
 	already_sent(0)
 {
@@ -97,6 +105,7 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 	memcpy(&client_sa, client, sizeof(irc::sockets::sockaddrs));
 	memcpy(&server_sa, servaddr, sizeof(irc::sockets::sockaddrs));
 	dhost = host = GetIPString();
+	UpdateLimits();
 }
 
 User::~User()
@@ -202,12 +211,7 @@ bool LocalUser::HasPermission(const std::string &command)
 		return false;
 	}
 
-	if (oper->AllowedOperCommands.find(command) != oper->AllowedOperCommands.end())
-		return true;
-	else if (oper->AllowedOperCommands.find("*") != oper->AllowedOperCommands.end())
-		return true;
-
-	return false;
+	return oper->HasCommand(OperInfo::CommandIndex.Find(command));
 }
 
 bool User::HasPrivPermission(const std::string &privstr, bool noisy)
@@ -215,6 +219,11 @@ bool User::HasPrivPermission(const std::string &privstr, bool noisy)
 	return true;
 }
 
+bool User::HasPrivPermission(const PrivilegeID& priv, bool noisy)
+{
+	return true;
+}
+
 bool LocalUser::HasPrivPermission(const std::string &privstr, bool noisy)
 {
 	if (!this->IsOper())
@@ -224,17 +233,29 @@ bool LocalUser::HasPrivPermission(const std::string &privstr, bool noisy)
 		return false;
 	}
 
-	if (oper->AllowedPrivs.find(privstr) != oper->AllowedPrivs.end())
-	{
+	if (oper->HasPriv(OperInfo::PrivIndex.Find(privstr)))
 		return true;
-	}
-	else if (oper->AllowedPrivs.find("*") != oper->AllowedPrivs.end())
+
+	if (noisy)
+		this->WriteNotice("Oper type " + oper->name + " does not have access to priv " + privstr);
+
+	return false;
+}
+
+bool LocalUser::HasPrivPermission(const PrivilegeID& priv, bool noisy)
+{
+	if (!this->IsOper())
 	{
-		return true;
+		if (noisy)
+			this->WriteNotice("You are not an oper");
+		return false;
 	}
 
+	if (oper->HasPriv(priv.GetID()))
+		return true;
+
 	if (noisy)
-		this->WriteNotice("Oper type " + oper->name + " does not have access to priv " + privstr);
+		this->WriteNotice("Oper type " + oper->name + " does not have access to priv " + priv.GetName());
 
 	return false;
 }
@@ -244,76 +265,211 @@ void UserIOHandler::OnDataReady()
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
+	const UserLimits& limits = user->Limits;
+	if (getRecvQSize() > limits.recvqmax)
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ of %lu exceeds connect class maximum of %lu",
-			user->nick.c_str(), (unsigned long)recvq.length(), user->MyClass->GetRecvqMax());
+			user->nick.c_str(), (unsigned long)getRecvQSize(), limits.recvqmax);
 		return;
 	}
-	unsigned long sendqmax = ULONG_MAX;
-	if (!user->HasPrivPermission("users/flood/increased-buffers"))
-		sendqmax = user->MyClass->GetSendqSoftMax();
-	unsigned long penaltymax = ULONG_MAX;
-	if (!user->HasPrivPermission("users/flood/no-fakelag"))
-		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
+	// Read into locals, a command can change the limits
+	const unsigned long sendqmax = limits.softsendqmax;
+	const unsigned long penaltymax = limits.penaltymax;
 
+	// Each line is copied into the same buffer, so its memory is only allocated once per call
+	const std::string::size_type maxline = ServerInstance->Config->Limits.MaxLine - 2;
+	std::string line;
+	line.reserve(ServerInstance->Config->Limits.MaxLine);
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(ServerInstance->Config->Limits.MaxLine);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		// The line is parsed in place; if the recvq runs out before a newline is found, stop
+		irc::string_view rawline;
+		if (!GetNextLine(rawline))
 		{
-			char c = recvq[qpos++];
-			switch (c)
+			if (user->CommandFloodPenalty)
+				user->floodtimer.Schedule();
+			return;
+		}
+
+		// Usually the only character which needs special treatment is the \r at the end
+		irc::string_view text = rawline;
+		if ((!text.empty()) && (text[text.length() - 1] == '\r'))
+			text = text.substr(0, text.length() - 1);
+
+		if ((text.find('\r') == std::string::npos) && (text.find('\0') == std::string::npos))
+		{
+			line.assign(text.data(), std::min(text.length(), maxline));
+		}
+		else
+		{
+			line.clear();
+			for (const char* i = rawline.begin(); i != rawline.end(); ++i)
 			{
-			case '\0':
-				c = ' ';
-				break;
-			case '\r':
-				continue;
-			case '\n':
-				goto eol_found;
+				char c = *i;
+				switch (c)
+				{
+				case '\0':
+					c = ' ';
+					break;
+				case '\r':
+					continue;
+				}
+				if (line.length() < maxline)
+					line.push_back(c);
 			}
-			if (line.length() < ServerInstance->Config->Limits.MaxLine - 2)
-				line.push_back(c);
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
 
 		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats->statsRecv += qpos;
-		user->bytes_in += qpos;
+		ServerInstance->stats->statsRecv += rawline.length() + 1;
+		user->bytes_in += rawline.length() + 1;
 		user->cmds_in++;
 
 		ServerInstance->Parser->ProcessBuffer(line, user);
 		if (user->quitting)
 			return;
 	}
-	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
+
+	// Reading stopped because of the penalty or the sendq, the flood timer tries again later
+	user->floodtimer.Schedule();
+	if (user->CommandFloodPenalty >= penaltymax && !user->Limits.fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+UserFloodTimer::UserFloodTimer(LocalUser* me)
+	: Timer(1, ServerInstance->Time()), user(me), scheduled(false)
 {
-	if (user->quitting_sendq)
+}
+
+void UserFloodTimer::Schedule()
+{
+	if (scheduled)
 		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
-		!user->HasPrivPermission("users/flood/increased-buffers"))
+
+	scheduled = true;
+	SetIntervalMs(1000);
+}
+
+bool UserFloodTimer::Tick(time_t)
+{
+	scheduled = false;
+	if (user->quitting)
+		return true;
+
+	unsigned int rate = user->MyClass->GetCommandRate();
+	if (user->CommandFloodPenalty > rate)
+		user->CommandFloodPenalty -= rate;
+	else
+		user->CommandFloodPenalty = 0;
+
+	// Reschedules the timer if reading has to stop again
+	user->eh.OnDataReady();
+	if (!user->quitting && user->CommandFloodPenalty)
+		Schedule();
+	return true;
+}
+
+UserPingTimer::UserPingTimer(LocalUser* me)
+	: Timer(1, ServerInstance->Time()), user(me)
+{
+}
+
+void UserPingTimer::Schedule()
+{
+	time_t when = ServerInstance->Time() + 1;
+	if ((user->registered == REG_ALL) && (user->nping >= when))
+		when = user->nping + 1;
+
+	SetTrigger(when);
+	ServerInstance->Timers->AddTimer(this);
+}
+
+bool UserPingTimer::Tick(time_t TIME)
+{
+	if (user->quitting)
+		return true;
+
+	switch (user->registered)
+	{
+		case REG_ALL:
+			// Activity of the user moves nping forward, in that case this just reschedules
+			if (TIME > user->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!user->lastping)
+				{
+					time_t time = TIME - (user->nping - user->MyClass->GetPingTime());
+					const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
+					ServerInstance->Users->QuitUser(user, message);
+					return true;
+				}
+
+				user->Write("PING :" + ServerInstance->Config->ServerName);
+				user->lastping = 0;
+				user->nping = TIME + user->MyClass->GetPingTime();
+			}
+			break;
+		case REG_NICKUSER:
+			if (ServerInstance->Users->AllModulesReportReady(user))
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				user->FullConnect();
+				if (!user->quitting)
+					Schedule();
+				return true;
+			}
+			break;
+	}
+
+	if (user->registered != REG_ALL && (TIME > (user->age + user->MyClass->GetRegTimeout())))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		ServerInstance->Users->QuitUser(user, "Registration timeout");
+		return true;
+	}
+
+	Schedule();
+	return true;
+}
+
+bool UserIOHandler::CheckSendQ(size_t len)
+{
+	if (user->quitting_sendq)
+		return false;
+	if (!user->quitting && getSendQSize() + len > user->Limits.hardsendqmax)
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls.AddSQItem(user);
-		return;
+		return false;
 	}
 
 	// We still want to append data to the sendq of a quitting user,
 	// e.g. their ERROR message that says 'closing link'
+	return true;
+}
+
+void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	if (CheckSendQ(data.length()))
+		WriteData(data);
+}
 
-	WriteData(data);
+void UserIOHandler::AddWriteBuf(const SharedBufferRef& data)
+{
+	if (CheckSendQ(data->length()))
+		WriteData(data);
+}
+
+void UserIOHandler::AddWriteLine(const char* line, size_t len)
+{
+	if (CheckSendQ(len + 2))
+	{
+		WriteData(line, len);
+		WriteData("\r\n", 2);
+	}
 }
 
 void UserIOHandler::OnError(BufferedSocketError)
@@ -383,16 +539,40 @@ void User::Oper(OperInfo* info)
 	ServerInstance->Users->all_opers.push_back(this);
 
 	// Expand permissions from config for faster lookup
-	if (IS_LOCAL(this))
+	LocalUser* luser = IS_LOCAL(this);
+	if (luser)
+	{
 		oper->init();
+		luser->UpdateLimits();
+	}
 
 	FOREACH_MOD(OnPostOper, (this, oper->name, opername));
 }
 
+PermissionIndex OperInfo::PrivIndex;
+PermissionIndex OperInfo::CommandIndex;
+
+unsigned int PermissionIndex::GetID(const std::string& name)
+{
+	std::pair<IDMap::iterator, bool> res = ids.insert(std::make_pair(name, ids.size()));
+	return res.first->second;
+}
+
+/** Set the bit of an ID in a permission bit vector, growing it as needed */
+static void SetPermissionBit(std::vector<bool>& bits, unsigned int id)
+{
+	if (id >= bits.size())
+		bits.resize(id + 1);
+	bits[id] = true;
+}
+
 void OperInfo::init()
 {
 	AllowedOperCommands.clear();
 	AllowedPrivs.clear();
+	PrivBits.clear();
+	CommandBits.clear();
+	AllPrivs = AllCommands = false;
 	AllowedUserModes.reset();
 	AllowedChanModes.reset();
 	AllowedUserModes['o' - 'A'] = true; // Call me paranoid if you want.
@@ -406,12 +586,20 @@ void OperInfo::init()
 		while (CommandList.GetToken(mycmd))
 		{
 			AllowedOperCommands.insert(mycmd);
+			if (mycmd == "*")
+				AllCommands = true;
+			else
+				SetPermissionBit(CommandBits, CommandIndex.GetID(mycmd));
 		}
 
 		irc::spacesepstream PrivList(tag->getString("privs"));
 		while (PrivList.GetToken(mypriv))
 		{
 			AllowedPrivs.insert(mypriv);
+			if (mypriv == "*")
+				AllPrivs = true;
+			else
+				SetPermissionBit(PrivBits, PrivIndex.GetID(mypriv));
 		}
 
 		std::string modes = tag->getString("usermodes");
@@ -454,6 +642,9 @@ void User::UnOper()
 	 */
 	oper = NULL;
 
+	LocalUser* luser = IS_LOCAL(this);
+	if (luser)
+		luser->UpdateLimits();
 
 	/* Remove all oper only modes from the user when the deoper - Bug #466*/
 	std::string moderemove("-");
@@ -612,6 +803,10 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+
+	// NAMES lists show the nick and, with UHNAMES, the ident and host
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->chan->InvalidateNamesCache();
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force)
@@ -806,8 +1001,6 @@ void LocalUser::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_elin
 	}
 }
 
-static std::string wide_newline("\r\n");
-
 void User::Write(const std::string& text)
 {
 }
@@ -816,26 +1009,43 @@ void User::Write(const char *text, ...)
 {
 }
 
+SharedBufferRef LocalUser::MakeLine(const std::string& text)
+{
+	// Lines longer than the maximum should happen rarely or never; crop them.
+	std::string line(text, 0, ServerInstance->Config->Limits.MaxLine - 2);
+	line.append("\r\n");
+	return new SharedBuffer(line);
+}
+
 void LocalUser::Write(const std::string& text)
 {
 	if (!SocketEngine::BoundsCheckFd(&eh))
 		return;
 
-	if (text.length() > ServerInstance->Config->Limits.MaxLine - 2)
-	{
-		// this should happen rarely or never. Crop the string at 512 and try again.
-		std::string try_again = text.substr(0, ServerInstance->Config->Limits.MaxLine - 2);
-		Write(try_again);
+	// Lines longer than the maximum should happen rarely or never; crop them.
+	const size_t len = std::min<size_t>(text.length(), ServerInstance->Config->Limits.MaxLine - 2);
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)len, text.c_str());
+
+	// Lines for a single user are copied into the sendq, only lines sent to many users are shared
+	eh.AddWriteLine(text.data(), len);
+
+	ServerInstance->stats->statsSent += len + 2;
+	this->bytes_out += len + 2;
+	this->cmds_out++;
+}
+
+void LocalUser::Write(const SharedBufferRef& line)
+{
+	if (!SocketEngine::BoundsCheckFd(&eh))
 		return;
-	}
 
-	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
+	const std::string& text = line->str();
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)text.length() - 2, text.c_str());
 
-	eh.AddWriteBuf(text);
-	eh.AddWriteBuf(wide_newline);
+	eh.AddWriteBuf(line);
 
-	ServerInstance->stats->statsSent += text.length() + 2;
-	this->bytes_out += text.length() + 2;
+	ServerInstance->stats->statsSent += text.length();
+	this->bytes_out += text.length();
 	this->cmds_out++;
 }
 
@@ -956,6 +1166,9 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 
 	FOREACH_MOD(OnBuildNeighborList, (this, include_c, exceptions));
 
+	// Every recipient gets a reference to the same buffer
+	const SharedBufferRef buffer = LocalUser::MakeLine(line);
+
 	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 	{
 		LocalUser* u = IS_LOCAL(i->first);
@@ -963,7 +1176,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 		{
 			u->already_sent = LocalUser::already_sent_id;
 			if (i->second)
-				u->Write(line);
+				u->Write(buffer);
 		}
 	}
 	for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
@@ -976,7 +1189,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 			if (u && u->already_sent != LocalUser::already_sent_id)
 			{
 				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				u->Write(buffer);
 			}
 		}
 	}
@@ -989,8 +1202,8 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 
 	already_sent_t uniq_id = ++LocalUser::already_sent_id;
 
-	const std::string normalMessage = ":" + this->GetFullHost() + " QUIT :" + normal_text;
-	const std::string operMessage = ":" + this->GetFullHost() + " QUIT :" + oper_text;
+	const SharedBufferRef normalMessage = LocalUser::MakeLine(":" + this->GetFullHost() + " QUIT :" + normal_text);
+	const SharedBufferRef operMessage = LocalUser::MakeLine(":" + this->GetFullHost() + " QUIT :" + oper_text);
 
 	IncludeChanList include_c(chans.begin(), chans.end());
 	std::map<User*,bool> exceptions;
@@ -1067,7 +1280,7 @@ void User::SendText(const std::string& linePrefix, std::stringstream& textStream
  * the first users channels then the second users channels within the outer loop,
  * therefore it was a maximum of x*y iterations (upon returning 0 and checking
  * all possible iterations). However this new function instead checks against the
- * channel's userlist in the inner loop which is a std::map<User*,User*>
+ * channel's userlist in the inner loop which is indexed by User*
  * and saves us time as we already know what pointer value we are after.
  * Don't quote me on the maths as i am not a mathematician or computer scientist,
  * but i believe this algorithm is now x+(log y) maximum iterations instead.
@@ -1148,7 +1361,7 @@ void User::SendAll(const char* command, const char* text, ...)
 {
 	std::string textbuffer;
 	VAFORMAT(textbuffer, text, text);
-	const std::string message = ":" + this->GetFullHost() + " " + command + " $* :" + textbuffer;
+	const SharedBufferRef message = LocalUser::MakeLine(":" + this->GetFullHost() + " " + command + " $* :" + textbuffer);
 
 	for (LocalUserList::const_iterator i = ServerInstance->Users->local_users.begin(); i != ServerInstance->Users->local_users.end(); i++)
 	{
@@ -1185,9 +1398,14 @@ void LocalUser::SetClass(const std::string &explicit_name)
 	}
 	else
 	{
-		for (ClassVector::iterator i = ServerInstance->Config->Classes.begin(); i != ServerInstance->Config->Classes.end(); i++)
+		// The index only rules out the classes whose host mask or port can't match
+		std::vector<size_t> candidates;
+		ServerInstance->Config->ClassIndex.FindCandidates(this, candidates);
+		std::vector<size_t>::const_iterator candidate = candidates.begin();
+
+		for (size_t i = 0; i < ServerInstance->Config->Classes.size(); ++i)
 		{
-			ConnectClass* c = *i;
+			ConnectClass* c = ServerInstance->Config->Classes[i];
 			ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Checking %s", c->GetName().c_str());
 
 			ModResult MOD_RESULT;
@@ -1209,6 +1427,13 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				continue;
 
 			/* check if host matches.. */
+			while ((candidate != candidates.end()) && (*candidate < i))
+				++candidate;
+			if ((candidate == candidates.end()) || (*candidate != i))
+			{
+				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "No host or port match (for %s)", c->GetHost().c_str());
+				continue;
+			}
 			if (!InspIRCd::MatchCIDR(this->GetIPString(), c->GetHost(), NULL) &&
 			    !InspIRCd::MatchCIDR(this->host, c->GetHost(), NULL))
 			{
@@ -1258,9 +1483,23 @@ void LocalUser::SetClass(const std::string &explicit_name)
 	if (found)
 	{
 		MyClass = found;
+		UpdateLimits();
 	}
 }
 
+void LocalUser::UpdateLimits()
+{
+	// A user without a class gets the defaults of ConnectClass, it is about to be disconnected anyway
+	ConnectClass* c = MyClass;
+	const bool increasedbuffers = HasPrivPermission(IncreasedBuffersPriv);
+
+	Limits.recvqmax = increasedbuffers ? ULONG_MAX : (c ? c->GetRecvqMax() : ConnectClass::DEFAULT_RECVQ);
+	Limits.softsendqmax = increasedbuffers ? ULONG_MAX : (c ? c->GetSendqSoftMax() : ConnectClass::DEFAULT_SOFTSENDQ);
+	Limits.hardsendqmax = increasedbuffers ? ULONG_MAX : (c ? c->GetSendqHardMax() : ConnectClass::DEFAULT_HARDSENDQ);
+	Limits.penaltymax = HasPrivPermission(NoFakelagPriv) ? ULONG_MAX : (c ? c->GetPenaltyThreshold() : ConnectClass::DEFAULT_THRESHOLD) * 1000UL;
+	Limits.fakelag = (c ? c->fakelag : true);
+}
+
 void User::PurgeEmptyChannels()
 {
 	// firstly decrement the count on each channel
@@ -141,6 +141,74 @@ bool XLine::Matches(User *u)
 	return false;
 }
 
+namespace
+{
+	/** Check a list of lines against a user
+	 * @param begin The first line to check
+	 * @param end The end of the list of lines
+	 * @param user The user to check the lines against
+	 * @param expired Receives the expired lines which were skipped
+	 * @return The first line which matches the user, or NULL if none do
+	 */
+	template<typename Iter>
+	Iter FindMatch(Iter begin, Iter end, User* user, std::vector<XLine*>& expired)
+	{
+		const time_t current = ServerInstance->Time();
+		for (Iter i = begin; i != end; ++i)
+		{
+			XLine* line = i->second;
+			if (line->duration && current > line->expiry)
+			{
+				if (std::find(expired.begin(), expired.end(), line) == expired.end())
+					expired.push_back(line);
+				continue;
+			}
+
+			if (line->Matches(user))
+				return i;
+		}
+		return end;
+	}
+}
+
+XLineIndex::XLineIndex()
+	: nextordinal(0)
+{
+}
+
+void XLineIndex::Add(XLine* line)
+{
+	const Entry entry(nextordinal++, line);
+	ordinals[line] = entry.first;
+
+	// A mask with a '/' which is not a valid range is left to MatchCIDR() to decide what it matches
+	const std::string& mask = line->GetHostMask();
+	if ((!hosts.IsExactMask(mask)) || (!hosts.Add(mask, entry)))
+		wildcards.insert(entry);
+}
+
+void XLineIndex::Remove(XLine* line)
+{
+	TR1NS::unordered_map<XLine*, unsigned long>::iterator ordinal = ordinals.find(line);
+	if (ordinal == ordinals.end())
+		return;
+	const Entry entry(ordinal->second, line);
+	ordinals.erase(ordinal);
+
+	// Lines which the host index rejected were added to the wildcards instead
+	if (!wildcards.erase(entry.first))
+		hosts.Remove(line->GetHostMask(), entry);
+}
+
+void XLineIndex::FindCandidates(const std::string& host, const std::string& ip, const irc::sockets::sockaddrs& sa, std::vector<Entry>& out) const
+{
+	hosts.Find(host, ip, sa, out);
+
+	// A line may be found both as an exact mask and as a CIDR range
+	std::sort(out.begin(), out.end());
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
 /*
  * Checks what users match a given vector of ELines and sets their ban exempt flag accordingly.
  */
@@ -282,6 +350,7 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable().c_str()] = line;
+	line_index[line->type].Add(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -316,6 +385,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_index[type].Remove(y->second);
 	delete y->second;
 	x->second.erase(y);
 
@@ -344,31 +414,31 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
+	/* Only check the lines which the index says may match, followed by the
+	 * lines which can't be indexed. Of the lines which match, the one which
+	 * was added first wins. Expired lines which are come across are removed
+	 * afterwards so the index isn't changed while it is being used.
+	 */
+	const XLineIndex& index = line_index[type];
+	std::vector<XLineIndex::Entry> candidates;
+	std::vector<XLine*> expired;
+	index.FindCandidates(user, candidates);
 
-	LookupIter safei;
+	std::vector<XLineIndex::Entry>::const_iterator found = FindMatch(candidates.begin(), candidates.end(), user, expired);
+	const XLineIndex::LineMap& wildcards = index.GetWildcards();
+	XLineIndex::LineMap::const_iterator last = (found != candidates.end() ? wildcards.lower_bound(found->first) : wildcards.end());
+	XLineIndex::LineMap::const_iterator wildfound = FindMatch(wildcards.begin(), last, user, expired);
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
-	{
-		safei = i;
-		safei++;
+	XLine* match = NULL;
+	if (wildfound != last)
+		match = wildfound->second;
+	else if (found != candidates.end())
+		match = found->second;
 
-		if (i->second->duration && current > i->second->expiry)
-		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
-			continue;
-		}
+	for (std::vector<XLine*>::const_iterator i = expired.begin(); i != expired.end(); ++i)
+		ExpireLine(x, x->second.find((*i)->Displayable().c_str()));
 
-		if (i->second->Matches(user))
-		{
-			return i->second;
-		}
-
-		i = safei;
-	}
-	return NULL;
+	return match;
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
@@ -422,6 +492,7 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_index[container->first].Remove(item->second);
 	delete item->second;
 	container->second.erase(item);
 }
@@ -430,6 +501,17 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
+	if (pending_lines.empty())
+		return;
+
+	/* Index the pending lines so that each user is only checked against the
+	 * lines which may match them, instead of against every pending line.
+	 */
+	XLineIndex pending;
+	for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); ++i)
+		pending.Add(*i);
+
+	std::vector<XLineIndex::Entry> candidates;
 	LocalUserList& list = ServerInstance->Users->local_users;
 	for (LocalUserList::iterator j = list.begin(); j != list.end(); ++j)
 	{
@@ -439,9 +521,17 @@ void XLineManager::ApplyLines()
 		if (u->exempt)
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		candidates.clear();
+		pending.FindCandidates(u, candidates);
+
+		// Apply the lines in the order they were added
+		const size_t indexed = candidates.size();
+		candidates.insert(candidates.end(), pending.GetWildcards().begin(), pending.GetWildcards().end());
+		std::inplace_merge(candidates.begin(), candidates.begin() + indexed, candidates.end());
+
+		for (std::vector<XLineIndex::Entry>::iterator i = candidates.begin(); i != candidates.end(); ++i)
 		{
-			XLine *x = *i;
+			XLine *x = i->second;
 			if (x->Matches(u))
 				x->Apply(u);
 		}
@@ -695,6 +785,32 @@ void XLine::DisplayExpiry()
 		type.c_str(), (onechar ? "-Line" : ""), Displayable().c_str(), source.c_str(), (long)(ServerInstance->Time() - set_time));
 }
 
+const std::string& XLine::GetHostMask()
+{
+	static const std::string nomask;
+	return nomask;
+}
+
+const std::string& ELine::GetHostMask()
+{
+	return hostmask;
+}
+
+const std::string& KLine::GetHostMask()
+{
+	return hostmask;
+}
+
+const std::string& GLine::GetHostMask()
+{
+	return hostmask;
+}
+
+const std::string& ZLine::GetHostMask()
+{
+	return ipaddr;
+}
+
 const std::string& ELine::Displayable()
 {
 	return matchtext;